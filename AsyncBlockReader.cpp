@@ -0,0 +1,300 @@
+#include "AsyncBlockReader.h"
+#include "BufferArena.h"
+#include "RecoveryStatus.h"
+#include "RunStats.h"
+#include <cerrno>
+#include <cstdlib>
+#include <algorithm>
+#include <cstring>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+// Submission and completion rings of an io_uring instance, set up with raw syscalls
+struct IoUring
+{
+    int fd;
+    void *sqRing;
+    size_t sqRingSize;
+    void *cqRing;
+    size_t cqRingSize;
+    io_uring_sqe *sqes;
+    size_t sqesSize;
+    unsigned *sqTail;
+    unsigned *sqMask;
+    unsigned *sqArray;
+    unsigned *cqHead;
+    unsigned *cqTail;
+    unsigned *cqMask;
+    io_uring_cqe *cqes;
+};
+
+static void destroyRing(IoUring *ring)
+{
+    if (ring->sqes && ring->sqes != MAP_FAILED)
+        munmap(ring->sqes, ring->sqesSize);
+    if (ring->cqRing && ring->cqRing != MAP_FAILED)
+        munmap(ring->cqRing, ring->cqRingSize);
+    if (ring->sqRing && ring->sqRing != MAP_FAILED)
+        munmap(ring->sqRing, ring->sqRingSize);
+    close(ring->fd);
+    delete ring;
+}
+
+/**************************************************************************************
+ * Function: createRing
+ * Description: Sets up an io_uring instance and maps its rings.
+ * Parameters:
+ *    - entries: The number of submission queue entries wanted.
+ * Returns:
+ *    - The ring, or null if io_uring is unavailable (old kernel, seccomp, sysctl).
+ **************************************************************************************/
+static IoUring *createRing(unsigned entries)
+{
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    int fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (fd < 0)
+    {
+        return 0;
+    }
+
+    IoUring *ring = new IoUring();
+    ring->fd = fd;
+    ring->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    ring->sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+
+    ring->sqRing = mmap(0, ring->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    ring->cqRing = mmap(0, ring->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    ring->sqes = static_cast<io_uring_sqe *>(mmap(0, ring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES));
+    if (ring->sqRing == MAP_FAILED || ring->cqRing == MAP_FAILED || ring->sqes == MAP_FAILED)
+    {
+        destroyRing(ring);
+        return 0;
+    }
+
+    char *sq = static_cast<char *>(ring->sqRing);
+    char *cq = static_cast<char *>(ring->cqRing);
+    ring->sqTail = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+    ring->sqMask = reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+    ring->sqArray = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+    ring->cqHead = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+    ring->cqTail = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+    ring->cqMask = reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+    ring->cqes = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+    return ring;
+}
+
+/**************************************************************************************
+ * Function: AsyncBlockReader
+ * Description: Creates a reader that keeps up to queueDepth block reads in flight. It
+ *              uses io_uring when the kernel allows it and falls back to synchronous
+ *              reads otherwise. Memory-mapped devices are read through the mapping with
+ *              read-ahead hints instead.
+ * Parameters:
+ *    - device: The USB device.
+ *    - queueDepth: The maximum number of reads in flight.
+ **************************************************************************************/
+AsyncBlockReader::AsyncBlockReader(const BlockDevice &device, int queueDepth)
+    : device(device), queueDepth(std::max(1, queueDepth)), ring(0), buffers(0)
+{
+    if (device.isMapped())
+    {
+        return;
+    }
+
+    buffers = BufferArena::shared().acquire(static_cast<size_t>(this->queueDepth) * device.blockSize());
+    if (!buffers)
+    {
+        throw RecoveryError(RecoveryStatus::OutOfMemory, "Failed to allocate read buffers.");
+    }
+
+    ring = createRing(this->queueDepth);
+}
+
+AsyncBlockReader::~AsyncBlockReader()
+{
+    if (ring)
+    {
+        destroyRing(ring);
+    }
+    BufferArena::shared().release(buffers, static_cast<size_t>(queueDepth) * device.blockSize());
+}
+
+/**************************************************************************************
+ * Function: readBlocks
+ * Description: Reads a list of blocks and hands each one to the consumer, in list order.
+ * Parameters:
+ *    - blocks: The block numbers to read.
+ *    - consumer: Called once per block with its contents. The data pointer is only
+ *                valid for the duration of the call.
+ **************************************************************************************/
+void AsyncBlockReader::readBlocks(const std::vector<BlockNumber> &blocks, const Consumer &consumer)
+{
+    if (device.isMapped())
+    {
+        readMapped(blocks, consumer);
+    }
+    else if (ring)
+    {
+        readQueued(blocks, consumer);
+    }
+    else
+    {
+        readSynchronous(blocks, consumer);
+    }
+}
+
+void AsyncBlockReader::readMapped(const std::vector<BlockNumber> &blocks, const Consumer &consumer)
+{
+    long pageSize = sysconf(_SC_PAGESIZE);
+
+    for (size_t i = 0; i < blocks.size(); ++i)
+    {
+        // Ask for the block queueDepth positions ahead so page faults overlap the copy
+        if (i + queueDepth < blocks.size())
+        {
+            BlockView ahead = device.block(blocks[i + queueDepth]);
+            if (ahead.size() > 0)
+            {
+                uintptr_t start = reinterpret_cast<uintptr_t>(ahead.data()) & ~(pageSize - 1);
+                madvise(reinterpret_cast<void *>(start), ahead.data() + ahead.size() - reinterpret_cast<char *>(start), MADV_WILLNEED);
+                RunStats::count(RunStats::Syscalls);
+            }
+        }
+
+        BlockView block = device.block(blocks[i]);
+        consumer(blocks[i], block.data(), block.size());
+    }
+}
+
+void AsyncBlockReader::readSynchronous(const std::vector<BlockNumber> &blocks, const Consumer &consumer)
+{
+    int blockSize = device.blockSize();
+    for (size_t i = 0; i < blocks.size(); ++i)
+    {
+        ssize_t bytesRead = device.read(device.offsetOf(blocks[i]), buffers, blockSize);
+        consumer(blocks[i], buffers, bytesRead);
+    }
+}
+
+void AsyncBlockReader::readQueued(const std::vector<BlockNumber> &blocks, const Consumer &consumer)
+{
+    int blockSize = device.blockSize();
+    std::vector<struct iovec> iovecs(queueDepth);
+    std::vector<ssize_t> results(queueDepth);
+    std::vector<bool> done(queueDepth);
+
+    size_t submitted = 0;
+    size_t completed = 0;
+    size_t delivered = 0;
+    unsigned unsubmitted = 0;
+
+    try
+    {
+        while (delivered < blocks.size())
+        {
+            // Fill every free slot; slot i % queueDepth is reused once block i - queueDepth is delivered
+            while (submitted < blocks.size() && submitted < delivered + queueDepth)
+            {
+                int slot = submitted % queueDepth;
+                iovecs[slot].iov_base = buffers + static_cast<size_t>(slot) * blockSize;
+                iovecs[slot].iov_len = blockSize;
+                done[slot] = false;
+
+                unsigned tail = *ring->sqTail;
+                unsigned index = tail & *ring->sqMask;
+                io_uring_sqe *sqe = &ring->sqes[index];
+                memset(sqe, 0, sizeof(*sqe));
+                sqe->opcode = IORING_OP_READV;
+                sqe->fd = device.fd();
+                sqe->addr = reinterpret_cast<uintptr_t>(&iovecs[slot]);
+                sqe->len = 1;
+                sqe->off = device.offsetOf(blocks[submitted]);
+                sqe->user_data = slot;
+                ring->sqArray[index] = index;
+                __atomic_store_n(ring->sqTail, tail + 1, __ATOMIC_RELEASE);
+
+                ++unsubmitted;
+                ++submitted;
+            }
+
+            int head = delivered % queueDepth;
+            if (!done[head])
+            {
+                int ret = syscall(__NR_io_uring_enter, ring->fd, unsubmitted, 1, IORING_ENTER_GETEVENTS, 0, 0);
+                RunStats::count(RunStats::Syscalls);
+                if (ret < 0 && errno == EINTR)
+                {
+                    continue; // a signal cut the wait short; nothing was submitted, so try again
+                }
+                if (ret < 0)
+                {
+                    throw RecoveryError(RecoveryStatus::DeviceError, "Failed to submit block reads to io_uring.");
+                }
+                unsubmitted -= ret;
+
+                int error = 0;
+                unsigned cqHead = *ring->cqHead;
+                unsigned cqTail = __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE);
+                while (cqHead != cqTail)
+                {
+                    io_uring_cqe *cqe = &ring->cqes[cqHead & *ring->cqMask];
+                    if (cqe->res < 0)
+                    {
+                        error = -cqe->res;
+                    }
+                    results[cqe->user_data] = cqe->res;
+                    done[cqe->user_data] = true;
+                    ++completed;
+                    ++cqHead;
+                }
+                __atomic_store_n(ring->cqHead, cqHead, __ATOMIC_RELEASE);
+                if (error)
+                {
+                    throw RecoveryError(RecoveryStatus::DeviceError, std::string("Failed to read block from USB device: ") + strerror(error));
+                }
+                continue;
+            }
+
+            RunStats::countRead(device.offsetOf(blocks[delivered]), results[head], 0);
+            consumer(blocks[delivered], buffers + static_cast<size_t>(head) * blockSize, results[head]);
+            ++delivered;
+        }
+    }
+    catch (...)
+    {
+        // Reads still in flight write into the slot buffers, so wait for them before
+        // the error leaves and the buffers are reused
+        drain(submitted - completed, unsubmitted);
+        throw;
+    }
+}
+
+// Waits for inFlight queued reads, unsubmitted of which were never handed to the kernel
+void AsyncBlockReader::drain(size_t inFlight, unsigned unsubmitted)
+{
+    while (inFlight > 0)
+    {
+        int ret = syscall(__NR_io_uring_enter, ring->fd, unsubmitted, 1, IORING_ENTER_GETEVENTS, 0, 0);
+        RunStats::count(RunStats::Syscalls);
+        if (ret < 0 && errno != EINTR)
+        {
+            return;
+        }
+        unsubmitted -= std::max(ret, 0);
+
+        unsigned cqHead = *ring->cqHead;
+        unsigned cqTail = __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE);
+        for (; cqHead != cqTail && inFlight > 0; ++cqHead)
+        {
+            --inFlight;
+        }
+        __atomic_store_n(ring->cqHead, cqHead, __ATOMIC_RELEASE);
+    }
+}
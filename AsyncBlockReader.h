@@ -0,0 +1,36 @@
+#ifndef ASYNCBLOCKREADER_H
+#define ASYNCBLOCKREADER_H
+
+#include <functional>
+#include <vector>
+#include "BlockDevice.h"
+
+struct IoUring;
+
+class AsyncBlockReader
+{
+public:
+    typedef std::function<void(BlockNumber blockNumber, const char *data, ssize_t size)> Consumer;
+
+    AsyncBlockReader(const BlockDevice &device, int queueDepth);
+    ~AsyncBlockReader();
+
+    void readBlocks(const std::vector<BlockNumber> &blocks, const Consumer &consumer);
+    bool usingIoUring() const { return ring != 0; }
+
+private:
+    AsyncBlockReader(const AsyncBlockReader &);
+    AsyncBlockReader &operator=(const AsyncBlockReader &);
+
+    void readMapped(const std::vector<BlockNumber> &blocks, const Consumer &consumer);
+    void readSynchronous(const std::vector<BlockNumber> &blocks, const Consumer &consumer);
+    void readQueued(const std::vector<BlockNumber> &blocks, const Consumer &consumer);
+    void drain(size_t inFlight, unsigned unsubmitted);
+
+    const BlockDevice &device;
+    int queueDepth;
+    IoUring *ring;
+    char *buffers;
+};
+
+#endif // ASYNCBLOCKREADER_H
@@ -0,0 +1,411 @@
+#include "BatchRecovery.h"
+#include "BlockIO.h"
+#include "BlockRecovery.h"
+#include "RecoveryStatus.h"
+#include "RunStats.h"
+#include "SignatureScanner.h"
+#include <algorithm>
+#include <thread>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+// Work handed between stages is capped so a fast scanner cannot run far ahead of the writers
+static const size_t queueCapacity = 64;
+
+// Each worker gets its own reader and cache, sized like the single-file path
+static const int workerQueueDepth = 32;
+static const int workerCacheSize = 1024;
+
+// Without an index, an indirect block is looked for this far past the data it points to,
+// the same distance the stream carver waits for one
+static const uint64_t indirectSearchBytes = 64 << 20;
+
+/**************************************************************************************
+ * Function: BatchRecovery
+ * Description: Sets up a batch run over the device.
+ * Parameters:
+ *    - device: The USB device.
+ *    - formats: The file formats to recover. Each recovered file gets its format's
+ *               extension, e.g. ".zip".
+ *    - outputDirectory: The directory recovered files are written to.
+ **************************************************************************************/
+BatchRecovery::BatchRecovery(const BlockDevice &device, const std::vector<FileFormat> &formats, const std::string &outputDirectory)
+    : device(device), formats(formats), outputDirectory(outputDirectory),
+      skip(0), journal(0), scanIndex(0), startBlocks(queueCapacity), jobs(queueCapacity), candidates(0), recovered(0),
+      progressLog(0), errorLog(0)
+{
+}
+
+/**************************************************************************************
+ * Function: run
+ * Description: Runs the scanner, resolver and writer stages until every candidate has
+ *              been written or rejected. A candidate that fails is reported and
+ *              skipped; an error that stops a whole stage, e.g. the device failing
+ *              during the scan, stops the run and is rethrown here once every stage
+ *              has wound down. The stages keep their own threads rather than using the
+ *              shared pool, since they block on each other's queues.
+ * Parameters:
+ *    - resolverCount: The number of resolver threads.
+ *    - writerCount: The number of writer threads.
+ * Returns:
+ *    - The number of files recovered.
+ **************************************************************************************/
+int BatchRecovery::run(int resolverCount, int writerCount)
+{
+    std::vector<std::thread> resolvers;
+    std::vector<std::thread> writers;
+
+    for (int i = 0; i < resolverCount; ++i)
+    {
+        resolvers.push_back(std::thread(&BatchRecovery::resolveStage, this));
+    }
+    for (int i = 0; i < writerCount; ++i)
+    {
+        writers.push_back(std::thread(&BatchRecovery::writeStage, this));
+    }
+
+    try
+    {
+        scanStage();
+    }
+    catch (...)
+    {
+        fail(std::current_exception());
+    }
+    startBlocks.close();
+
+    for (size_t i = 0; i < resolvers.size(); ++i)
+    {
+        resolvers[i].join();
+    }
+    jobs.close();
+
+    for (size_t i = 0; i < writers.size(); ++i)
+    {
+        writers[i].join();
+    }
+
+    if (failure)
+    {
+        std::rethrow_exception(failure);
+    }
+    return recovered;
+}
+
+/**************************************************************************************
+ * Function: scanStage
+ * Description: Streams every signature hit on the device to the resolvers, straight
+ *              from the scan index when there is one.
+ **************************************************************************************/
+void BatchRecovery::scanStage()
+{
+    RunStats::PhaseTimer timer(RunStats::Scan);
+    if (scanIndex)
+    {
+        const IndexedHit *hits = scanIndex->hits();
+        for (size_t i = 0; i < scanIndex->hitCount(); ++i)
+        {
+            ++candidates;
+            SignatureHit hit = {static_cast<BlockNumber>(hits[i].blockNumber), static_cast<int>(hits[i].signatureIndex)};
+            startBlocks.push(hit);
+        }
+        return;
+    }
+
+    SignatureScanner scanner(formats);
+    scanner.scan(device, [this](const std::vector<SignatureHit> &hits)
+    {
+        for (size_t i = 0; i < hits.size(); ++i)
+        {
+            ++candidates;
+            startBlocks.push(hits[i]);
+        }
+    }, 0, skip);
+}
+
+/**************************************************************************************
+ * Function: resolveStage
+ * Description: Resolves start blocks into block lists until the scanner is done.
+ **************************************************************************************/
+void BatchRecovery::resolveStage()
+{
+    try
+    {
+        BlockCache cache(device, workerCacheSize);
+        SignatureHit hit;
+
+        while (startBlocks.pop(hit))
+        {
+            RecoveryJob job;
+            std::string reason;
+            bool resolved;
+            try
+            {
+                resolved = resolve(cache, hit, job, reason);
+            }
+            catch (const RecoveryError &error)
+            {
+                resolved = false;
+                reason = error.what();
+            }
+
+            if (!resolved)
+            {
+                report("Skipping candidate at block " + std::to_string(hit.blockNumber) + ": " + reason, true);
+                continue;
+            }
+            jobs.push(std::move(job));
+        }
+    }
+    catch (...)
+    {
+        fail(std::current_exception());
+    }
+}
+
+/**************************************************************************************
+ * Function: writeStage
+ * Description: Writes resolved files until the resolvers are done.
+ **************************************************************************************/
+void BatchRecovery::writeStage()
+{
+    try
+    {
+        AsyncBlockReader reader(device, workerQueueDepth);
+        BlockCache cache(device, workerCacheSize);
+        RecoveryJob job;
+
+        while (jobs.pop(job))
+        {
+            std::string path = outputDirectory + "/" + std::to_string(job.startBlock) + formatTable[job.format].extension;
+            try
+            {
+                if (write(job, path, reader, cache))
+                {
+                    ++recovered;
+                }
+            }
+            catch (const RecoveryError &error)
+            {
+                unlink(path.c_str());
+                report("Failed to recover " + path + ": " + error.what(), true);
+            }
+        }
+    }
+    catch (...)
+    {
+        fail(std::current_exception());
+    }
+}
+
+/**************************************************************************************
+ * Function: resolve
+ * Description: Builds the block list of the file starting at a hit. A journaled
+ *              copy of the file's inode gives the exact list; otherwise the same
+ *              contiguity heuristic as the single-file path is used. Unlike that path,
+ *              a candidate that does not fit the heuristic is rejected instead of
+ *              ending the process.
+ * Parameters:
+ *    - cache: The resolver's block cache.
+ *    - hit: The first block of the candidate and the format it matched.
+ *    - job: Receives the block list.
+ *    - reason: Receives why the candidate was rejected.
+ * Returns:
+ *    - True if a block list was found.
+ **************************************************************************************/
+bool BatchRecovery::resolve(BlockCache &cache, const SignatureHit &hit, RecoveryJob &job, std::string &reason)
+{
+    RunStats::PhaseTimer timer(RunStats::IndirectSearch);
+    BlockNumber startBlock = hit.blockNumber;
+    job.startBlock = startBlock;
+    job.format = formats[hit.signatureIndex];
+    job.blocks = ExtentList();
+    job.exactSize = -1;
+
+    const InodeImage *image = journal && startBlock <= UINT32_MAX ? journal->findByFirstBlock(startBlock) : 0;
+    if (image)
+    {
+        const Inode &inode = image->inode;
+        for (int i = 0; i < 12; ++i)
+        {
+            job.blocks.append(inode.block[i]);
+        }
+        if (inode.block[12] != 0)
+        {
+            job.blocks.append(BlockRecovery::getBlockNumbersFromIndirect(cache, inode.block[12]));
+        }
+        if (inode.block[13] != 0)
+        {
+            job.blocks.append(BlockRecovery::findDoubleIndirectBlocks(cache, inode.block[13]));
+        }
+        if (inode.block[14] != 0)
+        {
+            job.blocks.append(BlockRecovery::findTripleIndirectBlocks(cache, inode.block[14]));
+        }
+
+        job.blocks.truncate((inode.size + device.blockSize() - 1) / device.blockSize());
+        job.exactSize = inode.size;
+        return true;
+    }
+
+    job.blocks = BlockRecovery::findDirectBlocks(device, startBlock, 12);
+
+    if (job.blocks.blockCount() == 12)
+    {
+        // Without an index the device is searched while the scan goes on, from the file's
+        // next data block on, since the indirect block is allocated after it
+        BlockNumber target = job.blocks.lastBlock() + 1;
+        BlockNumber indirectBlock = -1;
+        if (scanIndex)
+        {
+            indirectBlock = scanIndex->findIndirect(target);
+        }
+        else
+        {
+            try
+            {
+                indirectBlock = BlockRecovery::findIndirectBlock(device, target, skip, target, indirectSearchBytes / device.blockSize());
+            }
+            catch (const RecoveryError &error)
+            {
+                if (error.status().code != RecoveryStatus::NotFound)
+                {
+                    throw;
+                }
+            }
+        }
+
+        // Short files are followed by unrelated data, so a missing indirect block just
+        // means the file ends in its direct blocks; the writer finds the exact end
+        if (indirectBlock == -1)
+        {
+            return true;
+        }
+
+        bool indirectFull;
+        job.blocks.append(BlockRecovery::getBlockNumbersFromIndirect(cache, indirectBlock, &indirectFull));
+
+        // Heuristic double and triple indirect blocks are only followed if they really
+        // hold block pointers, since a bad guess would otherwise send reads off the device
+        if (indirectFull)
+        {
+            BlockView doubleIndirect = cache.block(indirectBlock + 1);
+            if (!IndirectIndex::looksLikeIndirect(doubleIndirect.data(), doubleIndirect.size(), device.blockCount()))
+            {
+                reason = "block " + std::to_string(indirectBlock + 1) + " is not a double indirect block";
+                return false;
+            }
+
+            bool doubleIndirectFull;
+            ExtentList blocksFromDoubleIndirect = BlockRecovery::findDoubleIndirectBlocks(cache, indirectBlock + 1, &doubleIndirectFull);
+            job.blocks.append(blocksFromDoubleIndirect);
+
+            if (doubleIndirectFull && !blocksFromDoubleIndirect.empty())
+            {
+                BlockNumber tripleIndirectBlock = blocksFromDoubleIndirect.lastBlock() + 1;
+                BlockView tripleIndirect = cache.block(tripleIndirectBlock);
+                if (!IndirectIndex::looksLikeIndirect(tripleIndirect.data(), tripleIndirect.size(), device.blockCount()))
+                {
+                    reason = "block " + std::to_string(tripleIndirectBlock) + " is not a triple indirect block";
+                    return false;
+                }
+
+                job.blocks.append(BlockRecovery::findTripleIndirectBlocks(cache, tripleIndirectBlock));
+            }
+        }
+    }
+
+    if (job.blocks.empty())
+    {
+        reason = "no data blocks";
+        return false;
+    }
+    return true;
+}
+
+/**************************************************************************************
+ * Function: write
+ * Description: Copies a resolved file to its output file.
+ * Parameters:
+ *    - job: The resolved file.
+ *    - path: The output file, <outputDirectory>/<startBlock><extension> with the
+ *            extension of the file's format.
+ *    - reader: The writer's block reader.
+ *    - cache: The writer's block cache, used to trim the last block.
+ * Returns:
+ *    - True if the file was written.
+ **************************************************************************************/
+bool BatchRecovery::write(const RecoveryJob &job, const std::string &path, AsyncBlockReader &reader, BlockCache &cache)
+{
+    int out_fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    if (out_fd == -1)
+    {
+        report("Failed to open output file " + path, true);
+        return false;
+    }
+
+    // A batch writes many files, so leave flushing them to the kernel
+    OutputWriter writer(out_fd, OutputWriter::NoSync);
+    size_t copied;
+    {
+        RunStats::PhaseTimer timer(RunStats::Copy);
+        copied = copyScheduled(device, job.blocks, 0, writer, reader, &cache);
+    }
+
+    if (copied != job.blocks.blockCount())
+    {
+        writer.close();
+        unlink(path.c_str());
+        report("Failed to read " + std::to_string(job.blocks.blockCount() - copied) + " of the blocks of " + path, true);
+        return false;
+    }
+
+    // Files are parsed by their format once copied, so their exact end is known
+    RunStats::PhaseTimer timer(RunStats::Finalize);
+    std::unique_ptr<EndDetector> end = job.exactSize < 0 ? makeEndDetector(job.format) : std::unique_ptr<EndDetector>();
+    off_t fileSize = job.exactSize;
+    if (end && detectEnd(*end, writer, 0, writer.offset()))
+    {
+        fileSize = end->fileSize();
+    }
+    else if (fileSize < 0 && finalizer)
+    {
+        fileSize = finalizer(job.blocks, cache, writer);
+    }
+    if (fileSize >= 0)
+    {
+        writer.truncate(fileSize);
+    }
+    writer.close();
+
+    report("Recovered " + path + " (" + std::to_string(job.blocks.blockCount()) + " blocks" +
+               (job.exactSize >= 0 ? ", block map from journal)" : end && end->complete() ? ", end found: " + end->summary() + ")" : std::string(")")),
+           false);
+    return true;
+}
+
+// Records the first error that stopped a stage and closes the queues, so every other
+// stage runs out of work and returns
+void BatchRecovery::fail(std::exception_ptr error)
+{
+    {
+        std::lock_guard<std::mutex> lock(reportMutex);
+        if (!failure)
+        {
+            failure = error;
+        }
+    }
+    startBlocks.close();
+    jobs.close();
+}
+
+void BatchRecovery::report(const std::string &line, bool error)
+{
+    std::ostream *log = error ? errorLog : progressLog;
+    if (log)
+    {
+        std::lock_guard<std::mutex> lock(reportMutex);
+        *log << line << "\n";
+    }
+}
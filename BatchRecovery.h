@@ -0,0 +1,85 @@
+#ifndef BATCHRECOVERY_H
+#define BATCHRECOVERY_H
+
+#include <atomic>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+#include <sys/types.h>
+#include "AsyncBlockReader.h"
+#include "BlockBitmap.h"
+#include "BlockCache.h"
+#include "BlockDevice.h"
+#include "BoundedQueue.h"
+#include "ExtentList.h"
+#include "FileFormat.h"
+#include "JournalScanner.h"
+#include "OutputWriter.h"
+#include "ScanIndex.h"
+#include "SignatureScanner.h"
+
+// A candidate file whose block list has been resolved and is ready to copy
+struct RecoveryJob
+{
+    BlockNumber startBlock;
+    FileFormat format;
+    ExtentList blocks;
+    off_t exactSize; // -1 when the size has to be guessed from the last block
+};
+
+// Recovers every candidate on the device in one run. A scanner stage streams signature
+// hits, resolver workers turn each hit into a block list, and writer workers copy each
+// list to its own output file. The stages are joined by bounded queues so all three
+// run at the same time.
+class BatchRecovery
+{
+public:
+    // Trims the last block of a guessed file; returns the file's final size
+    typedef std::function<off_t(const ExtentList &fileBlocks, BlockCache &cache, OutputWriter &writer)> Finalizer;
+
+    BatchRecovery(const BlockDevice &device, const std::vector<FileFormat> &formats, const std::string &outputDirectory);
+
+    void skipBlocks(const BlockBitmap *blocks) { skip = blocks; }
+    void useJournal(const JournalScanner *scanner) { journal = scanner; }
+    void useIndex(const ScanIndex *index) { scanIndex = index; }
+    void finalizeWith(const Finalizer &finalize) { finalizer = finalize; }
+    void logTo(std::ostream *progress, std::ostream *errors) { progressLog = progress; errorLog = errors; }
+
+    int run(int resolverCount = 2, int writerCount = 2);
+
+    int candidateCount() const { return candidates; }
+    int recoveredCount() const { return recovered; }
+
+private:
+    void scanStage();
+    void resolveStage();
+    void writeStage();
+
+    bool resolve(BlockCache &cache, const SignatureHit &hit, RecoveryJob &job, std::string &reason);
+    bool write(const RecoveryJob &job, const std::string &path, AsyncBlockReader &reader, BlockCache &cache);
+    void fail(std::exception_ptr error);
+    void report(const std::string &line, bool error);
+
+    const BlockDevice &device;
+    std::vector<FileFormat> formats;
+    std::string outputDirectory;
+    const BlockBitmap *skip;
+    const JournalScanner *journal;
+    const ScanIndex *scanIndex;
+    Finalizer finalizer;
+
+    BoundedQueue<SignatureHit> startBlocks;
+    BoundedQueue<RecoveryJob> jobs;
+
+    std::atomic<int> candidates;
+    std::atomic<int> recovered;
+    std::ostream *progressLog; // receives each recovered file; null for none
+    std::ostream *errorLog;    // receives skipped candidates and failed files; null for none
+    std::mutex reportMutex;
+    std::exception_ptr failure;
+};
+
+#endif // BATCHRECOVERY_H
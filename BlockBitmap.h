@@ -0,0 +1,40 @@
+#ifndef BLOCKBITMAP_H
+#define BLOCKBITMAP_H
+
+#include <cstddef>
+#include <vector>
+#include <stdint.h>
+#include "BlockDevice.h"
+
+// One bit per block on the device, e.g. which blocks are all zeros or allocated
+class BlockBitmap
+{
+public:
+    BlockBitmap() : blocks(0) {}
+    explicit BlockBitmap(BlockNumber blockCount) : words((blockCount + 63) / 64), blocks(blockCount) {}
+
+    bool empty() const { return blocks == 0; }
+    BlockNumber blockCount() const { return blocks; }
+
+    // Safe to call from several scanning threads at once
+    void set(BlockNumber blockNumber)
+    {
+        __atomic_fetch_or(&words[blockNumber / 64], uint64_t(1) << (blockNumber % 64), __ATOMIC_RELAXED);
+    }
+
+    // The raw words, e.g. for saving the map to a file
+    uint64_t *data() { return words.data(); }
+    const uint64_t *data() const { return words.data(); }
+    size_t wordCount() const { return words.size(); }
+
+    bool test(BlockNumber blockNumber) const
+    {
+        return blockNumber < blocks && (words[blockNumber / 64] >> (blockNumber % 64)) & 1;
+    }
+
+private:
+    std::vector<uint64_t> words;
+    BlockNumber blocks;
+};
+
+#endif // BLOCKBITMAP_H
@@ -0,0 +1,222 @@
+#include "BlockCache.h"
+#include "AsyncBlockReader.h"
+#include "BufferArena.h"
+#include "RecoveryStatus.h"
+#include "RunStats.h"
+#include <cstdlib>
+#include <algorithm>
+
+// Slot storage is aligned for both O_DIRECT-style reads and cache-line friendly copies
+static const size_t slabAlignment = 4096;
+
+// Reads kept in flight when a batch misses the cache
+static const int batchQueueDepth = 32;
+
+// Pins reference slab memory that the cache releases itself
+static void noDelete(char *)
+{
+}
+
+/**************************************************************************************
+ * Function: BlockCache
+ * Description: Allocates the slab for a cache of capacity blocks of the device.
+ * Parameters:
+ *    - device: The USB device.
+ *    - capacity: The number of blocks the cache holds.
+ **************************************************************************************/
+BlockCache::BlockCache(const BlockDevice &device, int capacity)
+    : blockDevice(device), slotSize(device.blockSize()), slab(0), slots(capacity < 1 ? 1 : capacity),
+      hand(0), hitCount(0), missCount(0)
+{
+    size_t rounded = (static_cast<size_t>(slotSize) + slabAlignment - 1) / slabAlignment * slabAlignment;
+    slotSize = rounded;
+
+    slab = BufferArena::shared().acquire(rounded * slots.size());
+    if (!slab)
+    {
+        throw RecoveryError(RecoveryStatus::OutOfMemory, "Failed to allocate the block cache.");
+    }
+
+    for (size_t i = 0; i < slots.size(); ++i)
+    {
+        slots[i].blockNumber = -1;
+        slots[i].length = 0;
+        slots[i].referenced = false;
+        slots[i].pin.reset(slab + i * slotSize, noDelete);
+    }
+    lookup.reserve(slots.size() * 2);
+}
+
+BlockCache::~BlockCache()
+{
+    BufferArena::shared().release(slab, slotSize * slots.size());
+}
+
+/**************************************************************************************
+ * Function: block
+ * Description: Returns a view of one block, reading it from the device on a miss. The
+ *              view pins its slot, so it stays valid however many blocks are read after.
+ * Parameters:
+ *    - blockNumber: The block number to view.
+ * Returns:
+ *    - A view of the block, empty past the end of the device.
+ **************************************************************************************/
+BlockView BlockCache::block(BlockNumber blockNumber)
+{
+    std::unordered_map<BlockNumber, int>::const_iterator found = lookup.find(blockNumber);
+    if (found != lookup.end())
+    {
+        ++hitCount;
+        RunStats::count(RunStats::CacheHits);
+        slots[found->second].referenced = true;
+        return viewOf(found->second);
+    }
+
+    ++missCount;
+    RunStats::count(RunStats::CacheMisses);
+    int slot = claimSlot();
+    if (slot == -1)
+    {
+        // Every slot is pinned, so hand out an uncached view instead
+        return blockDevice.block(blockNumber);
+    }
+
+    ssize_t length = blockDevice.read(blockDevice.offsetOf(blockNumber), slab + static_cast<size_t>(slot) * slotSize, blockDevice.blockSize());
+    if (length <= 0)
+    {
+        return BlockView();
+    }
+
+    slots[slot].blockNumber = blockNumber;
+    slots[slot].length = length;
+    slots[slot].referenced = true;
+    lookup[blockNumber] = slot;
+    return viewOf(slot);
+}
+
+/**************************************************************************************
+ * Function: readBatch
+ * Description: Visits a batch of blocks. Cached blocks are visited first, straight from
+ *              the slab; the misses are then read together, with up to batchQueueDepth
+ *              reads in flight, visited in place in the reader's aligned buffers (or
+ *              the device mapping) and stored in free or evicted slots, as block()
+ *              does with a single miss.
+ * Parameters:
+ *    - blocks: The block numbers to visit, best sorted so the misses are read in order.
+ *    - visit: Called once per block; the view is empty if the block could not be read.
+ **************************************************************************************/
+void BlockCache::readBatch(const std::vector<BlockNumber> &blocks, const BatchVisitor &visit)
+{
+    std::vector<BlockNumber> misses;
+    for (size_t i = 0; i < blocks.size(); ++i)
+    {
+        std::unordered_map<BlockNumber, int>::const_iterator found = lookup.find(blocks[i]);
+        if (found == lookup.end())
+        {
+            misses.push_back(blocks[i]);
+            continue;
+        }
+
+        ++hitCount;
+        RunStats::count(RunStats::CacheHits);
+        slots[found->second].referenced = true;
+        visit(blocks[i], viewOf(found->second));
+    }
+
+    if (misses.empty())
+    {
+        return;
+    }
+    missCount += misses.size();
+    RunStats::count(RunStats::CacheMisses, misses.size());
+
+    if (!batchReader)
+    {
+        batchReader.reset(new AsyncBlockReader(blockDevice, batchQueueDepth));
+    }
+    batchReader->readBlocks(misses, [this, &visit](BlockNumber blockNumber, const char *data, ssize_t size)
+    {
+        store(blockNumber, data, size);
+        visit(blockNumber, BlockView(data, size > 0 ? size : 0));
+    });
+}
+
+/**************************************************************************************
+ * Function: store
+ * Description: Adds a block that was read some other way, e.g. by the copy loop, so a
+ *              later lookup does not go back to the device.
+ * Parameters:
+ *    - blockNumber: The block number of the data.
+ *    - data: The block's contents.
+ *    - length: The number of bytes in data, at most one block.
+ **************************************************************************************/
+void BlockCache::store(BlockNumber blockNumber, const char *data, ssize_t length)
+{
+    if (length <= 0 || lookup.count(blockNumber))
+    {
+        return;
+    }
+
+    int slot = claimSlot();
+    if (slot == -1)
+    {
+        return;
+    }
+
+    length = std::min<ssize_t>(length, blockDevice.blockSize());
+    memcpy(slab + static_cast<size_t>(slot) * slotSize, data, length);
+    slots[slot].blockNumber = blockNumber;
+    slots[slot].length = length;
+    slots[slot].referenced = true;
+    lookup[blockNumber] = slot;
+}
+
+/**************************************************************************************
+ * Function: claimSlot
+ * Description: Finds a slot to reuse with the CLOCK algorithm. The hand clears the
+ *              referenced bit of each slot it passes and stops at the first slot that is
+ *              neither referenced nor pinned by a live view.
+ * Returns:
+ *    - The slot index, emptied and removed from the lookup table, or -1 if every slot
+ *      is pinned.
+ **************************************************************************************/
+int BlockCache::claimSlot()
+{
+    int count = static_cast<int>(slots.size());
+
+    // Two sweeps: the first may only clear referenced bits
+    for (int step = 0; step < 2 * count; ++step)
+    {
+        Slot &slot = slots[hand];
+        int index = hand;
+        hand = (hand + 1) % count;
+
+        if (slot.pin.use_count() > 1)
+        {
+            continue;
+        }
+        if (slot.referenced)
+        {
+            slot.referenced = false;
+            continue;
+        }
+
+        if (slot.blockNumber != -1)
+        {
+            lookup.erase(slot.blockNumber);
+            slot.blockNumber = -1;
+        }
+        return index;
+    }
+
+    return -1;
+}
+
+BlockView BlockCache::viewOf(int slot)
+{
+    BlockView result;
+    result.owner = slots[slot].pin;
+    result.bytes = result.owner.get();
+    result.length = slots[slot].length;
+    return result;
+}
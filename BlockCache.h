@@ -0,0 +1,61 @@
+#ifndef BLOCKCACHE_H
+#define BLOCKCACHE_H
+
+#include <functional>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+#include <stdint.h>
+#include "BlockDevice.h"
+
+class AsyncBlockReader;
+
+// A fixed-size cache of device blocks for the traversal and finalize steps, which revisit
+// the same indirect and metadata blocks. Blocks live in one 4 KiB-aligned slab and are
+// evicted with the CLOCK algorithm. A slot stays pinned while any view of it is alive.
+// The cache is not thread-safe.
+class BlockCache
+{
+public:
+    explicit BlockCache(const BlockDevice &device, int capacity = 1024);
+    ~BlockCache();
+
+    const BlockDevice &device() const { return blockDevice; }
+    int capacity() const { return static_cast<int>(slots.size()); }
+    uint64_t hits() const { return hitCount; }
+    uint64_t misses() const { return missCount; }
+
+    // Receives one block of a batch; the view is only valid for the duration of the call
+    typedef std::function<void(BlockNumber blockNumber, const BlockView &block)> BatchVisitor;
+
+    BlockView block(BlockNumber blockNumber);
+    void readBatch(const std::vector<BlockNumber> &blocks, const BatchVisitor &visit);
+    void store(BlockNumber blockNumber, const char *data, ssize_t length);
+
+private:
+    BlockCache(const BlockCache &);
+    BlockCache &operator=(const BlockCache &);
+
+    struct Slot
+    {
+        BlockNumber blockNumber;
+        ssize_t length;
+        bool referenced;
+        std::shared_ptr<char> pin;
+    };
+
+    int claimSlot();
+    BlockView viewOf(int slot);
+
+    const BlockDevice &blockDevice;
+    int slotSize;
+    char *slab;
+    std::vector<Slot> slots;
+    std::unordered_map<BlockNumber, int> lookup;
+    std::unique_ptr<AsyncBlockReader> batchReader;
+    int hand;
+    uint64_t hitCount;
+    uint64_t missCount;
+};
+
+#endif // BLOCKCACHE_H
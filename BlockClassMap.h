@@ -0,0 +1,54 @@
+#ifndef BLOCKCLASSMAP_H
+#define BLOCKCLASSMAP_H
+
+#include <cstddef>
+#include <vector>
+#include <stdint.h>
+#include "BlockDevice.h"
+
+// What a block holds, as far as its bytes tell. Blocks that were never classified, e.g.
+// skipped allocated blocks, read as LowEntropy, the class no search is narrowed to.
+enum BlockClass
+{
+    LowEntropy = 0,  // text, markup and other structured data
+    HighEntropy = 1, // compressed or encrypted data
+    ZeroFilled = 2,
+    PointerArray = 3 // a plausible ext2/ext3 indirect block
+};
+
+// Two bits per block on the device, holding each block's BlockClass
+class BlockClassMap
+{
+public:
+    BlockClassMap() : blocks(0) {}
+    explicit BlockClassMap(BlockNumber blockCount) : words((blockCount + 31) / 32), blocks(blockCount) {}
+
+    bool empty() const { return blocks == 0; }
+    BlockNumber blockCount() const { return blocks; }
+
+    // Safe to call from several scanning threads at once, once per block
+    void set(BlockNumber blockNumber, BlockClass blockClass)
+    {
+        __atomic_fetch_or(&words[blockNumber / 32], uint64_t(blockClass) << (blockNumber % 32 * 2), __ATOMIC_RELAXED);
+    }
+
+    BlockClass get(BlockNumber blockNumber) const
+    {
+        if (blockNumber < 0 || blockNumber >= blocks)
+        {
+            return LowEntropy;
+        }
+        return static_cast<BlockClass>((words[blockNumber / 32] >> (blockNumber % 32 * 2)) & 3);
+    }
+
+    // The raw words, e.g. for saving the map to a file
+    uint64_t *data() { return words.data(); }
+    const uint64_t *data() const { return words.data(); }
+    size_t wordCount() const { return words.size(); }
+
+private:
+    std::vector<uint64_t> words;
+    BlockNumber blocks;
+};
+
+#endif // BLOCKCLASSMAP_H
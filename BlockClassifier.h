@@ -0,0 +1,24 @@
+#ifndef BLOCKCLASSIFIER_H
+#define BLOCKCLASSIFIER_H
+
+#include <cstddef>
+#include "BlockClassMap.h"
+#include "BlockDevice.h"
+
+// Sorts blocks into BlockClass values during a scan, so later searches can rule most
+// blocks out from the map instead of reading them again
+class BlockClassifier
+{
+public:
+    BlockClassifier(int blockSize, BlockNumber deviceBlocks);
+
+    BlockClass classify(const char *block, size_t length, BlockNumber blockNumber) const;
+
+    static double byteEntropy(const char *block, size_t length);
+
+private:
+    int blockSize;
+    BlockNumber deviceBlocks;
+};
+
+#endif // BLOCKCLASSIFIER_H
@@ -0,0 +1,301 @@
+#include "BlockDevice.h"
+#include "BufferArena.h"
+#include "RecoveryStatus.h"
+#include "RunStats.h"
+#include <cerrno>
+#include <cstdlib>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+
+// O_DIRECT transfers must start, end and land on multiples of the device's logical
+// sector size; 4 KiB covers every sector size in use
+static const size_t directAlignment = 4096;
+
+static off_t alignDown(off_t offset)
+{
+    return offset / directAlignment * directAlignment;
+}
+
+static off_t alignUp(off_t offset)
+{
+    return (offset + directAlignment - 1) / directAlignment * directAlignment;
+}
+
+/**************************************************************************************
+ * Function: BlockDevice
+ * Description: Opens a device or image file for block reads. Regular image files are
+ *              memory-mapped so blocks can be viewed in place; block devices (or images
+ *              that fail to map) are read with a single pread per request. The Direct
+ *              backend reads through a second, O_DIRECT descriptor so a full scan does
+ *              not fill the page cache; if the file system or device refuses O_DIRECT
+ *              it falls back to pread and drops the pages it read.
+ * Parameters:
+ *    - devicePath: The path to the USB device or image file.
+ *    - blockSize: The size of each block.
+ *    - backend: Force a backend, or Auto to pick one from the file type.
+ **************************************************************************************/
+BlockDevice::BlockDevice(const std::string &devicePath, int blockSize, Backend backend)
+    : deviceFd(-1), directFd(-1), dropCache(false), deviceBlockSize(blockSize), deviceSize(0), mapping(0)
+{
+    deviceFd = open(devicePath.c_str(), O_RDONLY);
+    if (deviceFd == -1)
+    {
+        throw RecoveryError(RecoveryStatus::DeviceError, "Failed to open USB device.");
+    }
+
+    struct stat st;
+    if (fstat(deviceFd, &st) != 0)
+    {
+        close(deviceFd);
+        throw RecoveryError(RecoveryStatus::DeviceError, "Failed to stat USB device.");
+    }
+
+    if (S_ISBLK(st.st_mode))
+    {
+        uint64_t bytes = 0;
+        if (ioctl(deviceFd, BLKGETSIZE64, &bytes) != 0)
+        {
+            close(deviceFd);
+            throw RecoveryError(RecoveryStatus::DeviceError, "Failed to get the size of the USB device.");
+        }
+        deviceSize = bytes;
+    }
+    else
+    {
+        deviceSize = st.st_size;
+    }
+
+    if (backend == Auto)
+    {
+        backend = S_ISREG(st.st_mode) ? Mmap : Pread;
+    }
+
+    if (backend == Direct)
+    {
+        // deviceFd stays buffered for the copy paths (io_uring, copy_file_range), which
+        // read few blocks and need no alignment; those blocks are only read once
+        if (openDirect(devicePath))
+        {
+            posix_fadvise(deviceFd, 0, 0, POSIX_FADV_NOREUSE);
+        }
+        else
+        {
+            dropCache = true;
+            posix_fadvise(deviceFd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        }
+    }
+
+    if (backend == Mmap && deviceSize > 0)
+    {
+        void *addr = mmap(0, deviceSize, PROT_READ, MAP_SHARED, deviceFd, 0);
+        if (addr != MAP_FAILED)
+        {
+            mapping = static_cast<char *>(addr);
+        }
+    }
+}
+
+BlockDevice::~BlockDevice()
+{
+    if (mapping)
+    {
+        munmap(mapping, deviceSize);
+    }
+    if (directFd != -1)
+    {
+        close(directFd);
+    }
+    close(deviceFd);
+}
+
+/**************************************************************************************
+ * Function: openDirect
+ * Description: Opens the O_DIRECT descriptor and checks that an aligned read works on
+ *              it, since some file systems accept the flag at open but fail every read.
+ * Parameters:
+ *    - devicePath: The path to the USB device or image file.
+ * Returns:
+ *    - True if direct reads work; false if the device does not support them or the
+ *      probe buffer could not be allocated. Never throws, so the constructor cannot
+ *      leave the device descriptor open.
+ **************************************************************************************/
+bool BlockDevice::openDirect(const std::string &devicePath)
+{
+    directFd = open(devicePath.c_str(), O_RDONLY | O_DIRECT);
+    if (directFd == -1)
+    {
+        return false;
+    }
+
+    // Without a probe buffer direct reads cannot be checked, so the buffered path is used
+    char *probe = BufferArena::shared().acquire(directAlignment);
+    bool works = probe && (deviceSize == 0 || pread(directFd, probe, directAlignment, 0) >= 0);
+    if (probe)
+    {
+        BufferArena::shared().release(probe, directAlignment);
+    }
+
+    if (!works)
+    {
+        close(directFd);
+        directFd = -1;
+    }
+    return works;
+}
+
+/**************************************************************************************
+ * Function: block
+ * Description: Returns a view of one block on the device.
+ * Parameters:
+ *    - blockNumber: The block number to view.
+ * Returns:
+ *    - A view of the block. It is shorter than the block size for a partial last block
+ *      and empty past the end of the device.
+ **************************************************************************************/
+BlockView BlockDevice::block(BlockNumber blockNumber) const
+{
+    return view(offsetOf(blockNumber), deviceBlockSize);
+}
+
+/**************************************************************************************
+ * Function: view
+ * Description: Returns a view of a byte range on the device. With the mmap backend the
+ *              view points straight into the mapping; with the pread backend it owns a
+ *              buffer filled by one pread, and with direct I/O an aligned buffer
+ *              holding the range widened to sector boundaries.
+ * Parameters:
+ *    - offset: The byte offset of the range.
+ *    - length: The number of bytes wanted.
+ * Returns:
+ *    - A view of the range, truncated at the end of the device.
+ **************************************************************************************/
+BlockView BlockDevice::view(off_t offset, size_t length) const
+{
+    BlockView result;
+    if (offset >= deviceSize)
+    {
+        return result;
+    }
+
+    if (mapping)
+    {
+        result.bytes = mapping + offset;
+        result.length = std::min<off_t>(length, deviceSize - offset);
+        RunStats::countRead(offset, result.length, 0);
+        return result;
+    }
+    if (directFd != -1)
+    {
+        return viewDirect(offset, length);
+    }
+
+    result.owner.reset(new char[length], std::default_delete<char[]>());
+    result.bytes = result.owner.get();
+    result.length = read(offset, result.owner.get(), length);
+    return result;
+}
+
+/**************************************************************************************
+ * Function: viewDirect
+ * Description: Reads a byte range with O_DIRECT. The range is widened to sector
+ *              boundaries and read into a buffer from the shared arena, which the view
+ *              hands back when the last copy of it goes away.
+ * Parameters:
+ *    - offset: The byte offset of the range.
+ *    - length: The number of bytes wanted.
+ * Returns:
+ *    - A view of the range, truncated at the end of the device.
+ **************************************************************************************/
+BlockView BlockDevice::viewDirect(off_t offset, size_t length) const
+{
+    off_t start = alignDown(offset);
+    size_t span = alignUp(offset + length) - start;
+    char *buffer = BufferArena::shared().acquire(span);
+    if (!buffer)
+    {
+        throw RecoveryError(RecoveryStatus::OutOfMemory, "Failed to allocate a direct I/O buffer.");
+    }
+
+    BlockView result;
+    result.owner.reset(buffer, [span](char *released) { BufferArena::shared().release(released, span); });
+
+    // A read ends short only at the end of the device, which need not be aligned
+    size_t total = 0;
+    while (total < span)
+    {
+        ssize_t bytesRead = pread(directFd, buffer + total, span - total, start + total);
+        if (bytesRead == -1)
+        {
+            throw RecoveryError(RecoveryStatus::DeviceError, "Failed to read block from USB device.");
+        }
+        RunStats::countRead(start + total, bytesRead, 1);
+        total += bytesRead;
+        if (bytesRead == 0 || total % directAlignment != 0)
+        {
+            break;
+        }
+    }
+
+    size_t skipped = offset - start;
+    result.bytes = buffer + skipped;
+    result.length = total > skipped ? std::min(length, total - skipped) : 0;
+    return result;
+}
+
+/**************************************************************************************
+ * Function: read
+ * Description: Copies a byte range of the device into a caller-supplied buffer.
+ * Parameters:
+ *    - offset: The byte offset of the range.
+ *    - buffer: The buffer to fill.
+ *    - length: The number of bytes wanted.
+ * Returns:
+ *    - The number of bytes read, which is short only at the end of the device.
+ **************************************************************************************/
+ssize_t BlockDevice::read(off_t offset, char *buffer, size_t length) const
+{
+    if (mapping)
+    {
+        if (offset >= deviceSize)
+        {
+            return 0;
+        }
+        size_t available = std::min<off_t>(length, deviceSize - offset);
+        memcpy(buffer, mapping + offset, available);
+        RunStats::countRead(offset, available, 0);
+        return available;
+    }
+    if (directFd != -1)
+    {
+        BlockView range = viewDirect(offset, length);
+        memcpy(buffer, range.data(), range.size());
+        return range.size();
+    }
+
+    size_t total = 0;
+    while (total < length)
+    {
+        ssize_t bytesRead = pread(deviceFd, buffer + total, length - total, offset + total);
+        if (bytesRead == -1)
+        {
+            throw RecoveryError(RecoveryStatus::DeviceError, "Failed to read block from USB device.");
+        }
+        RunStats::countRead(offset + total, bytesRead, 1);
+        if (bytesRead == 0)
+        {
+            break;
+        }
+        total += bytesRead;
+    }
+
+    if (dropCache && total > 0)
+    {
+        posix_fadvise(deviceFd, offset, total, POSIX_FADV_DONTNEED);
+    }
+    return total;
+}
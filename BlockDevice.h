@@ -0,0 +1,86 @@
+#ifndef BLOCKDEVICE_H
+#define BLOCKDEVICE_H
+
+#include <cstring>
+#include <memory>
+#include <string>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Block numbers and counts are 64-bit, so devices with more than 2^31 blocks can be
+// addressed; ext2/ext3 block pointers on disk are still u32
+typedef int64_t BlockNumber;
+
+class BlockView
+{
+public:
+    BlockView() : bytes(0), length(0) {}
+
+    // A view of memory the caller owns, e.g. a block read from a stream
+    BlockView(const char *data, ssize_t length) : bytes(data), length(length) {}
+
+    const char *data() const { return bytes; }
+    ssize_t size() const { return length; }
+
+    // Number of on-disk block pointers that fit in the view
+    int pointerCount() const { return length / sizeof(uint32_t); }
+
+    // Decodes the index'th little-endian u32 block pointer
+    uint32_t pointer(int index) const
+    {
+        const unsigned char *p = reinterpret_cast<const unsigned char *>(bytes) + index * sizeof(uint32_t);
+        return p[0] | (p[1] << 8) | (p[2] << 16) | (static_cast<uint32_t>(p[3]) << 24);
+    }
+
+private:
+    friend class BlockDevice;
+    friend class BlockCache;
+
+    const char *bytes;
+    ssize_t length;
+    std::shared_ptr<char> owner;
+};
+
+class BlockDevice
+{
+public:
+    enum Backend
+    {
+        Auto,
+        Mmap,
+        Pread,
+        Direct // O_DIRECT reads that bypass the page cache, or Pread if unsupported
+    };
+
+    BlockDevice(const std::string &devicePath, int blockSize, Backend backend = Auto);
+    ~BlockDevice();
+
+    int fd() const { return deviceFd; }
+    int blockSize() const { return deviceBlockSize; }
+    void setBlockSize(int blockSize) { deviceBlockSize = blockSize; }
+    off_t size() const { return deviceSize; }
+    BlockNumber blockCount() const { return (deviceSize + deviceBlockSize - 1) / deviceBlockSize; }
+    off_t offsetOf(BlockNumber blockNumber) const { return static_cast<off_t>(blockNumber) * deviceBlockSize; }
+    bool isMapped() const { return mapping != 0; }
+    bool isDirect() const { return directFd != -1; }
+
+    BlockView block(BlockNumber blockNumber) const;
+    BlockView view(off_t offset, size_t length) const;
+    ssize_t read(off_t offset, char *buffer, size_t length) const;
+
+private:
+    BlockDevice(const BlockDevice &);
+    BlockDevice &operator=(const BlockDevice &);
+
+    bool openDirect(const std::string &devicePath);
+    BlockView viewDirect(off_t offset, size_t length) const;
+
+    int deviceFd;
+    int directFd;      // an O_DIRECT descriptor for view and read, or -1
+    bool dropCache;    // Direct was asked for but is unsupported; pages read are dropped
+    int deviceBlockSize;
+    off_t deviceSize;
+    char *mapping;
+};
+
+#endif // BLOCKDEVICE_H
@@ -1,39 +1,134 @@
 #include "BlockIO.h"
+#include "RunStats.h"
 #include <unistd.h>
 #include <fcntl.h>
+#include <algorithm>
 
-ssize_t readBlock(int usb_fd, int blockNumber, char *buffer, int blockSize)
+// Bytes of output read back through an EndDetector at a time
+static const size_t detectChunkSize = 1 << 20;
+
+// A run of consecutive device blocks and where it belongs in the output file
+struct PlacedExtent
 {
-    off_t offset = blockNumber * blockSize;
-    lseek(usb_fd, offset, SEEK_SET);
-    ssize_t bytesRead = read(usb_fd, buffer, blockSize);
-    if (bytesRead == -1)
-    {
-        std::cerr << "Failed to read block from USB device.\n";
-        exit(1);
-    }
-    return bytesRead;
+    BlockNumber start;
+    BlockNumber length;
+    off_t fileOffset;
+};
+
+static bool byDeviceOffset(const PlacedExtent &a, const PlacedExtent &b)
+{
+    return a.start < b.start;
 }
 
-void writeBlock(int out_fd, const char *buffer, int blockSize)
+/**************************************************************************************
+ * Function: copyScheduled
+ * Description: Copies a file's blocks to the output in elevator order. The file's runs
+ *              are sorted by their offset on the device and read in a single ascending
+ *              sweep, and each run is written at its logical offset in the output, so a
+ *              fragmented file costs one pass across the device instead of a seek per
+ *              fragment. Runs are moved inside the kernel when the output allows it;
+ *              otherwise their blocks are read through the reader.
+ * Parameters:
+ *    - device: The USB device.
+ *    - blocks: The blocks to copy, in file order.
+ *    - fileOffset: The output offset of the first block.
+ *    - writer: The writer for the output file. It is left at the end of the copied
+ *              range, so later appends follow the last block.
+ *    - reader: The reader for the blocks when they cannot be copied in the kernel.
+ *    - cache: If not null, receives the last block, so finalizeFile can trim it
+ *             without another read.
+ * Returns:
+ *    - The number of blocks copied. Fewer than blocks.blockCount() means some could
+ *      not be read.
+ **************************************************************************************/
+size_t copyScheduled(const BlockDevice &device, const ExtentList &blocks, off_t fileOffset, OutputWriter &writer, AsyncBlockReader &reader, BlockCache *cache)
 {
-    ssize_t bytesWritten = 0;
-    ssize_t totalBytesWritten = 0;
-    while (totalBytesWritten < blockSize)
+    int blockSize = device.blockSize();
+    std::vector<PlacedExtent> runs;
+    off_t logical = fileOffset;
+    for (ExtentList::const_iterator it = blocks.begin(); it != blocks.end(); ++it)
+    {
+        PlacedExtent run = {it->start, it->length, logical};
+        runs.push_back(run);
+        logical += static_cast<off_t>(it->length) * blockSize;
+    }
+    std::stable_sort(runs.begin(), runs.end(), byDeviceOffset);
+
+    size_t copied = 0;
+    if (writer.copyMethod() != OutputWriter::Buffered)
+    {
+        for (size_t i = 0; i < runs.size(); ++i)
+        {
+            writer.seek(runs[i].fileOffset);
+            writer.appendRange(device.fd(), device.offsetOf(runs[i].start), static_cast<size_t>(runs[i].length) * blockSize);
+            copied += (writer.offset() - runs[i].fileOffset + blockSize - 1) / blockSize;
+        }
+    }
+    else
     {
-        bytesWritten = write(out_fd, buffer + totalBytesWritten, blockSize - totalBytesWritten);
-        if (bytesWritten == -1)
+        std::vector<BlockNumber> order;
+        std::vector<off_t> offsets;
+        order.reserve(blocks.blockCount());
+        offsets.reserve(blocks.blockCount());
+        for (size_t i = 0; i < runs.size(); ++i)
         {
-            std::cerr << "Failed to write block to output file.\n";
-            exit(1);
+            for (BlockNumber j = 0; j < runs[i].length; ++j)
+            {
+                order.push_back(runs[i].start + j);
+                offsets.push_back(runs[i].fileOffset + static_cast<off_t>(j) * blockSize);
+            }
         }
-        totalBytesWritten += bytesWritten;
 
-        // Flush data to disk
-        if (fsync(out_fd) == -1)
+        // Blocks arrive in list order, so the next offset is always the one delivered
+        size_t next = 0;
+        BlockNumber lastBlock = blocks.empty() ? -1 : blocks.lastBlock();
+        reader.readBlocks(order, [&](BlockNumber block, const char *data, ssize_t size)
+        {
+            off_t offset = offsets[next++];
+            if (size <= 0)
+            {
+                return;
+            }
+            writer.seek(offset);
+            writer.append(data, size);
+            ++copied;
+
+            if (cache && block == lastBlock)
+                cache->store(block, data, size);
+        });
+    }
+
+    writer.seek(logical);
+    return copied;
+}
+
+/**************************************************************************************
+ * Function: detectEnd
+ * Description: Reads a range of the output back through an EndDetector. Blocks are
+ *              copied out of order, so the detector sees the file here instead, in file
+ *              order, while the range is still in the page cache.
+ * Parameters:
+ *    - end: The format parser that tracks the file.
+ *    - writer: The writer for the output file.
+ *    - from: The first output offset not yet fed to the detector.
+ *    - to: The end of the range to feed.
+ * Returns:
+ *    - True if the file ended within the range.
+ **************************************************************************************/
+bool detectEnd(EndDetector &end, OutputWriter &writer, off_t from, off_t to)
+{
+    writer.flush();
+    std::vector<char> buffer(detectChunkSize);
+    for (off_t offset = from; offset < to && !end.complete();)
+    {
+        RunStats::count(RunStats::Syscalls);
+        ssize_t bytesRead = pread(writer.fd(), &buffer[0], std::min<off_t>(buffer.size(), to - offset), offset);
+        if (bytesRead <= 0)
         {
-            std::cerr << "Failed to flush data to disk.\n";
-            exit(1);
+            break;
         }
+        end.feed(&buffer[0], bytesRead);
+        offset += bytesRead;
     }
+    return end.complete();
 }
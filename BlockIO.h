@@ -2,8 +2,15 @@
 #define BLOCKIO_H
 
 #include <iostream>
+#include "AsyncBlockReader.h"
+#include "BlockCache.h"
+#include "BlockDevice.h"
+#include "ExtentList.h"
+#include "OutputWriter.h"
+#include "FormatCarver.h"
 
-ssize_t readBlock(int usb_fd, int blockNumber, char *buffer, int blockSize);
-void writeBlock(int out_fd, const char *buffer, int blockSize);
+size_t copyScheduled(const BlockDevice &device, const ExtentList &blocks, off_t fileOffset, OutputWriter &writer, AsyncBlockReader &reader,
+                     BlockCache *cache = 0);
+bool detectEnd(EndDetector &end, OutputWriter &writer, off_t from, off_t to);
 
 #endif // BLOCKIO_H
@@ -1,296 +1,328 @@
 #include "BlockRecovery.h"
 #include "BlockIO.h"
+#include "ParallelScanner.h"
+#include "RecoveryStatus.h"
 
 /**************************************************************************************
- * Function: findDirectBlocks
- * Description: Finds the direct blocks of a file on the USB device.
+ * Function: findFirstBlockOfType
+ * Description: Finds the first block on the USB device that starts with the signature
+ *              of any of the given formats.
  * Parameters:
- *    - usb_fd: The file descriptor of the USB device.
- *    - startBlock: The starting block number.
- *    - blockSize: The size of each block.
- *    - numDirectBlocks: The number of direct blocks to find.
+ *    - device: The USB device.
+ *    - formats: The file formats to search for.
+ *    - skipBlocks: If not null, blocks set in this map (e.g. allocated blocks) are skipped.
  * Returns:
- *    - A vector containing the direct block numbers.
+ *    - The first matching block, tagged with the position of its format in formats.
+ *      Throws a NotFound RecoveryError if there is none.
  **************************************************************************************/
-int BlockRecovery::findFirstBlockOfType(int usb_fd, const std::string &fileTypeSignature)
+SignatureHit BlockRecovery::findFirstBlockOfType(const BlockDevice &device, const std::vector<FileFormat> &formats, const BlockBitmap *skipBlocks)
 {
-    const int bufferSize = 4096;
-    char buffer[bufferSize];
-
-    int blockNumber = 0;
-    int bytesRead = 0;
+    SignatureScanner scanner(formats);
+    std::vector<SignatureHit> hits = scanner.scan(device, 1, 0, skipBlocks);
 
-    while ((bytesRead = read(usb_fd, buffer, bufferSize)) == bufferSize)
+    if (hits.empty())
     {
-        if (memcmp(buffer, fileTypeSignature.c_str(), fileTypeSignature.size()) == 0)
-        {
-            return blockNumber;
-        }
-
-        blockNumber++;
+        throw RecoveryError(RecoveryStatus::NotFound, "Could not find the specified file type on the USB device.");
     }
 
-    if (bytesRead > 0)
+    return hits.front();
+}
+
+/**************************************************************************************
+ * Function: findFirstBlockOfType
+ * Description: Finds the first block starting with a signature, using a saved scan
+ *              index instead of reading the device.
+ * Parameters:
+ *    - index: A complete scan index of the USB device.
+ * Returns:
+ *    - The first matching block, tagged with the position of its format in the index's
+ *      format list. Throws a NotFound RecoveryError if there is none.
+ **************************************************************************************/
+SignatureHit BlockRecovery::findFirstBlockOfType(const ScanIndex &index)
+{
+    if (index.hitCount() == 0)
     {
-        const char *match = std::search(buffer, buffer + bytesRead, fileTypeSignature.begin(), fileTypeSignature.end());
-        if (match != buffer + bytesRead)
-        {
-            int position = match - buffer;
-            int foundBlock = blockNumber + (position / bufferSize);
-            return foundBlock;
-        }
+        throw RecoveryError(RecoveryStatus::NotFound, "Could not find the specified file type on the USB device.");
     }
 
-    std::cerr << "Could not find the specified file type on the USB device.\n";
-    exit(1);
+    const IndexedHit &first = index.hits()[0];
+    SignatureHit hit = {static_cast<BlockNumber>(first.blockNumber), static_cast<int>(first.signatureIndex)};
+    return hit;
 }
 
 /**************************************************************************************
  * Function: findDirectBlocks
- * Description: Finds the direct blocks of a file on the USB device.
+ * Description: Finds the direct blocks of a file on the USB device. The run ends at
+ *              the first block that is all zero or holds a pointer array, since for a
+ *              file small enough to fit, the block after its data is free or is its
+ *              indirect block. A change between text and dense data does not end the
+ *              run: PDF and ZIP files mix both.
  * Parameters:
- *    - usb_fd: The file descriptor of the USB device.
+ *    - device: The USB device.
  *    - startBlock: The starting block number.
- *    - blockSize: The size of each block.
  *    - numDirectBlocks: The number of direct blocks to find.
+ *    - classes: An optional map of block classes from an earlier full scan; blocks are
+ *               read and checked directly when it is not given.
  * Returns:
- *    - A vector containing the direct block numbers.
+ *    - The direct blocks, a single run starting at startBlock.
  **************************************************************************************/
-std::vector<int> BlockRecovery::findDirectBlocks(int usb_fd, int startBlock, int blockSize, int numDirectBlocks)
+ExtentList BlockRecovery::findDirectBlocks(const BlockDevice &device, BlockNumber startBlock, int numDirectBlocks, const BlockClassMap *classes)
 {
-    std::vector<int> directBlocks;
-    char buffer[blockSize];
-    ssize_t bytesRead;
+    ExtentList directBlocks;
 
     for (int i = 0; i < numDirectBlocks; ++i)
     {
-        bytesRead = readBlock(usb_fd, startBlock + i, buffer, blockSize);
-
-        bool isEmpty = true;
-        for (int j = 0; j < bytesRead; ++j)
+        bool isEnd;
+        if (classes && !classes->empty())
         {
-            if (buffer[j] != '\0')
-            {
-                isEmpty = false;
-                break;
-            }
+            BlockClass blockClass = classes->get(startBlock + i);
+            isEnd = startBlock + i >= classes->blockCount() || blockClass == ZeroFilled || blockClass == PointerArray;
+        }
+        else
+        {
+            BlockView block = device.block(startBlock + i);
+            isEnd = endsDirectRun(block.data(), block.size(), device.blockSize(), device.blockCount());
         }
 
-        if (isEmpty)
+        if (isEnd)
         {
             break;
         }
 
-        directBlocks.push_back(startBlock + i);
+        directBlocks.append(startBlock + i);
     }
 
     return directBlocks;
 }
 
+/**************************************************************************************
+ * Function: endsDirectRun
+ * Description: Checks whether a block ends a run of direct blocks, by being all zero
+ *              or by holding a pointer array, like the indirect block after a file's
+ *              last direct block.
+ * Parameters:
+ *    - block: The block's contents.
+ *    - length: The number of bytes in block, less than blockSize at the device's end.
+ *    - blockSize: The device's block size.
+ *    - blockCount: The number of blocks on the device, which pointers must stay under.
+ * Returns:
+ *    - True if the block cannot be the next direct block of a file.
+ **************************************************************************************/
+bool BlockRecovery::endsDirectRun(const char *block, int length, int blockSize, BlockNumber blockCount)
+{
+    return isZeroBlock(block, length) || (length == blockSize && IndirectIndex::looksLikeIndirect(block, length, blockCount));
+}
+
 /**************************************************************************************
  * Function: findIndirectBlock
- * Description: Finds the indirect block with the specified value on the USB device.
+ * Description: Finds the indirect block with the specified value in a saved scan index.
  * Parameters:
- *    - usb_fd: The file descriptor of the USB device.
- *    - startBlock: The starting block number.
- *    - blockSize: The size of each block.
+ *    - index: A complete scan index of the USB device.
  *    - targetValue: The value to search for in the indirect blocks.
  * Returns:
- *    - The block number of the found indirect block.
+ *    - The block number of the found indirect block. Throws a NotFound RecoveryError
+ *      if no candidate holds targetValue.
  **************************************************************************************/
-
-int BlockRecovery::findIndirectBlock(int usb_fd, int startBlock, int blockSize, int targetValue)
+BlockNumber BlockRecovery::findIndirectBlock(const ScanIndex &index, BlockNumber targetValue)
 {
-    const int bufferSize = 4096;
-    char buffer[bufferSize];
-    int blockNumber = 0;
-    int bytesRead = 0;
-
-    unsigned char targetBytesValue[4];
-    targetBytesValue[0] = (targetValue >> 0) & 0xFF;
-    targetBytesValue[1] = (targetValue >> 8) & 0xFF;
-    targetBytesValue[2] = (targetValue >> 16) & 0xFF;
-    targetBytesValue[3] = (targetValue >> 24) & 0xFF;
-
-    while ((bytesRead = readBlock(usb_fd, blockNumber, buffer, blockSize)) == blockSize)
+    BlockNumber blockNumber = index.findIndirect(targetValue);
+    if (blockNumber != -1)
     {
-        if (memcmp(buffer, targetBytesValue, sizeof(targetBytesValue)) == 0)
-        {
-            return blockNumber;
-        }
-
-        ++blockNumber;
+        return blockNumber;
     }
 
-    std::cerr << "Could not find the indirect block with the specified value.\n";
-    exit(1);
+    throw RecoveryError(RecoveryStatus::NotFound, "Could not find the indirect block with the specified value.");
 }
 
 /**************************************************************************************
- * Function: findDoubleIndirectBlocks
- * Description: Finds the direct blocks of double indirect block a file on the USB device.
+ * Function: findIndirectBlock
+ * Description: Searches the device for the indirect block with the specified value,
+ *              for when no scan gave an index of the candidates. Chunks are searched in
+ *              parallel and the search stops at the first chunk holding a match, so
+ *              only a file whose indirect block lies far past its data reads the whole
+ *              device.
  * Parameters:
- *    - usb_fd: The file descriptor of the USB device.
- *    - doubleIndirectBlockNumber: The block number of the double indirect block.
- *    - blockSize: The size of each block.
+ *    - device: The USB device.
+ *    - targetValue: The value to search for in the indirect blocks.
+ *    - skipBlocks: If not null, blocks set in this map are neither read nor matched.
+ *    - firstBlock: The first block to search.
+ *    - blockCount: The number of blocks to search; clipped to the end of the device.
  * Returns:
- *    - A vector containing the direct block numbers.
+ *    - The lowest block number in the range holding targetValue as its first pointer.
+ *      Throws a NotFound RecoveryError if there is none.
  **************************************************************************************/
-std::vector<int> BlockRecovery::findDoubleIndirectBlocks(int usb_fd, int doubleIndirectBlockNumber, int blockSize)
+BlockNumber BlockRecovery::findIndirectBlock(const BlockDevice &device, BlockNumber targetValue, const BlockBitmap *skipBlocks,
+                                             BlockNumber firstBlock, BlockNumber blockCount)
 {
-    const int bufferSize = 4096;
-    char buffer[bufferSize];
-    int bytesRead = 0;
-    int blockCount = blockSize / sizeof(int);
-
-    std::vector<int> directBlockNumbers;
-    if (lseek(usb_fd, doubleIndirectBlockNumber * blockSize, SEEK_SET) == -1)
+    ParallelScanner scanner(device);
+    scanner.skipBlocks(skipBlocks);
+    scanner.blockRange(firstBlock, blockCount);
+    std::vector<BlockNumber> chunkMatch(scanner.chunkCount(), -1);
+    int blockSize = device.blockSize();
+    BlockNumber deviceBlocks = device.blockCount();
+
+    if (targetValue > 0 && targetValue <= UINT32_MAX)
     {
-        std::cerr << "Error seeking to double indirect block number " << doubleIndirectBlockNumber << std::endl;
-        exit(1);
-    }
-
-    bytesRead = read(usb_fd, buffer, bufferSize);
-    if (bytesRead == -1)
-    {
-        std::cerr << "Error reading double indirect block number " << doubleIndirectBlockNumber << std::endl;
-        exit(1);
+        scanner.run([&](int chunk, BlockNumber runStart, int runBlocks, const BlockView &window)
+        {
+            for (int i = 0; i < runBlocks && runStart + i <= UINT32_MAX; ++i)
+            {
+                ssize_t pos = static_cast<ssize_t>(i) * blockSize;
+                if (pos + blockSize > window.size())
+                {
+                    break;
+                }
+                if (window.pointer(pos / sizeof(uint32_t)) == targetValue &&
+                    IndirectIndex::looksLikeIndirect(window.data() + pos, blockSize, deviceBlocks))
+                {
+                    chunkMatch[chunk] = runStart + i;
+                    return true;
+                }
+            }
+            return false;
+        });
     }
 
-    int doubleIndirectBlockNumbers[blockCount];
-    memcpy(doubleIndirectBlockNumbers, buffer, bytesRead);
-    bool noTripleIndirectBlocks = false;
-
-    for (int i = 0; i < blockCount; ++i)
+    for (size_t chunk = 0; chunk < chunkMatch.size(); ++chunk)
     {
-        int indirectBlockNumber = doubleIndirectBlockNumbers[i];
-        if (indirectBlockNumber == 0)
-        {
-            noTripleIndirectBlocks = true;
-            break;
-        }
-
-        if (lseek(usb_fd, indirectBlockNumber * blockSize, SEEK_SET) == -1)
+        if (chunkMatch[chunk] != -1)
         {
-            std::cerr << "Error seeking to indirect block number " << indirectBlockNumber << std::endl;
-            exit(1);
-        }
-
-        bytesRead = read(usb_fd, buffer, bufferSize);
-        if (bytesRead == -1)
-        {
-            std::cerr << "Error reading indirect block number " << indirectBlockNumber << std::endl;
-            exit(1);
-        }
-
-        int indirectBlockNumbers[blockCount];
-        memcpy(indirectBlockNumbers, buffer, bytesRead);
-
-        for (int j = 0; j < blockCount; ++j)
-        {
-            int directBlockNumber = indirectBlockNumbers[j];
-            if (directBlockNumber == 0)
-            {
-                break;
-            }
-            directBlockNumbers.push_back(directBlockNumber);
+            return chunkMatch[chunk];
         }
     }
-    if (noTripleIndirectBlocks)
-        directBlockNumbers.push_back(0);
 
-    return directBlockNumbers;
+    throw RecoveryError(RecoveryStatus::NotFound, "Could not find the indirect block with the specified value.");
+}
+
+/**************************************************************************************
+ * Function: findDoubleIndirectBlocks
+ * Description: Finds the direct blocks of double indirect block a file on the USB device.
+ * Parameters:
+ *    - cache: The block cache to read the USB device through.
+ *    - doubleIndirectBlockNumber: The block number of the double indirect block.
+ *    - full: If not null, set to whether every pointer in the double indirect block is
+ *            in use, i.e. whether the file may go on into a triple indirect block.
+ * Returns:
+ *    - The data blocks, in file order.
+ **************************************************************************************/
+ExtentList BlockRecovery::findDoubleIndirectBlocks(BlockCache &cache, BlockNumber doubleIndirectBlockNumber, bool *full)
+{
+    return resolvePointerTree(cache, doubleIndirectBlockNumber, 2, full);
 }
 
 /**************************************************************************************
  * Function: findTripleIndirectBlocks
  * Description: Finds the triple indirect blocks of a file on the USB device.
  * Parameters:
- *    - usb_fd: The file descriptor of the USB device.
+ *    - cache: The block cache to read the USB device through.
  *    - tripleIndirectBlock: The block number of the triple indirect block.
- *    - blockSize: The size of each block.
  * Returns:
- *    - A vector containing the triple indirect block numbers.
+ *    - The data blocks, in file order.
  **************************************************************************************/
-std::vector<int> BlockRecovery::findTripleIndirectBlocks(int usb_fd, int tripleIndirectBlockNumber, int blockSize)
+ExtentList BlockRecovery::findTripleIndirectBlocks(BlockCache &cache, BlockNumber tripleIndirectBlockNumber)
 {
-    const int bufferSize = 4096;
-    char buffer[bufferSize];
-    int bytesRead = 0;
-    int blockCount = blockSize / sizeof(int);
-
-    std::vector<int> directBlockNumbers;
+    return resolvePointerTree(cache, tripleIndirectBlockNumber, 3);
+}
 
-    if (lseek(usb_fd, tripleIndirectBlockNumber * blockSize, SEEK_SET) == -1)
-    {
-        std::cerr << "Error seeking to triple indirect block number " << tripleIndirectBlockNumber << std::endl;
-        exit(1);
-    }
+/**************************************************************************************
+ * Function: resolvePointerTree
+ * Description: Resolves a tree of pointer blocks breadth-first. The pointers of a whole
+ *              level are gathered in file order, and the blocks they name are sorted,
+ *              deduplicated and read as one batch, so a triple indirect tree takes three
+ *              batched rounds instead of a chain of dependent single-block reads. Each
+ *              block's pointers are parsed in place from the read buffer.
+ * Parameters:
+ *    - cache: The block cache to read the USB device through.
+ *    - root: The block number of the tree's top pointer block.
+ *    - depth: The number of pointer levels: 2 for double and 3 for triple indirect.
+ *    - full: If not null, set to whether every pointer in the root is in use.
+ * Returns:
+ *    - The data blocks, in file order. Each pointer block's pointers stop at its first
+ *      unused (zero) pointer.
+ **************************************************************************************/
+ExtentList BlockRecovery::resolvePointerTree(BlockCache &cache, BlockNumber root, int depth, bool *full)
+{
+    static const char *const levelNames[] = {"", "indirect", "double indirect", "triple indirect"};
+    std::vector<BlockNumber> level(1, root);
 
-    bytesRead = read(usb_fd, buffer, bufferSize);
-    if (bytesRead == -1)
+    for (int height = depth; height > 0; --height)
     {
-        std::cerr << "Error reading triple indirect block number " << tripleIndirectBlockNumber << std::endl;
-        exit(1);
-    }
-
-    int tripleIndirectBlockNumbers[blockCount];
-    memcpy(tripleIndirectBlockNumbers, buffer, bytesRead);
+        std::vector<BlockNumber> batch(level);
+        std::sort(batch.begin(), batch.end());
+        batch.erase(std::unique(batch.begin(), batch.end()), batch.end());
+
+        // Each block's pointers, as a range of children, indexed by the block's place in batch
+        std::vector<BlockNumber> children;
+        std::vector<std::pair<size_t, int> > ranges(batch.size(), std::make_pair(0, -1));
+        cache.readBatch(batch, [&](BlockNumber blockNumber, const BlockView &block)
+        {
+            size_t slot = std::lower_bound(batch.begin(), batch.end(), blockNumber) - batch.begin();
+            int count = firstZeroPointer(block.data(), block.pointerCount());
+            ranges[slot] = std::make_pair(children.size(), block.size() > 0 ? count : -1);
+            for (int i = 0; i < count; ++i)
+            {
+                children.push_back(block.pointer(i));
+            }
+            if (full && height == depth)
+            {
+                *full = count == block.pointerCount();
+            }
+        });
 
-    for (int i = 0; i < blockCount; ++i)
-    {
-        int doubleIndirectBlockNumber = tripleIndirectBlockNumbers[i];
-        if (doubleIndirectBlockNumber == 0)
+        for (size_t i = 0; i < batch.size(); ++i)
         {
-            break;
-            ;
+            if (ranges[i].second < 0)
+            {
+                throw RecoveryError(RecoveryStatus::DeviceError, std::string("Error reading ") + levelNames[height] + " block number " + std::to_string(batch[i]));
+            }
         }
 
-        std::vector<int> doubleIndirectBlocks = findDoubleIndirectBlocks(usb_fd, doubleIndirectBlockNumber, blockSize);
-
-        directBlockNumbers.insert(directBlockNumbers.end(), doubleIndirectBlocks.begin(), doubleIndirectBlocks.end());
+        // The next level, in file order: each block's pointers wherever the block appears
+        std::vector<BlockNumber> next;
+        for (size_t i = 0; i < level.size(); ++i)
+        {
+            const std::pair<size_t, int> &range = ranges[std::lower_bound(batch.begin(), batch.end(), level[i]) - batch.begin()];
+            next.insert(next.end(), children.begin() + range.first, children.begin() + range.first + range.second);
+        }
+        level.swap(next);
     }
 
-    return directBlockNumbers;
+    ExtentList dataBlocks;
+    for (size_t i = 0; i < level.size(); ++i)
+    {
+        dataBlocks.append(level[i]);
+    }
+    return dataBlocks;
 }
 
 /**************************************************************************************
  * Function: getBlockNumbersFromIndirect
  * Description: Retrieves the block numbers from the given indirect block on the USB device.
  * Parameters:
- *    - usb_fd: The file descriptor of the USB device.
+ *    - cache: The block cache to read the USB device through.
  *    - indirectBlockNumber: The block number of the indirect block.
- *    - blockSize: The size of each block.
+ *    - full: If not null, set to whether the last pointer in the block is in use, i.e.
+ *            whether the file may go on into a double indirect block.
  * Returns:
- *    - A vector containing the direct block numbers.
+ *    - The data blocks, in file order. Unused (zero) pointers are left out.
  **************************************************************************************/
-std::vector<int> BlockRecovery::getBlockNumbersFromIndirect(int usb_fd, int indirectBlockNumber, int blockSize)
+ExtentList BlockRecovery::getBlockNumbersFromIndirect(BlockCache &cache, BlockNumber indirectBlockNumber, bool *full)
 {
-
-    const int bufferSize = 4096;
-    char buffer[bufferSize];
-    int bytesRead = 0;
-    int directBlockCount = blockSize / sizeof(int);
-
-    if (lseek(usb_fd, indirectBlockNumber * blockSize, SEEK_SET) == -1)
+    BlockView indirectBlock = cache.block(indirectBlockNumber);
+    if (indirectBlock.size() == 0)
     {
-        std::cerr << "Error seeking to indirect block number " << indirectBlockNumber << std::endl;
-        exit(1);
+        throw RecoveryError(RecoveryStatus::DeviceError, "Error reading indirect block number " + std::to_string(indirectBlockNumber));
     }
 
-    bytesRead = read(usb_fd, buffer, bufferSize);
-    if (bytesRead == -1)
+    ExtentList directBlockNumbers;
+
+    for (int i = 0; i < indirectBlock.pointerCount(); ++i)
     {
-        std::cerr << "Error reading indirect block number " << indirectBlockNumber << std::endl;
-        exit(1);
+        directBlockNumbers.append(indirectBlock.pointer(i));
     }
-
-    int *blockNumbers = reinterpret_cast<int *>(buffer);
-    std::vector<int> directBlockNumbers;
-
-    for (int i = 0; i < directBlockCount; ++i)
+    if (full)
     {
-        directBlockNumbers.push_back(blockNumbers[i]);
+        *full = indirectBlock.pointerCount() > 0 && indirectBlock.pointer(indirectBlock.pointerCount() - 1) != 0;
     }
 
     return directBlockNumbers;
@@ -7,16 +7,32 @@
 #include <algorithm>
 #include <iomanip>
 #include <vector>
+#include "BlockCache.h"
+#include "BlockDevice.h"
+#include "ExtentList.h"
+#include "IndirectIndex.h"
+#include "BlockBitmap.h"
+#include "BlockClassMap.h"
+#include "ZeroDetect.h"
+#include "ScanIndex.h"
+#include "SignatureScanner.h"
 
 class BlockRecovery
 {
 public:
-    static int findFirstBlockOfType(int usb_fd, const std::string &fileTypeSignature);
-    static std::vector<int> findDirectBlocks(int usb_fd, int startBlock, int blockSize, int numDirectBlocks);
-    static int findIndirectBlock(int usb_fd, int startBlock, int blockSize, int targetValue);
-    static std::vector<int> findDoubleIndirectBlocks(int usb_fd, int doubleIndirectBlock, int blockSize);
-    static std::vector<int> findTripleIndirectBlocks(int usb_fd, int tripleIndirectBlock, int blockSize);
-    static std::vector<int> getBlockNumbersFromIndirect(int usb_fd, int indirectBlockNumber, int blockSize);
+    static SignatureHit findFirstBlockOfType(const BlockDevice &device, const std::vector<FileFormat> &formats, const BlockBitmap *skipBlocks = 0);
+    static SignatureHit findFirstBlockOfType(const ScanIndex &index);
+    static ExtentList findDirectBlocks(const BlockDevice &device, BlockNumber startBlock, int numDirectBlocks, const BlockClassMap *classes = 0);
+    static bool endsDirectRun(const char *block, int length, int blockSize, BlockNumber blockCount);
+    static BlockNumber findIndirectBlock(const ScanIndex &index, BlockNumber targetValue);
+    static BlockNumber findIndirectBlock(const BlockDevice &device, BlockNumber targetValue, const BlockBitmap *skipBlocks = 0,
+                                         BlockNumber firstBlock = 0, BlockNumber blockCount = INT64_MAX);
+    static ExtentList findDoubleIndirectBlocks(BlockCache &cache, BlockNumber doubleIndirectBlock, bool *full = 0);
+    static ExtentList findTripleIndirectBlocks(BlockCache &cache, BlockNumber tripleIndirectBlock);
+    static ExtentList getBlockNumbersFromIndirect(BlockCache &cache, BlockNumber indirectBlockNumber, bool *full = 0);
+
+private:
+    static ExtentList resolvePointerTree(BlockCache &cache, BlockNumber root, int depth, bool *full = 0);
 };
 
 #endif // BLOCKRECOVERY_H
@@ -0,0 +1,67 @@
+#ifndef BOUNDEDQUEUE_H
+#define BOUNDEDQUEUE_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+
+// A blocking FIFO with a fixed capacity for handing work between pipeline stages.
+// Producers wait while it is full, consumers wait while it is empty, and close()
+// wakes everyone once the producing stage is done.
+template <typename T>
+class BoundedQueue
+{
+public:
+    explicit BoundedQueue(size_t capacity) : capacity(capacity < 1 ? 1 : capacity), closed(false) {}
+
+    // Returns false, dropping item, if the queue was closed
+    bool push(T item)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        notFull.wait(lock, [this] { return closed || items.size() < capacity; });
+        if (closed)
+        {
+            return false;
+        }
+        items.push_back(std::move(item));
+        notEmpty.notify_one();
+        return true;
+    }
+
+    // Returns false once the queue is closed and drained
+    bool pop(T &item)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        notEmpty.wait(lock, [this] { return closed || !items.empty(); });
+        if (items.empty())
+        {
+            return false;
+        }
+        item = std::move(items.front());
+        items.pop_front();
+        notFull.notify_one();
+        return true;
+    }
+
+    void close()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        closed = true;
+        notEmpty.notify_all();
+        notFull.notify_all();
+    }
+
+private:
+    BoundedQueue(const BoundedQueue &);
+    BoundedQueue &operator=(const BoundedQueue &);
+
+    size_t capacity;
+    bool closed;
+    std::deque<T> items;
+    std::mutex mutex;
+    std::condition_variable notEmpty;
+    std::condition_variable notFull;
+};
+
+#endif // BOUNDEDQUEUE_H
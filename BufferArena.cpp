@@ -0,0 +1,101 @@
+#include "BufferArena.h"
+#include <cstdlib>
+
+// Buffers are aligned for O_DIRECT-style reads and io_uring fixed buffers
+static const size_t bufferAlignment = 4096;
+
+// Idle memory the shared arena keeps before freeing released buffers
+static const size_t sharedRetainMiB = 256;
+
+/**************************************************************************************
+ * Function: BufferArena
+ * Description: Creates an empty arena.
+ * Parameters:
+ *    - retainLimit: The most bytes of released buffers kept for reuse; buffers
+ *                   released beyond it are freed.
+ **************************************************************************************/
+BufferArena::BufferArena(size_t retainLimit)
+    : idleTotal(0), retainLimit(retainLimit)
+{
+}
+
+BufferArena::~BufferArena()
+{
+    for (std::unordered_map<size_t, std::vector<char *> >::iterator it = idle.begin(); it != idle.end(); ++it)
+    {
+        for (size_t i = 0; i < it->second.size(); ++i)
+        {
+            free(it->second[i]);
+        }
+    }
+}
+
+/**************************************************************************************
+ * Function: acquire
+ * Description: Returns an aligned buffer, reusing a released one of the same size when
+ *              there is one. Its contents are undefined.
+ * Parameters:
+ *    - size: The size of the buffer in bytes.
+ * Returns:
+ *    - The buffer, or null if it could not be allocated.
+ **************************************************************************************/
+char *BufferArena::acquire(size_t size)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::unordered_map<size_t, std::vector<char *> >::iterator found = idle.find(size);
+        if (found != idle.end() && !found->second.empty())
+        {
+            char *buffer = found->second.back();
+            found->second.pop_back();
+            idleTotal -= size;
+            return buffer;
+        }
+    }
+
+    void *memory = 0;
+    if (posix_memalign(&memory, bufferAlignment, size == 0 ? bufferAlignment : size) != 0)
+    {
+        return 0;
+    }
+    return static_cast<char *>(memory);
+}
+
+/**************************************************************************************
+ * Function: release
+ * Description: Gives a buffer back for reuse, or frees it if the arena already keeps
+ *              as much idle memory as it may.
+ * Parameters:
+ *    - buffer: A buffer from acquire, or null.
+ *    - size: The size it was acquired with.
+ **************************************************************************************/
+void BufferArena::release(char *buffer, size_t size)
+{
+    if (!buffer)
+    {
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (idleTotal + size <= retainLimit)
+        {
+            idle[size].push_back(buffer);
+            idleTotal += size;
+            return;
+        }
+    }
+    free(buffer);
+}
+
+size_t BufferArena::idleBytes() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return idleTotal;
+}
+
+BufferArena &BufferArena::shared()
+{
+    static BufferArena arena(sharedRetainMiB << 20);
+    return arena;
+}
@@ -0,0 +1,37 @@
+#ifndef BUFFERARENA_H
+#define BUFFERARENA_H
+
+#include <cstddef>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+// Hands out 4 KiB-aligned I/O buffers and keeps released ones for reuse, so the
+// readers, writers and caches made for every file and every engine do not go back to
+// the allocator each time. Buffers are reused by exact size; the I/O classes only ask
+// for a few sizes. Safe to use from several threads at once.
+class BufferArena
+{
+public:
+    explicit BufferArena(size_t retainLimit);
+    ~BufferArena();
+
+    char *acquire(size_t size);
+    void release(char *buffer, size_t size);
+
+    size_t idleBytes() const;
+
+    // The arena every engine in the process shares
+    static BufferArena &shared();
+
+private:
+    BufferArena(const BufferArena &);
+    BufferArena &operator=(const BufferArena &);
+
+    mutable std::mutex mutex;
+    std::unordered_map<size_t, std::vector<char *> > idle;
+    size_t idleTotal;
+    size_t retainLimit;
+};
+
+#endif // BUFFERARENA_H
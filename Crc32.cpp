@@ -0,0 +1,172 @@
+#include "Crc32.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CRC32_X86 1
+#endif
+
+// The reflected CRC-32 polynomial used by ZIP, gzip and PNG. This is not the Castagnoli
+// polynomial computed by the SSE4.2 crc32 instruction, so that instruction cannot be used.
+static const uint32_t crcPolynomial = 0xEDB88320;
+
+/**************************************************************************************
+ * Slicing-by-8 tables: table[k][b] is the CRC of byte b followed by k zero bytes, so
+ * eight input bytes can be folded in with eight independent lookups.
+ **************************************************************************************/
+struct CrcTables
+{
+    uint32_t table[8][256];
+
+    CrcTables()
+    {
+        for (uint32_t b = 0; b < 256; ++b)
+        {
+            uint32_t crc = b;
+            for (int bit = 0; bit < 8; ++bit)
+            {
+                crc = (crc >> 1) ^ (crc & 1 ? crcPolynomial : 0);
+            }
+            table[0][b] = crc;
+        }
+        for (int k = 1; k < 8; ++k)
+        {
+            for (uint32_t b = 0; b < 256; ++b)
+            {
+                table[k][b] = (table[k - 1][b] >> 8) ^ table[0][table[k - 1][b] & 0xFF];
+            }
+        }
+    }
+};
+
+static const CrcTables crcTables;
+
+// Works on the inverted running CRC, like the carry-less kernel below
+static uint32_t crc32Scalar(uint32_t crc, const unsigned char *p, size_t length)
+{
+    const uint32_t (*t)[256] = crcTables.table;
+
+    for (; length >= 8; p += 8, length -= 8)
+    {
+        uint32_t low = crc ^ (p[0] | (p[1] << 8) | (p[2] << 16) | (static_cast<uint32_t>(p[3]) << 24));
+        crc = t[7][low & 0xFF] ^ t[6][(low >> 8) & 0xFF] ^ t[5][(low >> 16) & 0xFF] ^ t[4][low >> 24] ^
+              t[3][p[4]] ^ t[2][p[5]] ^ t[1][p[6]] ^ t[0][p[7]];
+    }
+    for (; length > 0; ++p, --length)
+    {
+        crc = (crc >> 8) ^ t[0][(crc ^ *p) & 0xFF];
+    }
+    return crc;
+}
+
+#ifdef CRC32_X86
+
+/**************************************************************************************
+ * Carry-less multiply kernel (Intel, "Fast CRC Computation for Generic Polynomials
+ * Using PCLMULQDQ"). Four 128-bit lanes are folded 64 bytes at a time, reduced to one
+ * lane, then to 32 bits with a Barrett reduction. Needs at least 64 bytes; the caller
+ * hands it a multiple of 16 and finishes the tail with the table kernel.
+ **************************************************************************************/
+alignas(16) static const uint64_t foldBy4[2] = {0x0154442bd4, 0x01c6e41596};
+alignas(16) static const uint64_t foldBy1[2] = {0x01751997d0, 0x00ccaa009e};
+alignas(16) static const uint64_t fold64[2] = {0x0163cd6124, 0x0000000000};
+alignas(16) static const uint64_t barrett[2] = {0x01db710641, 0x01f7011641};
+
+__attribute__((target("pclmul,sse4.1"))) static uint32_t crc32Clmul(uint32_t crc, const unsigned char *p, size_t length)
+{
+    __m128i x1 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 0x00));
+    __m128i x2 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 0x10));
+    __m128i x3 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 0x20));
+    __m128i x4 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 0x30));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+
+    __m128i k = _mm_load_si128(reinterpret_cast<const __m128i *>(foldBy4));
+    p += 64;
+    length -= 64;
+
+    for (; length >= 64; p += 64, length -= 64)
+    {
+        __m128i x5 = _mm_clmulepi64_si128(x1, k, 0x00);
+        __m128i x6 = _mm_clmulepi64_si128(x2, k, 0x00);
+        __m128i x7 = _mm_clmulepi64_si128(x3, k, 0x00);
+        __m128i x8 = _mm_clmulepi64_si128(x4, k, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, k, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, k, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, k, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, k, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 0x00)));
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 0x10)));
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 0x20)));
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 0x30)));
+    }
+
+    // Fold the four lanes into one, then any remaining 16-byte blocks into that
+    k = _mm_load_si128(reinterpret_cast<const __m128i *>(foldBy1));
+    __m128i lanes[3] = {x2, x3, x4};
+    for (int i = 0; i < 3; ++i)
+    {
+        __m128i x5 = _mm_clmulepi64_si128(x1, k, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, k, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, lanes[i]), x5);
+    }
+    for (; length >= 16; p += 16, length -= 16)
+    {
+        __m128i x5 = _mm_clmulepi64_si128(x1, k, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, k, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, _mm_loadu_si128(reinterpret_cast<const __m128i *>(p))), x5);
+    }
+
+    // 128 bits down to 64
+    __m128i mask = _mm_setr_epi32(~0, 0, ~0, 0);
+    __m128i x2r = _mm_clmulepi64_si128(x1, k, 0x10);
+    x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2r);
+    k = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(fold64));
+    x2r = _mm_srli_si128(x1, 4);
+    x1 = _mm_xor_si128(_mm_clmulepi64_si128(_mm_and_si128(x1, mask), k, 0x00), x2r);
+
+    // Barrett reduction to 32 bits
+    k = _mm_load_si128(reinterpret_cast<const __m128i *>(barrett));
+    x2r = _mm_clmulepi64_si128(_mm_and_si128(x1, mask), k, 0x10);
+    x2r = _mm_clmulepi64_si128(_mm_and_si128(x2r, mask), k, 0x00);
+    x1 = _mm_xor_si128(x1, x2r);
+    return _mm_extract_epi32(x1, 1);
+}
+
+static bool hasClmul()
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1");
+}
+
+static const bool useClmul = hasClmul();
+
+#endif
+
+/**************************************************************************************
+ * Function: crc32Update
+ * Description: Extends a ZIP/zlib CRC-32 with more data, so a file's CRC can be built
+ *              up block by block. Large buffers use carry-less multiplication when the
+ *              CPU has it; everything else uses slicing-by-8 tables.
+ * Parameters:
+ *    - crc: The CRC of the data so far, 0 to start.
+ *    - data: The next bytes.
+ *    - length: The number of bytes in data.
+ * Returns:
+ *    - The CRC of the data so far followed by data.
+ **************************************************************************************/
+uint32_t crc32Update(uint32_t crc, const char *data, size_t length)
+{
+    const unsigned char *p = reinterpret_cast<const unsigned char *>(data);
+    crc = ~crc;
+
+#ifdef CRC32_X86
+    if (useClmul && length >= 64)
+    {
+        size_t bulk = length & ~static_cast<size_t>(15);
+        crc = crc32Clmul(crc, p, bulk);
+        p += bulk;
+        length -= bulk;
+    }
+#endif
+
+    return ~crc32Scalar(crc, p, length);
+}
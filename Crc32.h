@@ -0,0 +1,9 @@
+#ifndef CRC32_H
+#define CRC32_H
+
+#include <cstddef>
+#include <stdint.h>
+
+uint32_t crc32Update(uint32_t crc, const char *data, size_t length);
+
+#endif // CRC32_H
@@ -0,0 +1,268 @@
+#include "Ext2FileSystem.h"
+#include <algorithm>
+#include <cstring>
+
+// On-disk layout constants from the ext2/ext3 specification
+static const uint16_t ext2Magic = 0xEF53;
+static const uint32_t incompat64Bit = 0x80;
+static const uint16_t blockUninit = 0x2;
+
+static inline uint16_t le16(const char *p)
+{
+    const unsigned char *u = reinterpret_cast<const unsigned char *>(p);
+    return u[0] | (u[1] << 8);
+}
+
+static inline uint32_t le32(const char *p)
+{
+    const unsigned char *u = reinterpret_cast<const unsigned char *>(p);
+    return u[0] | (u[1] << 8) | (u[2] << 16) | (static_cast<uint32_t>(u[3]) << 24);
+}
+
+Ext2FileSystem::Ext2FileSystem()
+    : fsBlockSize(0), blocksCount(0), inodesCount(0), firstDataBlock(0), blocksPerGroup(0),
+      inodesInGroup(0), fsInodeSize(0), journalInodeNumber(0), freeBlocks(0), errorLog(0)
+{
+    memset(fsUuid, 0, sizeof(fsUuid));
+}
+
+/**************************************************************************************
+ * Function: parseGeometry
+ * Description: Checks a raw superblock and reads the block size and block count.
+ * Parameters:
+ *    - superblock: The superblockSize bytes found at superblockOffset.
+ *    - blockSize: Receives the file system block size.
+ *    - blockCount: Receives the number of blocks in the file system.
+ * Returns:
+ *    - True if the superblock belongs to an ext2/ext3 file system.
+ **************************************************************************************/
+bool Ext2FileSystem::parseGeometry(const char *superblock, int &blockSize, uint32_t &blockCount)
+{
+    uint32_t logBlockSize = le32(superblock + 24);
+    if (le16(superblock + 56) != ext2Magic || logBlockSize > 6)
+    {
+        return false;
+    }
+
+    blockSize = 1024 << logBlockSize;
+    blockCount = le32(superblock + 4);
+    return true;
+}
+
+/**************************************************************************************
+ * Function: load
+ * Description: Reads the superblock, the group descriptor table and every group's block
+ *              bitmap. On success the device is switched to the file system block size.
+ * Parameters:
+ *    - device: The USB device.
+ * Returns:
+ *    - True if the device holds a readable ext2/ext3 file system.
+ **************************************************************************************/
+bool Ext2FileSystem::load(BlockDevice &device)
+{
+    BlockView superblock = device.view(superblockOffset, superblockSize);
+    if (superblock.size() != superblockSize)
+    {
+        return false;
+    }
+
+    const char *sb = superblock.data();
+    if (!parseGeometry(sb, fsBlockSize, blocksCount))
+    {
+        return false;
+    }
+
+    inodesCount = le32(sb + 0);
+    firstDataBlock = le32(sb + 20);
+    blocksPerGroup = le32(sb + 32);
+    inodesInGroup = le32(sb + 40);
+    fsInodeSize = le32(sb + 76) == 0 ? 128 : le16(sb + 88);
+    journalInodeNumber = le32(sb + 224);
+    memcpy(fsUuid, sb + 104, sizeof(fsUuid));
+
+    if (blocksPerGroup == 0 || inodesInGroup == 0 || blocksCount <= firstDataBlock)
+    {
+        return false;
+    }
+
+    // Inode table lookups divide by the inode size and by the inodes per block
+    if (fsInodeSize < 128 || (fsInodeSize & (fsInodeSize - 1)) != 0 || fsInodeSize > fsBlockSize)
+    {
+        return false;
+    }
+
+    int descriptorSize = 32;
+    if ((le32(sb + 96) & incompat64Bit) && le16(sb + 254) > 32)
+    {
+        descriptorSize = le16(sb + 254);
+    }
+
+    uint32_t groupCount = (blocksCount - firstDataBlock + blocksPerGroup - 1) / blocksPerGroup;
+    BlockView table = device.view(static_cast<off_t>(firstDataBlock + 1) * fsBlockSize,
+                                  static_cast<size_t>(groupCount) * descriptorSize);
+    if (table.size() != static_cast<ssize_t>(groupCount) * descriptorSize)
+    {
+        if (errorLog)
+        {
+            *errorLog << "Failed to read the group descriptor table.\n";
+        }
+        return false;
+    }
+
+    groupDescriptors.clear();
+    for (uint32_t g = 0; g < groupCount; ++g)
+    {
+        const char *desc = table.data() + static_cast<size_t>(g) * descriptorSize;
+        GroupDescriptor group;
+        group.blockBitmap = le32(desc + 0);
+        group.inodeBitmap = le32(desc + 4);
+        group.inodeTable = le32(desc + 8);
+        group.flags = le16(desc + 18);
+        groupDescriptors.push_back(group);
+    }
+
+    if (!readBlockBitmaps(device))
+    {
+        return false;
+    }
+
+    device.setBlockSize(fsBlockSize);
+    return true;
+}
+
+/**************************************************************************************
+ * Function: readBlockBitmaps
+ * Description: Builds a device-wide map of allocated blocks from the per-group block
+ *              bitmaps. Blocks before the first data block are always allocated, and
+ *              groups whose bitmap was never initialised are entirely free.
+ * Parameters:
+ *    - device: The USB device.
+ * Returns:
+ *    - True if every bitmap could be read.
+ **************************************************************************************/
+bool Ext2FileSystem::readBlockBitmaps(const BlockDevice &device)
+{
+    allocated = BlockBitmap(blocksCount);
+    freeBlocks = 0;
+
+    for (uint32_t block = 0; block < firstDataBlock; ++block)
+    {
+        allocated.set(block);
+    }
+
+    for (size_t g = 0; g < groupDescriptors.size(); ++g)
+    {
+        uint32_t groupStart = firstDataBlock + g * blocksPerGroup;
+        uint32_t groupBlocks = std::min(blocksPerGroup, blocksCount - groupStart);
+
+        if (groupDescriptors[g].flags & blockUninit)
+        {
+            freeBlocks += groupBlocks;
+            continue;
+        }
+
+        BlockView bitmap = device.view(static_cast<off_t>(groupDescriptors[g].blockBitmap) * fsBlockSize, fsBlockSize);
+        if (bitmap.size() * 8 < static_cast<ssize_t>(groupBlocks))
+        {
+            if (errorLog)
+            {
+                *errorLog << "Failed to read the block bitmap of group " << g << ".\n";
+            }
+            return false;
+        }
+
+        const unsigned char *bits = reinterpret_cast<const unsigned char *>(bitmap.data());
+        for (uint32_t i = 0; i < groupBlocks; ++i)
+        {
+            if (bits[i / 8] & (1 << (i % 8)))
+            {
+                allocated.set(groupStart + i);
+            }
+            else
+            {
+                ++freeBlocks;
+            }
+        }
+    }
+
+    return true;
+}
+
+/**************************************************************************************
+ * Function: parseInode
+ * Description: Decodes the fields of an on-disk inode that recovery needs.
+ * Parameters:
+ *    - raw: The on-disk inode.
+ *    - inode: Receives the decoded fields.
+ **************************************************************************************/
+void Ext2FileSystem::parseInode(const char *raw, Inode &inode)
+{
+    inode.mode = le16(raw + 0);
+    inode.size = le32(raw + 4) | (static_cast<uint64_t>(le32(raw + 108)) << 32);
+    inode.flags = le32(raw + 32);
+    for (int i = 0; i < 15; ++i)
+    {
+        inode.block[i] = le32(raw + 40 + i * 4);
+    }
+}
+
+/**************************************************************************************
+ * Function: readInode
+ * Description: Reads an inode from its group's inode table.
+ * Parameters:
+ *    - device: The USB device.
+ *    - inodeNumber: The inode number, starting at 1.
+ *    - inode: Receives the decoded inode.
+ * Returns:
+ *    - True if the inode could be read.
+ **************************************************************************************/
+bool Ext2FileSystem::readInode(const BlockDevice &device, uint32_t inodeNumber, Inode &inode) const
+{
+    if (inodeNumber == 0 || inodeNumber > inodesCount)
+    {
+        return false;
+    }
+
+    uint32_t group = (inodeNumber - 1) / inodesInGroup;
+    uint32_t index = (inodeNumber - 1) % inodesInGroup;
+    if (group >= groupDescriptors.size())
+    {
+        return false;
+    }
+
+    off_t offset = static_cast<off_t>(groupDescriptors[group].inodeTable) * fsBlockSize + static_cast<off_t>(index) * fsInodeSize;
+    BlockView raw = device.view(offset, fsInodeSize);
+    if (raw.size() != fsInodeSize)
+    {
+        return false;
+    }
+
+    parseInode(raw.data(), inode);
+    return true;
+}
+
+/**************************************************************************************
+ * Function: isInodeTableBlock
+ * Description: Checks whether a block belongs to one of the groups' inode tables.
+ * Parameters:
+ *    - blockNumber: The block number to check.
+ *    - firstInode: Receives the number of the first inode stored in the block.
+ * Returns:
+ *    - True if the block is part of an inode table.
+ **************************************************************************************/
+bool Ext2FileSystem::isInodeTableBlock(uint32_t blockNumber, uint32_t &firstInode) const
+{
+    uint32_t inodesPerBlock = fsBlockSize / fsInodeSize;
+    uint32_t tableBlocks = (inodesInGroup + inodesPerBlock - 1) / inodesPerBlock;
+
+    for (size_t g = 0; g < groupDescriptors.size(); ++g)
+    {
+        uint32_t tableStart = groupDescriptors[g].inodeTable;
+        if (blockNumber >= tableStart && blockNumber < tableStart + tableBlocks)
+        {
+            firstInode = g * inodesInGroup + (blockNumber - tableStart) * inodesPerBlock + 1;
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,73 @@
+#ifndef EXT2FILESYSTEM_H
+#define EXT2FILESYSTEM_H
+
+#include <ostream>
+#include <vector>
+#include <stdint.h>
+#include "BlockBitmap.h"
+#include "BlockDevice.h"
+
+struct GroupDescriptor
+{
+    uint32_t blockBitmap;
+    uint32_t inodeBitmap;
+    uint32_t inodeTable;
+    uint16_t flags;
+};
+
+struct Inode
+{
+    uint16_t mode;
+    uint32_t flags;
+    uint64_t size;
+    uint32_t block[15];
+};
+
+class Ext2FileSystem
+{
+public:
+    Ext2FileSystem();
+
+    static const off_t superblockOffset = 1024;
+    static const int superblockSize = 1024;
+
+    bool load(BlockDevice &device);
+    void logTo(std::ostream *errors) { errorLog = errors; }
+
+    int blockSize() const { return fsBlockSize; }
+    uint32_t blockCount() const { return blocksCount; }
+    uint32_t inodeCount() const { return inodesCount; }
+    uint32_t inodesPerGroup() const { return inodesInGroup; }
+    int inodeSize() const { return fsInodeSize; }
+    uint32_t journalInode() const { return journalInodeNumber; }
+    const unsigned char *uuid() const { return fsUuid; }
+    const std::vector<GroupDescriptor> &groups() const { return groupDescriptors; }
+
+    static bool parseGeometry(const char *superblock, int &blockSize, uint32_t &blockCount);
+    static void parseInode(const char *raw, Inode &inode);
+    bool readInode(const BlockDevice &device, uint32_t inodeNumber, Inode &inode) const;
+    bool isInodeTableBlock(uint32_t blockNumber, uint32_t &firstInode) const;
+
+    const BlockBitmap &allocatedBlocks() const { return allocated; }
+    uint32_t freeBlockCount() const { return freeBlocks; }
+
+private:
+    bool readBlockBitmaps(const BlockDevice &device);
+
+    int fsBlockSize;
+    uint32_t blocksCount;
+    uint32_t inodesCount;
+    uint32_t firstDataBlock;
+    uint32_t blocksPerGroup;
+    uint32_t inodesInGroup;
+    int fsInodeSize;
+    uint32_t journalInodeNumber;
+    unsigned char fsUuid[16];
+
+    std::vector<GroupDescriptor> groupDescriptors;
+    BlockBitmap allocated;
+    uint32_t freeBlocks;
+    std::ostream *errorLog; // receives why the metadata could not be read; null for none
+};
+
+#endif // EXT2FILESYSTEM_H
@@ -0,0 +1,91 @@
+#include "ExtentList.h"
+
+/**************************************************************************************
+ * Function: append
+ * Description: Appends one block, extending the last run when the block follows it.
+ * Parameters:
+ *    - block: The block number. 0 is an unused block pointer and is skipped.
+ **************************************************************************************/
+void ExtentList::append(BlockNumber block)
+{
+    append(block, 1);
+}
+
+/**************************************************************************************
+ * Function: append
+ * Description: Appends a run of blocks, merging it into the last run when it follows on.
+ * Parameters:
+ *    - start: The first block of the run. Runs starting at block 0 are skipped.
+ *    - length: The number of blocks in the run.
+ **************************************************************************************/
+void ExtentList::append(BlockNumber start, BlockNumber length)
+{
+    if (start == 0 || length <= 0)
+    {
+        return;
+    }
+
+    if (!runs.empty() && runs.back().start + runs.back().length == start)
+    {
+        runs.back().length += length;
+    }
+    else
+    {
+        Extent extent = {start, length};
+        runs.push_back(extent);
+    }
+    total += length;
+}
+
+void ExtentList::append(const ExtentList &other)
+{
+    for (const_iterator it = other.begin(); it != other.end(); ++it)
+    {
+        append(it->start, it->length);
+    }
+}
+
+/**************************************************************************************
+ * Function: truncate
+ * Description: Drops every block after the first blockCount.
+ * Parameters:
+ *    - blockCount: The number of blocks to keep.
+ **************************************************************************************/
+void ExtentList::truncate(size_t blockCount)
+{
+    while (total > blockCount)
+    {
+        size_t excess = total - blockCount;
+        if (static_cast<size_t>(runs.back().length) > excess)
+        {
+            runs.back().length -= excess;
+            total -= excess;
+        }
+        else
+        {
+            total -= runs.back().length;
+            runs.pop_back();
+        }
+    }
+}
+
+/**************************************************************************************
+ * Function: blocks
+ * Description: Expands the runs into one entry per block, for callers that read block
+ *              by block.
+ * Returns:
+ *    - The block numbers in file order.
+ **************************************************************************************/
+std::vector<BlockNumber> ExtentList::blocks() const
+{
+    std::vector<BlockNumber> result;
+    result.reserve(total);
+    for (const_iterator it = begin(); it != end(); ++it)
+    {
+        for (BlockNumber i = 0; i < it->length; ++i)
+        {
+            result.push_back(it->start + i);
+        }
+    }
+    return result;
+}
@@ -0,0 +1,44 @@
+#ifndef EXTENTLIST_H
+#define EXTENTLIST_H
+
+#include <cstddef>
+#include <vector>
+#include "BlockDevice.h"
+
+// A run of consecutive blocks
+struct Extent
+{
+    BlockNumber start;
+    BlockNumber length;
+};
+
+// A file's data blocks in order, stored as runs of consecutive blocks. ext3 allocates
+// mostly contiguously, so a file of any size usually needs only a handful of runs.
+class ExtentList
+{
+public:
+    typedef std::vector<Extent>::const_iterator const_iterator;
+
+    ExtentList() : total(0) {}
+
+    void append(BlockNumber block);
+    void append(BlockNumber start, BlockNumber length);
+    void append(const ExtentList &other);
+    void truncate(size_t blockCount);
+
+    bool empty() const { return total == 0; }
+    size_t blockCount() const { return total; }
+    size_t extentCount() const { return runs.size(); }
+    BlockNumber firstBlock() const { return runs.front().start; }
+    BlockNumber lastBlock() const { return runs.back().start + runs.back().length - 1; }
+    std::vector<BlockNumber> blocks() const;
+
+    const_iterator begin() const { return runs.begin(); }
+    const_iterator end() const { return runs.end(); }
+
+private:
+    std::vector<Extent> runs;
+    size_t total;
+};
+
+#endif // EXTENTLIST_H
@@ -0,0 +1,53 @@
+#include "FileFormat.h"
+#include <sstream>
+
+/**************************************************************************************
+ * Function: parseFormats
+ * Description: Parses a comma-separated list of format names, e.g. "zip,pdf", or "all".
+ * Parameters:
+ *    - list: The list given on the command line.
+ *    - formats: Receives the formats, in the order given, without duplicates.
+ *    - error: Receives why the list was rejected.
+ * Returns:
+ *    - True if every name is a known format.
+ **************************************************************************************/
+bool parseFormats(const std::string &list, std::vector<FileFormat> &formats, std::string &error)
+{
+    formats.clear();
+    std::istringstream names(list);
+    std::string name;
+    while (std::getline(names, name, ','))
+    {
+        int format = 0;
+        while (format < FormatCount && name != formatTable[format].name)
+        {
+            ++format;
+        }
+
+        if (name == "all")
+        {
+            formats.clear();
+            for (int i = 0; i < FormatCount; ++i)
+            {
+                formats.push_back(static_cast<FileFormat>(i));
+            }
+            return true;
+        }
+        if (format == FormatCount)
+        {
+            error = "Unknown file format \"" + name + "\".";
+            return false;
+        }
+
+        bool seen = false;
+        for (size_t i = 0; i < formats.size(); ++i)
+        {
+            seen = seen || formats[i] == format;
+        }
+        if (!seen)
+        {
+            formats.push_back(static_cast<FileFormat>(format));
+        }
+    }
+    return !formats.empty();
+}
@@ -0,0 +1,79 @@
+#ifndef FILEFORMAT_H
+#define FILEFORMAT_H
+
+#include <cstddef>
+#include <cstring>
+#include <string>
+#include <vector>
+
+// The file formats that can be carved. A format's value indexes formatTable.
+enum FileFormat
+{
+    Zip,
+    Pdf,
+    Jpeg,
+    Png,
+    Sqlite,
+    Gzip,
+    FormatCount
+};
+
+struct FormatInfo
+{
+    const char *name;      // as given to --formats
+    const char *extension; // given to recovered files
+    const char *signature; // the bytes every file of the format starts with
+    size_t signatureLength;
+};
+
+// The signature of every format, known at compile time so matchers can be built from it
+constexpr FormatInfo formatTable[FormatCount] = {
+    {"zip", ".zip", "PK\x03\x04", 4},                   // also .docx, .pptx, .xlsx, ...
+    {"pdf", ".pdf", "%PDF-", 5},
+    {"jpeg", ".jpg", "\xFF\xD8\xFF", 3},
+    {"png", ".png", "\x89PNG\r\n\x1A\n", 8},
+    {"sqlite", ".sqlite", "SQLite format 3\0", 16},
+    {"gzip", ".gz", "\x1F\x8B\x08", 3},
+};
+
+// Longest signature in formatTable, i.e. how far into a block matching looks
+constexpr size_t maxSignatureLength = 16;
+
+inline std::string formatSignature(FileFormat format)
+{
+    return std::string(formatTable[format].signature, formatTable[format].signatureLength);
+}
+
+bool parseFormats(const std::string &list, std::vector<FileFormat> &formats, std::string &error);
+
+template <FileFormat Format>
+inline bool startsWith(const char *block, size_t length)
+{
+    return length >= formatTable[Format].signatureLength &&
+           memcmp(block, formatTable[Format].signature, formatTable[Format].signatureLength) == 0;
+}
+
+// A set of formats matched against the start of a block. The set is expanded at compile
+// time into a chain of fixed-length compares, so matching does no per-byte table walk.
+template <FileFormat... Formats>
+struct FormatSet;
+
+template <>
+struct FormatSet<>
+{
+    // Returns the format whose signature the block starts with, or -1
+    static int match(const char *, size_t) { return -1; }
+};
+
+template <FileFormat First, FileFormat... Rest>
+struct FormatSet<First, Rest...>
+{
+    static int match(const char *block, size_t length)
+    {
+        return startsWith<First>(block, length) ? First : FormatSet<Rest...>::match(block, length);
+    }
+};
+
+typedef FormatSet<Zip, Pdf, Jpeg, Png, Sqlite, Gzip> AllFormats;
+
+#endif // FILEFORMAT_H
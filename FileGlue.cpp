@@ -1,4 +1,6 @@
-#include <iostream>
+#include "FileGlue.h"
+#include "RecoveryStatus.h"
+#include "ZeroDetect.h"
 #include <unistd.h>
 #include <vector>
 #include <sys/statvfs.h>
@@ -9,55 +11,41 @@
  * Description: Finalizes a file by determining its actual size and writing it to the output file.
  *              It also adds trailing zeros and double zeros as needed to align to 4-byte boundaries.
  * Parameters:
- *    - fileBlocks: A vector containing the block numbers of the file.
- *    - blockSize: The size of each block.
- *    - usb_fd: The file descriptor of the USB device.
- *    - out_fd: The file descriptor of the output file.
+ *    - fileBlocks: The blocks of the file.
+ *    - cache: The block cache to read the USB device through; the copy loop leaves the
+ *             last data block in it.
+ *    - writer: The writer for the output file.
  * Returns:
  *    - The actual size of the file in bytes.
  **************************************************************************************/
-off_t finalizeFile(const std::vector<int> &fileBlocks, int blockSize, int usb_fd, int out_fd)
+off_t finalizeFile(const ExtentList &fileBlocks, BlockCache &cache, OutputWriter &writer)
 {
-    char buffer[4096];
-
-    off_t fileSize = (fileBlocks.size() - 1) * blockSize;
-    int lastBlock = fileBlocks.back();
+    const BlockDevice &device = cache.device();
+    int blockSize = device.blockSize();
+    off_t fileSize = static_cast<off_t>(fileBlocks.blockCount() - 1) * blockSize;
+    BlockNumber lastBlock = fileBlocks.lastBlock();
     struct statvfs vfs;
 
-    if (fstatvfs(usb_fd, &vfs) != 0)
+    if (fstatvfs(device.fd(), &vfs) != 0)
     {
-        std::cerr << "Failed to get file system information.\n";
-        exit(1);
+        throw RecoveryError(RecoveryStatus::DeviceError, "Failed to get file system information.");
     }
 
     off_t lastBlockSize = vfs.f_frsize;
     fileSize += lastBlockSize;
 
     // Calculate the actual file size from the last block
-    off_t lastBlockOffset = lseek(usb_fd, lastBlock * blockSize, SEEK_SET);
-    if (lastBlockOffset == -1)
+    BlockView lastBlockView = cache.block(lastBlock);
+    if (lastBlockView.size() == 0)
     {
-        std::cerr << "Failed to seek to the last block.\n";
-        exit(1);
+        throw RecoveryError(RecoveryStatus::DeviceError, "Failed to read the last block from the USB device.");
     }
 
-    ssize_t bytesRead = read(usb_fd, buffer, blockSize);
-    if (bytesRead < 0)
-    {
-        std::cerr << "Failed to read the last block from the USB device.\n";
-        exit(1);
-    }
+    const char *buffer = lastBlockView.data();
+    ssize_t bytesRead = lastBlockView.size();
 
     // Find the index of the last non-zero byte
-    int lastNonZeroIndex = -1;
-    for (int i = bytesRead - 1; i >= 0; --i)
-    {
-        if (buffer[i] != 0)
-        {
-            lastNonZeroIndex = i;
-            break;
-        }
-    }
+    int lastNonZeroIndex = lastNonZeroOffset(buffer, bytesRead);
 
     // Check if the last four bytes are all zeros
     bool endsWithZeros = false;
@@ -75,12 +63,7 @@ off_t finalizeFile(const std::vector<int> &fileBlocks, int blockSize, int usb_fd
     }
 
     // Write the actual file data to the output file
-    ssize_t bytesWritten = write(out_fd, buffer, actualFileSize);
-    if (bytesWritten < 0)
-    {
-        std::cerr << "Failed to write the actual file data to the output file.\n";
-        exit(1);
-    }
+    writer.append(buffer, actualFileSize);
 
     // Update the file size
     fileSize -= (lastBlockSize - actualFileSize);
@@ -93,12 +76,7 @@ off_t finalizeFile(const std::vector<int> &fileBlocks, int blockSize, int usb_fd
     {
         char zeros[4] = {0, 0, 0, 0};
 
-        bytesWritten = write(out_fd, zeros, zerosNeeded);
-        if (bytesWritten < 0)
-        {
-            std::cerr << "Failed to write the trailing zeros to the output file.\n";
-            exit(1);
-        }
+        writer.append(zeros, zerosNeeded);
 
         fileSize += zerosNeeded;
     }
@@ -115,12 +93,7 @@ off_t finalizeFile(const std::vector<int> &fileBlocks, int blockSize, int usb_fd
     {
         char doubleZeros[4] = {0, 0, 0, 0};
 
-        bytesWritten = write(out_fd, doubleZeros, 4);
-        if (bytesWritten < 0)
-        {
-            std::cerr << "Failed to write the double zeros to the output file.\n";
-            exit(1);
-        }
+        writer.append(doubleZeros, 4);
 
         fileSize += 4;
     }
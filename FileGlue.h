@@ -0,0 +1,11 @@
+#ifndef FILEGLUE_H
+#define FILEGLUE_H
+
+#include <sys/types.h>
+#include "BlockCache.h"
+#include "ExtentList.h"
+#include "OutputWriter.h"
+
+off_t finalizeFile(const ExtentList &fileBlocks, BlockCache &cache, OutputWriter &writer);
+
+#endif // FILEGLUE_H
@@ -0,0 +1,935 @@
+#include "FormatCarver.h"
+#include "Crc32.h"
+#include <algorithm>
+#include <cstring>
+
+static inline uint16_t be16(const unsigned char *p)
+{
+    return (p[0] << 8) | p[1];
+}
+
+static inline uint32_t be32(const unsigned char *p)
+{
+    return (static_cast<uint32_t>(p[0]) << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+/**************************************************************************************
+ * Function: makeEndDetector
+ * Description: Creates the end detection policy of a format.
+ * Parameters:
+ *    - format: The format of the file being carved.
+ * Returns:
+ *    - A new detector, fed the file's bytes in order while they are copied.
+ **************************************************************************************/
+std::unique_ptr<EndDetector> makeEndDetector(FileFormat format)
+{
+    switch (format)
+    {
+    case Zip:
+        return std::unique_ptr<EndDetector>(new CarverOf<Zip>());
+    case Pdf:
+        return std::unique_ptr<EndDetector>(new CarverOf<Pdf>());
+    case Jpeg:
+        return std::unique_ptr<EndDetector>(new CarverOf<Jpeg>());
+    case Png:
+        return std::unique_ptr<EndDetector>(new CarverOf<Png>());
+    case Sqlite:
+        return std::unique_ptr<EndDetector>(new CarverOf<Sqlite>());
+    case Gzip:
+        return std::unique_ptr<EndDetector>(new CarverOf<Gzip>());
+    default:
+        return std::unique_ptr<EndDetector>();
+    }
+}
+
+std::string FormatCarver<Zip>::summary() const
+{
+    return std::to_string(entryCount()) + " entries, " + std::to_string(checkedEntries() - crcErrors()) + " of " +
+           std::to_string(checkedEntries()) + " stored entries passed CRC-32";
+}
+
+// -------------------------------------------------------------------------------------
+// PDF
+// -------------------------------------------------------------------------------------
+
+// "%%EOF" as it appears in the low five bytes of FormatCarver<Pdf>::recent
+static const uint64_t pdfEndMarker = 0x2525454F46ULL;
+static const uint64_t pdfMarkerMask = 0xFFFFFFFFFFULL;
+
+// An incremental update starts with an object number, an xref table or a comment
+static inline bool startsUpdate(unsigned char c)
+{
+    return (c >= '0' && c <= '9') || c == 'x' || c == '%';
+}
+
+FormatCarver<Pdf>::FormatCarver()
+    : position(0), recent(0), afterMarker(false), ended(false), endOffset(0), updates(0)
+{
+}
+
+/**************************************************************************************
+ * Function: feed
+ * Description: Looks for %%EOF and the end of line after it. An incremental update
+ *              appends a new body and another %%EOF, so a marker only ends the file
+ *              when the byte after its line end cannot start an update.
+ * Parameters:
+ *    - data: The next bytes of the file, in file order.
+ *    - length: The number of bytes in data.
+ * Returns:
+ *    - How many of the bytes belong to the file.
+ **************************************************************************************/
+size_t FormatCarver<Pdf>::feed(const char *data, size_t length)
+{
+    if (ended)
+    {
+        return 0;
+    }
+
+    const unsigned char *p = reinterpret_cast<const unsigned char *>(data);
+    for (size_t i = 0; i < length; ++i)
+    {
+        if (afterMarker)
+        {
+            if (p[i] == '\r' || p[i] == '\n')
+            {
+                endOffset = position + i + 1;
+                continue;
+            }
+            if (!startsUpdate(p[i]))
+            {
+                ended = true;
+                position += i;
+                return i;
+            }
+            afterMarker = false;
+            ++updates;
+        }
+
+        recent = (recent << 8) | p[i];
+        if ((recent & pdfMarkerMask) == pdfEndMarker)
+        {
+            afterMarker = true;
+            endOffset = position + i + 1;
+        }
+    }
+    position += length;
+    return length;
+}
+
+std::string FormatCarver<Pdf>::summary() const
+{
+    return std::to_string(updates) + " incremental updates";
+}
+
+// -------------------------------------------------------------------------------------
+// JPEG
+// -------------------------------------------------------------------------------------
+
+static const unsigned char jpegStartOfScan = 0xDA;
+static const unsigned char jpegEndOfImage = 0xD9;
+
+// Markers that stand alone, without a length field: SOI, TEM and RST0 to RST7
+static inline bool standaloneMarker(unsigned char marker)
+{
+    return marker == 0xD8 || marker == 0x01 || (marker >= 0xD0 && marker <= 0xD7);
+}
+
+FormatCarver<Jpeg>::FormatCarver()
+    : state(MarkerStart), position(0), marker(0), remaining(0), endOffset(0), scans(0)
+{
+}
+
+/**************************************************************************************
+ * Function: feed
+ * Description: Walks the marker segments. Segment bodies are skipped by their length,
+ *              and the entropy-coded data after each Start Of Scan is searched for the
+ *              next marker, ignoring stuffed 0xFF00 bytes and restart markers.
+ * Parameters:
+ *    - data: The next bytes of the file, in file order.
+ *    - length: The number of bytes in data.
+ * Returns:
+ *    - How many of the bytes belong to the file.
+ **************************************************************************************/
+size_t FormatCarver<Jpeg>::feed(const char *data, size_t length)
+{
+    if (state == Ended)
+    {
+        return 0;
+    }
+
+    const unsigned char *p = reinterpret_cast<const unsigned char *>(data);
+    size_t i = 0;
+    while (i < length && state != Ended && state != Untracked)
+    {
+        unsigned char c = p[i];
+        switch (state)
+        {
+        case MarkerStart:
+            state = c == 0xFF ? MarkerCode : Untracked;
+            ++i;
+            break;
+
+        case MarkerCode:
+        case EntropyMarker:
+            ++i;
+            if (c == 0xFF)
+            {
+                break; // fill byte
+            }
+            if (state == EntropyMarker && (c == 0x00 || (c >= 0xD0 && c <= 0xD7)))
+            {
+                state = Entropy;
+            }
+            else if (c == jpegEndOfImage)
+            {
+                state = Ended;
+                endOffset = position + i;
+            }
+            else if (standaloneMarker(c))
+            {
+                state = MarkerStart;
+            }
+            else
+            {
+                marker = c;
+                state = LengthHigh;
+            }
+            break;
+
+        case LengthHigh:
+            remaining = c << 8;
+            state = LengthLow;
+            ++i;
+            break;
+
+        case LengthLow:
+            remaining |= c;
+            ++i;
+            if (remaining < 2)
+            {
+                state = Untracked;
+                break;
+            }
+            remaining -= 2;
+            state = Segment;
+            if (remaining == 0)
+            {
+                endSegment();
+            }
+            break;
+
+        case Segment:
+        {
+            size_t take = std::min<size_t>(remaining, length - i);
+            i += take;
+            remaining -= take;
+            if (remaining == 0)
+            {
+                endSegment();
+            }
+            break;
+        }
+
+        case Entropy:
+        {
+            const void *next = memchr(p + i, 0xFF, length - i);
+            if (!next)
+            {
+                i = length;
+                break;
+            }
+            i = static_cast<const unsigned char *>(next) - p + 1;
+            state = EntropyMarker;
+            break;
+        }
+
+        default:
+            break;
+        }
+    }
+
+    // The rest of an unparseable file is copied without tracking
+    size_t used = state == Untracked ? length : i;
+    position += used;
+    return used;
+}
+
+// Entropy-coded data follows the header of a scan; any other segment is followed by a marker
+void FormatCarver<Jpeg>::endSegment()
+{
+    if (marker == jpegStartOfScan)
+    {
+        ++scans;
+        state = Entropy;
+    }
+    else
+    {
+        state = MarkerStart;
+    }
+}
+
+std::string FormatCarver<Jpeg>::summary() const
+{
+    return std::to_string(scans) + " scans";
+}
+
+// -------------------------------------------------------------------------------------
+// PNG
+// -------------------------------------------------------------------------------------
+
+static const size_t pngSignatureSize = 8;
+static const size_t pngChunkHeaderSize = 8;
+static const size_t pngCrcSize = 4;
+static const uint32_t pngMaxChunkLength = 0x7FFFFFFF;
+
+FormatCarver<Png>::FormatCarver()
+    : state(Signature), position(0), remaining(0), crc(0), lastChunk(false), ended(false), endOffset(0), chunks(0), crcErrors(0)
+{
+}
+
+/**************************************************************************************
+ * Function: feed
+ * Description: Walks the chunks after the signature, checking each chunk's CRC-32 over
+ *              its type and data, and ends after the CRC of the IEND chunk.
+ * Parameters:
+ *    - data: The next bytes of the file, in file order.
+ *    - length: The number of bytes in data.
+ * Returns:
+ *    - How many of the bytes belong to the file.
+ **************************************************************************************/
+size_t FormatCarver<Png>::feed(const char *data, size_t length)
+{
+    if (ended)
+    {
+        return 0;
+    }
+
+    size_t i = 0;
+    auto collect = [&](size_t want)
+    {
+        size_t take = std::min(want - field.size(), length - i);
+        field.insert(field.end(), data + i, data + i + take);
+        i += take;
+        return field.size() == want;
+    };
+
+    while (i < length && state != Untracked && !ended)
+    {
+        switch (state)
+        {
+        case Signature:
+            if (collect(pngSignatureSize))
+            {
+                field.clear();
+                state = ChunkHeader;
+            }
+            break;
+
+        case ChunkHeader:
+            if (collect(pngChunkHeaderSize))
+            {
+                remaining = be32(&field[0]);
+                if (remaining > pngMaxChunkLength)
+                {
+                    state = Untracked;
+                    break;
+                }
+                crc = crc32Update(0, reinterpret_cast<const char *>(&field[4]), 4);
+                lastChunk = memcmp(&field[4], "IEND", 4) == 0;
+                field.clear();
+                ++chunks;
+                state = remaining ? ChunkData : ChunkCrc;
+            }
+            break;
+
+        case ChunkData:
+        {
+            size_t take = std::min<size_t>(remaining, length - i);
+            crc = crc32Update(crc, data + i, take);
+            i += take;
+            remaining -= take;
+            if (remaining == 0)
+            {
+                state = ChunkCrc;
+            }
+            break;
+        }
+
+        case ChunkCrc:
+            if (collect(pngCrcSize))
+            {
+                if (be32(&field[0]) != crc)
+                {
+                    ++crcErrors;
+                }
+                field.clear();
+                if (lastChunk)
+                {
+                    ended = true;
+                    endOffset = position + i;
+                }
+                else
+                {
+                    state = ChunkHeader;
+                }
+            }
+            break;
+
+        default:
+            break;
+        }
+    }
+
+    size_t used = state == Untracked ? length : i;
+    position += used;
+    return used;
+}
+
+std::string FormatCarver<Png>::summary() const
+{
+    return std::to_string(chunks) + " chunks, " + std::to_string(crcErrors) + " CRC-32 errors";
+}
+
+// -------------------------------------------------------------------------------------
+// SQLite
+// -------------------------------------------------------------------------------------
+
+static const size_t sqliteHeaderSize = 100;
+
+FormatCarver<Sqlite>::FormatCarver()
+    : position(0), sizeKnown(false), pageSize(0), pageCount(0), databaseSize(0)
+{
+}
+
+/**************************************************************************************
+ * Function: feed
+ * Description: Reads the page size and the in-header page count from the database
+ *              header. The count is only trusted when the header's version-valid-for
+ *              number matches its change counter, as SQLite itself requires.
+ * Parameters:
+ *    - data: The next bytes of the file, in file order.
+ *    - length: The number of bytes in data.
+ * Returns:
+ *    - How many of the bytes belong to the file.
+ **************************************************************************************/
+size_t FormatCarver<Sqlite>::feed(const char *data, size_t length)
+{
+    if (header.size() < sqliteHeaderSize)
+    {
+        size_t take = std::min(sqliteHeaderSize - header.size(), length);
+        header.insert(header.end(), data, data + take);
+
+        if (header.size() == sqliteHeaderSize)
+        {
+            const unsigned char *h = &header[0];
+            pageSize = be16(h + 16) == 1 ? 65536 : be16(h + 16);
+            pageCount = be32(h + 28);
+            bool powerOfTwo = pageSize >= 512 && (pageSize & (pageSize - 1)) == 0;
+            sizeKnown = powerOfTwo && pageCount > 0 && be32(h + 24) == be32(h + 92);
+            databaseSize = static_cast<uint64_t>(pageSize) * pageCount;
+        }
+    }
+
+    size_t used = length;
+    if (sizeKnown)
+    {
+        used = position < databaseSize ? std::min<uint64_t>(length, databaseSize - position) : 0;
+    }
+    position += used;
+    return used;
+}
+
+std::string FormatCarver<Sqlite>::summary() const
+{
+    return std::to_string(pageCount) + " pages of " + std::to_string(pageSize) + " bytes";
+}
+
+// -------------------------------------------------------------------------------------
+// gzip
+// -------------------------------------------------------------------------------------
+
+// Results of one parsing step
+static const int needInput = 0;
+static const int parsed = 1;
+static const int invalid = -1;
+
+// Extra bits after each length symbol (257 to 285) and distance symbol
+static const int lengthExtraBits[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+static const int distanceExtraBits[30] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+// Order of the code length code lengths in a dynamic block header
+static const uint8_t codeLengthOrder[19] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+
+static const size_t gzipHeaderSize = 10;
+static const size_t gzipTrailerSize = 8;
+static const int endOfBlock = 256;
+
+// Parsed input is dropped once this much has built up in front of the checkpoint
+static const size_t compactThreshold = 1 << 16;
+
+FormatCarver<Gzip>::FormatCarver()
+    : state(MemberHeader), inputStart(0), bytePos(0), bitBuffer(0), bitCount(0), finalBlock(false), storedRemaining(0), endOffset(0),
+      blocks(0)
+{
+}
+
+/**************************************************************************************
+ * Function: feed
+ * Description: Walks the first gzip member. Input is parsed in small units, each one
+ *              a header or a single Huffman symbol; a unit cut off by the end of the
+ *              input is rolled back to its checkpoint and parsed again with more data.
+ * Parameters:
+ *    - data: The next bytes of the file, in file order.
+ *    - length: The number of bytes in data.
+ * Returns:
+ *    - How many of the bytes belong to the file.
+ **************************************************************************************/
+size_t FormatCarver<Gzip>::feed(const char *data, size_t length)
+{
+    if (state == Ended)
+    {
+        return 0;
+    }
+    if (state == Untracked)
+    {
+        return length;
+    }
+
+    uint64_t start = inputStart + input.size();
+    input.insert(input.end(), data, data + length);
+
+    int result;
+    do
+    {
+        result = step();
+    } while (result == parsed && state != Ended);
+
+    if (result == invalid)
+    {
+        state = Untracked;
+        input.clear();
+        return length;
+    }
+    if (state == Ended)
+    {
+        input.clear();
+        return endOffset > start ? std::min<uint64_t>(length, endOffset - start) : 0;
+    }
+    return length;
+}
+
+// Parses one unit at the checkpoint, restoring the checkpoint if it needs more input
+int FormatCarver<Gzip>::step()
+{
+    if (bytePos >= compactThreshold)
+    {
+        input.erase(input.begin(), input.begin() + bytePos);
+        inputStart += bytePos;
+        bytePos = 0;
+    }
+
+    size_t savedPos = bytePos;
+    uint32_t savedBuffer = bitBuffer;
+    int savedCount = bitCount;
+    int result = parsed;
+
+    switch (state)
+    {
+    case MemberHeader:
+        result = readMemberHeader();
+        if (result == parsed)
+        {
+            state = BlockHeader;
+        }
+        break;
+
+    case BlockHeader:
+    {
+        uint32_t header;
+        if (!bits(3, header))
+        {
+            result = needInput;
+            break;
+        }
+        finalBlock = header & 1;
+
+        if ((header >> 1) == 0)
+        {
+            // Stored blocks start on the next byte boundary
+            bitBuffer = 0;
+            bitCount = 0;
+            state = StoredLength;
+        }
+        else if ((header >> 1) == 1)
+        {
+            uint8_t lengths[288];
+            std::fill(lengths, lengths + 144, 8);
+            std::fill(lengths + 144, lengths + 256, 9);
+            std::fill(lengths + 256, lengths + 280, 7);
+            std::fill(lengths + 280, lengths + 288, 8);
+            build(lengthCodes, lengths, 288);
+            std::fill(lengths, lengths + 30, 5);
+            build(distanceCodes, lengths, 30);
+            state = Codes;
+        }
+        else if ((header >> 1) == 2)
+        {
+            result = readDynamicTables();
+            if (result == parsed)
+            {
+                state = Codes;
+            }
+        }
+        else
+        {
+            result = invalid;
+        }
+        if (result == parsed)
+        {
+            ++blocks;
+        }
+        break;
+    }
+
+    case StoredLength:
+    {
+        if (input.size() - bytePos < 4)
+        {
+            result = needInput;
+            break;
+        }
+        const unsigned char *p = &input[bytePos];
+        uint16_t storedLength = p[0] | (p[1] << 8);
+        uint16_t complement = p[2] | (p[3] << 8);
+        if (storedLength != static_cast<uint16_t>(~complement))
+        {
+            result = invalid;
+            break;
+        }
+        bytePos += 4;
+        storedRemaining = storedLength;
+        state = storedRemaining ? Stored : finalBlock ? Trailer : BlockHeader;
+        break;
+    }
+
+    case Stored:
+    {
+        size_t take = std::min<size_t>(storedRemaining, input.size() - bytePos);
+        if (take == 0)
+        {
+            result = needInput;
+            break;
+        }
+        bytePos += take;
+        storedRemaining -= take;
+        if (storedRemaining == 0)
+        {
+            state = finalBlock ? Trailer : BlockHeader;
+        }
+        break;
+    }
+
+    case Codes:
+    {
+        int symbol;
+        result = decode(lengthCodes, symbol);
+        if (result != parsed)
+        {
+            break;
+        }
+        if (symbol == endOfBlock)
+        {
+            state = finalBlock ? Trailer : BlockHeader;
+        }
+        else if (symbol > endOfBlock)
+        {
+            // A match: skip the length's extra bits, the distance symbol and its extra bits
+            symbol -= endOfBlock + 1;
+            uint32_t extra;
+            int distance;
+            if (symbol >= 29)
+            {
+                result = invalid;
+            }
+            else if (!bits(lengthExtraBits[symbol], extra))
+            {
+                result = needInput;
+            }
+            else if ((result = decode(distanceCodes, distance)) == parsed)
+            {
+                if (distance >= 30)
+                {
+                    result = invalid;
+                }
+                else if (!bits(distanceExtraBits[distance], extra))
+                {
+                    result = needInput;
+                }
+            }
+        }
+        break;
+    }
+
+    case Trailer:
+        // The deflate stream ends on a byte boundary, followed by the CRC-32 and size
+        bitBuffer = 0;
+        bitCount = 0;
+        if (input.size() - bytePos < gzipTrailerSize)
+        {
+            result = needInput;
+            break;
+        }
+        endOffset = inputStart + bytePos + gzipTrailerSize;
+        state = Ended;
+        break;
+
+    default:
+        result = invalid;
+        break;
+    }
+
+    if (result == needInput)
+    {
+        bytePos = savedPos;
+        bitBuffer = savedBuffer;
+        bitCount = savedCount;
+    }
+    return result;
+}
+
+// Takes the next need bits, least significant first; false if the input runs out
+bool FormatCarver<Gzip>::bits(int need, uint32_t &value)
+{
+    while (bitCount < need)
+    {
+        if (bytePos == input.size())
+        {
+            return false;
+        }
+        bitBuffer |= static_cast<uint32_t>(input[bytePos++]) << bitCount;
+        bitCount += 8;
+    }
+    value = bitBuffer & ((1u << need) - 1);
+    bitBuffer >>= need;
+    bitCount -= need;
+    return true;
+}
+
+// Decodes one symbol a bit at a time, walking the canonical code's lengths in order
+int FormatCarver<Gzip>::decode(const Huffman &table, int &symbol)
+{
+    int code = 0;
+    int first = 0;
+    int index = 0;
+    for (int length = 1; length <= 15; ++length)
+    {
+        uint32_t bit;
+        if (!bits(1, bit))
+        {
+            return needInput;
+        }
+        code |= bit;
+        int count = table.count[length];
+        if (code - count < first)
+        {
+            symbol = table.symbol[index + (code - first)];
+            return parsed;
+        }
+        index += count;
+        first = (first + count) << 1;
+        code <<= 1;
+    }
+    return invalid;
+}
+
+// Builds a canonical Huffman code from its code lengths; false if it is oversubscribed
+bool FormatCarver<Gzip>::build(Huffman &table, const uint8_t *lengths, int symbolCount)
+{
+    memset(table.count, 0, sizeof(table.count));
+    for (int i = 0; i < symbolCount; ++i)
+    {
+        ++table.count[lengths[i]];
+    }
+
+    int left = 1;
+    for (int length = 1; length <= 15; ++length)
+    {
+        left = (left << 1) - table.count[length];
+        if (left < 0)
+        {
+            return false;
+        }
+    }
+
+    uint16_t offsets[16];
+    offsets[1] = 0;
+    for (int length = 1; length < 15; ++length)
+    {
+        offsets[length + 1] = offsets[length] + table.count[length];
+    }
+    for (int i = 0; i < symbolCount; ++i)
+    {
+        if (lengths[i] != 0)
+        {
+            table.symbol[offsets[lengths[i]]++] = i;
+        }
+    }
+    return true;
+}
+
+// Skips the fixed header and the optional extra field, name, comment and header CRC
+int FormatCarver<Gzip>::readMemberHeader()
+{
+    const unsigned char *p = input.data();
+    size_t pos = bytePos;
+    if (input.size() - pos < gzipHeaderSize)
+    {
+        return needInput;
+    }
+    unsigned char flags = p[pos + 3];
+    if (p[pos] != 0x1F || p[pos + 1] != 0x8B || p[pos + 2] != 8 || (flags & 0xE0))
+    {
+        return invalid;
+    }
+    pos += gzipHeaderSize;
+
+    if (flags & 0x04)
+    {
+        if (input.size() - pos < 2)
+        {
+            return needInput;
+        }
+        size_t extraLength = p[pos] | (p[pos + 1] << 8);
+        pos += 2;
+        if (input.size() - pos < extraLength)
+        {
+            return needInput;
+        }
+        pos += extraLength;
+    }
+    for (unsigned char field = 0x08; field <= 0x10; field <<= 1)
+    {
+        if (flags & field)
+        {
+            const void *end = memchr(p + pos, 0, input.size() - pos);
+            if (!end)
+            {
+                return needInput;
+            }
+            pos = static_cast<const unsigned char *>(end) - p + 1;
+        }
+    }
+    if (flags & 0x02)
+    {
+        if (input.size() - pos < 2)
+        {
+            return needInput;
+        }
+        pos += 2;
+    }
+
+    bytePos = pos;
+    return parsed;
+}
+
+// Reads the code lengths of a dynamic block, themselves Huffman coded, and builds its codes
+int FormatCarver<Gzip>::readDynamicTables()
+{
+    uint32_t literalCodes;
+    uint32_t distanceCount;
+    uint32_t lengthCodeCount;
+    if (!bits(5, literalCodes) || !bits(5, distanceCount) || !bits(4, lengthCodeCount))
+    {
+        return needInput;
+    }
+    int lengthCount = literalCodes + 257;
+    distanceCount += 1;
+    if (lengthCount > 286 || distanceCount > 30)
+    {
+        return invalid;
+    }
+
+    uint8_t lengths[320];
+    memset(lengths, 0, sizeof(lengths));
+    for (uint32_t i = 0; i < lengthCodeCount + 4; ++i)
+    {
+        uint32_t length;
+        if (!bits(3, length))
+        {
+            return needInput;
+        }
+        lengths[codeLengthOrder[i]] = length;
+    }
+
+    Huffman codeLengthCodes;
+    if (!build(codeLengthCodes, lengths, 19))
+    {
+        return invalid;
+    }
+
+    int total = lengthCount + distanceCount;
+    for (int index = 0; index < total;)
+    {
+        int symbol;
+        int result = decode(codeLengthCodes, symbol);
+        if (result != parsed)
+        {
+            return result;
+        }
+        if (symbol < 16)
+        {
+            lengths[index++] = symbol;
+            continue;
+        }
+
+        // 16 repeats the previous length 3-6 times, 17 and 18 repeat a zero 3-10 and 11-138 times
+        uint8_t value = 0;
+        uint32_t repeat;
+        if (symbol == 16)
+        {
+            if (index == 0)
+            {
+                return invalid;
+            }
+            value = lengths[index - 1];
+            if (!bits(2, repeat))
+            {
+                return needInput;
+            }
+            repeat += 3;
+        }
+        else if (symbol == 17)
+        {
+            if (!bits(3, repeat))
+            {
+                return needInput;
+            }
+            repeat += 3;
+        }
+        else
+        {
+            if (!bits(7, repeat))
+            {
+                return needInput;
+            }
+            repeat += 11;
+        }
+        if (index + static_cast<int>(repeat) > total)
+        {
+            return invalid;
+        }
+        std::fill(lengths + index, lengths + index + repeat, value);
+        index += repeat;
+    }
+
+    if (lengths[endOfBlock] == 0 || !build(lengthCodes, lengths, lengthCount) || !build(distanceCodes, lengths + lengthCount, distanceCount))
+    {
+        return invalid;
+    }
+    return parsed;
+}
+
+std::string FormatCarver<Gzip>::summary() const
+{
+    return std::to_string(blocks) + " deflate blocks";
+}
@@ -0,0 +1,225 @@
+#ifndef FORMATCARVER_H
+#define FORMATCARVER_H
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include "FileFormat.h"
+#include "ZipStream.h"
+
+// Finds the exact end of a carved file while its bytes are copied out. feed() takes the
+// file's bytes in order and returns how many of them belong to the file; once
+// complete() is true, fileSize() is the file's exact size and nothing more is needed.
+class EndDetector
+{
+public:
+    virtual ~EndDetector() {}
+
+    virtual size_t feed(const char *data, size_t length) = 0;
+    virtual bool complete() const = 0;
+    virtual uint64_t fileSize() const = 0;
+    virtual std::string summary() const = 0;
+};
+
+// The end detection policy of one format. Every specialization has the members of
+// EndDetector, without the virtual calls.
+template <FileFormat Format>
+class FormatCarver;
+
+// ZIP and OOXML: the End of Central Directory record
+template <>
+class FormatCarver<Zip> : public ZipStream
+{
+public:
+    std::string summary() const;
+};
+
+// PDF: the last %%EOF marker, which is followed by slack rather than an incremental update
+template <>
+class FormatCarver<Pdf>
+{
+public:
+    FormatCarver();
+
+    size_t feed(const char *data, size_t length);
+    bool complete() const { return ended; }
+    uint64_t fileSize() const { return endOffset; }
+    std::string summary() const;
+
+private:
+    uint64_t position;
+    uint64_t recent; // the last bytes seen, newest in the low byte
+    bool afterMarker;
+    bool ended;
+    uint64_t endOffset;
+    int updates;
+};
+
+// JPEG: segments are skipped by their length fields and entropy-coded data is scanned
+// for the End Of Image marker, so thumbnails embedded in APPn segments are passed over
+template <>
+class FormatCarver<Jpeg>
+{
+public:
+    FormatCarver();
+
+    size_t feed(const char *data, size_t length);
+    bool complete() const { return state == Ended; }
+    uint64_t fileSize() const { return endOffset; }
+    std::string summary() const;
+
+private:
+    enum State
+    {
+        MarkerStart,
+        MarkerCode,
+        LengthHigh,
+        LengthLow,
+        Segment,
+        Entropy,
+        EntropyMarker,
+        Ended,
+        Untracked
+    };
+
+    void endSegment();
+
+    State state;
+    uint64_t position;
+    unsigned char marker;
+    uint32_t remaining;
+    uint64_t endOffset;
+    int scans;
+};
+
+// PNG: chunks are walked by their length fields, with each chunk's CRC-32 checked,
+// up to the end of the IEND chunk
+template <>
+class FormatCarver<Png>
+{
+public:
+    FormatCarver();
+
+    size_t feed(const char *data, size_t length);
+    bool complete() const { return ended; }
+    uint64_t fileSize() const { return endOffset; }
+    std::string summary() const;
+
+private:
+    enum State
+    {
+        Signature,
+        ChunkHeader,
+        ChunkData,
+        ChunkCrc,
+        Untracked
+    };
+
+    State state;
+    uint64_t position;
+    std::vector<unsigned char> field;
+    uint32_t remaining;
+    uint32_t crc;
+    bool lastChunk;
+    bool ended;
+    uint64_t endOffset;
+    int chunks;
+    int crcErrors;
+};
+
+// SQLite: the page size and page count in the 100-byte database header
+template <>
+class FormatCarver<Sqlite>
+{
+public:
+    FormatCarver();
+
+    size_t feed(const char *data, size_t length);
+    bool complete() const { return sizeKnown && position >= databaseSize; }
+    uint64_t fileSize() const { return databaseSize; }
+    std::string summary() const;
+
+private:
+    std::vector<unsigned char> header;
+    uint64_t position;
+    bool sizeKnown;
+    uint32_t pageSize;
+    uint32_t pageCount;
+    uint64_t databaseSize;
+};
+
+// gzip: the deflate stream is walked block by block, decoding Huffman symbols without
+// inflating them, up to the end of the 8-byte member trailer
+template <>
+class FormatCarver<Gzip>
+{
+public:
+    FormatCarver();
+
+    size_t feed(const char *data, size_t length);
+    bool complete() const { return state == Ended; }
+    uint64_t fileSize() const { return endOffset; }
+    std::string summary() const;
+
+private:
+    enum State
+    {
+        MemberHeader,
+        BlockHeader,
+        StoredLength,
+        Stored,
+        Codes,
+        Trailer,
+        Ended,
+        Untracked
+    };
+
+    // Canonical Huffman code: the number of codes of each length and the symbols in
+    // code order
+    struct Huffman
+    {
+        uint16_t count[16];
+        uint16_t symbol[288];
+    };
+
+    int step();
+    bool bits(int need, uint32_t &value);
+    int decode(const Huffman &table, int &symbol);
+    int readMemberHeader();
+    int readDynamicTables();
+    static bool build(Huffman &table, const uint8_t *lengths, int symbolCount);
+
+    State state;
+    std::vector<unsigned char> input; // unparsed input, from the last checkpoint on
+    uint64_t inputStart;              // file offset of input[0]
+    size_t bytePos;
+    uint32_t bitBuffer;
+    int bitCount;
+    bool finalBlock;
+    uint32_t storedRemaining;
+    Huffman lengthCodes;
+    Huffman distanceCodes;
+    uint64_t endOffset;
+    int blocks;
+};
+
+// Wraps a format's policy as an EndDetector, so copy loops pay one virtual call per
+// chunk rather than per byte
+template <FileFormat Format>
+class CarverOf : public EndDetector
+{
+public:
+    size_t feed(const char *data, size_t length) { return carver.feed(data, length); }
+    bool complete() const { return carver.complete(); }
+    uint64_t fileSize() const { return carver.fileSize(); }
+    std::string summary() const { return carver.summary(); }
+
+private:
+    FormatCarver<Format> carver;
+};
+
+std::unique_ptr<EndDetector> makeEndDetector(FileFormat format);
+
+#endif // FORMATCARVER_H
@@ -0,0 +1,164 @@
+#include "IndirectIndex.h"
+#include "BlockClassMap.h"
+#include "BlockDevice.h"
+#include "ZeroDetect.h"
+#include <algorithm>
+
+static inline size_t slotFor(uint32_t key, size_t mask)
+{
+    uint32_t hash = key * 0x9E3779B1u;
+    return (hash ^ (hash >> 16)) & mask;
+}
+
+IndirectIndex::IndirectIndex()
+    : table(1024), count(0)
+{
+}
+
+/**************************************************************************************
+ * Function: looksLikeIndirect
+ * Description: Decides whether a block could be an ext2/ext3 indirect block: an array
+ *              of little-endian u32 block numbers that all lie on the device, starting
+ *              with a non-zero pointer and zero-padded after the last one in use.
+ * Parameters:
+ *    - block: The block contents.
+ *    - length: The number of valid bytes in block.
+ *    - blockCount: The number of blocks on the device.
+ * Returns:
+ *    - True if the block is a plausible pointer array.
+ **************************************************************************************/
+bool IndirectIndex::looksLikeIndirect(const char *block, int length, BlockNumber blockCount)
+{
+    const unsigned char *p = reinterpret_cast<const unsigned char *>(block);
+    size_t pointerCount = length / sizeof(uint32_t);
+    size_t used = firstZeroPointer(block, pointerCount);
+    if (used == 0)
+    {
+        return false;
+    }
+
+    for (size_t i = 0; i < used; ++i, p += sizeof(uint32_t))
+    {
+        uint32_t pointer = p[0] | (p[1] << 8) | (p[2] << 16) | (static_cast<uint32_t>(p[3]) << 24);
+        if (pointer >= blockCount)
+        {
+            return false;
+        }
+    }
+
+    return isZeroBlock(block + used * sizeof(uint32_t), length - used * sizeof(uint32_t));
+}
+
+/**************************************************************************************
+ * Function: build
+ * Description: Indexes the blocks a full scan classified as pointer arrays, reading only
+ *              those blocks instead of the whole device.
+ * Parameters:
+ *    - device: The USB device.
+ *    - classes: The block classes from a full scan of the device.
+ * Returns:
+ *    - The index.
+ **************************************************************************************/
+IndirectIndex IndirectIndex::build(const BlockDevice &device, const BlockClassMap &classes)
+{
+    IndirectIndex index;
+    const uint64_t *words = classes.data();
+    for (size_t word = 0; word < classes.wordCount(); ++word)
+    {
+        // PointerArray is the one class with both bits set
+        uint64_t pointerArrays = words[word] & (words[word] >> 1) & 0x5555555555555555ULL;
+        while (pointerArrays)
+        {
+            BlockNumber blockNumber = static_cast<BlockNumber>(word) * 32 + __builtin_ctzll(pointerArrays) / 2;
+            pointerArrays &= pointerArrays - 1;
+
+            BlockView block = device.block(blockNumber);
+            if (block.size() >= static_cast<ssize_t>(sizeof(uint32_t)))
+            {
+                index.add(block.pointer(0), blockNumber);
+            }
+        }
+    }
+
+    return index;
+}
+
+/**************************************************************************************
+ * Function: add
+ * Description: Records an indirect block candidate. When several candidates share a
+ *              first pointer the lowest block number is kept, matching a linear search
+ *              from block 0.
+ * Parameters:
+ *    - firstPointer: The first block pointer stored in the candidate.
+ *    - blockNumber: The block number of the candidate.
+ **************************************************************************************/
+void IndirectIndex::add(uint32_t firstPointer, BlockNumber blockNumber)
+{
+    if (blockNumber > UINT32_MAX)
+    {
+        return;
+    }
+    if ((count + 1) * 2 > table.size())
+    {
+        grow();
+    }
+
+    size_t mask = table.size() - 1;
+    for (size_t slot = slotFor(firstPointer, mask);; slot = (slot + 1) & mask)
+    {
+        if (table[slot].firstPointer == 0)
+        {
+            table[slot].firstPointer = firstPointer;
+            table[slot].blockNumber = blockNumber;
+            ++count;
+            return;
+        }
+        if (table[slot].firstPointer == firstPointer)
+        {
+            table[slot].blockNumber = std::min<BlockNumber>(table[slot].blockNumber, blockNumber);
+            return;
+        }
+    }
+}
+
+/**************************************************************************************
+ * Function: find
+ * Description: Looks up the indirect block whose first pointer is firstPointer.
+ * Parameters:
+ *    - firstPointer: The first block pointer to look for. Blocks past 2^32 cannot be
+ *                    pointed to and are never found.
+ * Returns:
+ *    - The block number of the indirect block, or -1 if there is none.
+ **************************************************************************************/
+BlockNumber IndirectIndex::find(BlockNumber firstPointer) const
+{
+    if (firstPointer <= 0 || firstPointer > UINT32_MAX)
+    {
+        return -1;
+    }
+
+    size_t mask = table.size() - 1;
+    for (size_t slot = slotFor(firstPointer, mask); table[slot].firstPointer != 0; slot = (slot + 1) & mask)
+    {
+        if (table[slot].firstPointer == firstPointer)
+        {
+            return table[slot].blockNumber;
+        }
+    }
+    return -1;
+}
+
+void IndirectIndex::grow()
+{
+    std::vector<Entry> old(table.size() * 2);
+    old.swap(table);
+    count = 0;
+
+    for (size_t i = 0; i < old.size(); ++i)
+    {
+        if (old[i].firstPointer != 0)
+        {
+            add(old[i].firstPointer, old[i].blockNumber);
+        }
+    }
+}
@@ -0,0 +1,39 @@
+#ifndef INDIRECTINDEX_H
+#define INDIRECTINDEX_H
+
+#include <cstddef>
+#include <vector>
+#include <stdint.h>
+
+#include "BlockDevice.h"
+
+class BlockClassMap;
+
+class IndirectIndex
+{
+public:
+    IndirectIndex();
+
+    static IndirectIndex build(const BlockDevice &device, const BlockClassMap &classes);
+    static bool looksLikeIndirect(const char *block, int length, BlockNumber blockCount);
+
+    void add(uint32_t firstPointer, BlockNumber blockNumber);
+    BlockNumber find(BlockNumber firstPointer) const;
+    size_t size() const { return count; }
+
+private:
+    // Blocks are stored at the width of an on-disk pointer, since a block past 2^32
+    // cannot be pointed to and so is never an indirect block
+    struct Entry
+    {
+        uint32_t firstPointer;
+        uint32_t blockNumber;
+    };
+
+    void grow();
+
+    std::vector<Entry> table;
+    size_t count;
+};
+
+#endif // INDIRECTINDEX_H
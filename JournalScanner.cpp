@@ -0,0 +1,356 @@
+#include "JournalScanner.h"
+#include <algorithm>
+#include <cstring>
+
+// JBD/JBD2 on-disk constants. Unlike the rest of ext3, the journal is big-endian.
+static const uint32_t journalMagic = 0xC03B3998;
+static const uint32_t descriptorBlockType = 1;
+static const uint32_t commitBlockType = 2;
+static const uint32_t superblockV1Type = 3;
+static const uint32_t superblockV2Type = 4;
+static const uint32_t revokeBlockType = 5;
+
+static const uint32_t featureIncompat64Bit = 0x2;
+static const uint32_t featureIncompatCsumV2 = 0x8;
+static const uint32_t featureIncompatCsumV3 = 0x10;
+
+static const uint16_t tagFlagEscape = 0x1;
+static const uint16_t tagFlagSameUuid = 0x2;
+static const uint16_t tagFlagLastTag = 0x8;
+
+static const uint32_t extentsFlag = 0x80000;
+static const uint16_t regularFileMode = 0x8000;
+
+static inline uint16_t be16(const char *p)
+{
+    const unsigned char *u = reinterpret_cast<const unsigned char *>(p);
+    return (u[0] << 8) | u[1];
+}
+
+static inline uint32_t be32(const char *p)
+{
+    const unsigned char *u = reinterpret_cast<const unsigned char *>(p);
+    return (static_cast<uint32_t>(u[0]) << 24) | (u[1] << 16) | (u[2] << 8) | u[3];
+}
+
+JournalScanner::JournalScanner()
+    : firstLogBlock(0), incompatFeatures(0), jbd2(false)
+{
+}
+
+/**************************************************************************************
+ * Function: load
+ * Description: Reads the ext3 journal and indexes every regular-file inode found in
+ *              journaled copies of inode table blocks. ext3 zeroes i_block[] when a file
+ *              is deleted, but older copies of the inode often survive in the journal.
+ *              The whole log area is scanned rather than just the live transactions,
+ *              since a cleanly unmounted journal has no live transactions at all.
+ * Parameters:
+ *    - device: The USB device, already set to the file system block size.
+ *    - fileSystem: The file system whose journal to read.
+ * Returns:
+ *    - True if a journal was found and scanned.
+ **************************************************************************************/
+bool JournalScanner::load(const BlockDevice &device, const Ext2FileSystem &fileSystem)
+{
+    Inode journalInode;
+    if (fileSystem.journalInode() == 0 || !fileSystem.readInode(device, fileSystem.journalInode(), journalInode))
+    {
+        return false;
+    }
+
+    if ((journalInode.flags & extentsFlag) || !mapJournal(device, journalInode, fileSystem.blockSize()))
+    {
+        return false;
+    }
+
+    BlockView superblock = journalBlock(device, 0);
+    if (superblock.size() < 48 || be32(superblock.data()) != journalMagic)
+    {
+        return false;
+    }
+
+    uint32_t type = be32(superblock.data() + 4);
+    if (type != superblockV1Type && type != superblockV2Type)
+    {
+        return false;
+    }
+    jbd2 = type == superblockV2Type;
+
+    uint32_t maxLength = std::min<uint32_t>(be32(superblock.data() + 16), journalBlocks.size());
+    firstLogBlock = be32(superblock.data() + 20);
+    incompatFeatures = jbd2 ? be32(superblock.data() + 40) : 0;
+    if (be32(superblock.data() + 12) != static_cast<uint32_t>(fileSystem.blockSize()) || firstLogBlock == 0)
+    {
+        return false;
+    }
+
+    journalBlocks.resize(maxLength);
+
+    for (uint32_t j = firstLogBlock; j < maxLength; ++j)
+    {
+        BlockView block = journalBlock(device, j);
+        if (block.size() < 12 || be32(block.data()) != journalMagic)
+        {
+            continue;
+        }
+
+        uint32_t blockType = be32(block.data() + 4);
+        uint32_t sequence = be32(block.data() + 8);
+        if (blockType == descriptorBlockType)
+        {
+            scanDescriptor(device, fileSystem, j, sequence);
+        }
+        else if (blockType == commitBlockType)
+        {
+            committedSequences.insert(sequence);
+        }
+        else if (blockType == revokeBlockType)
+        {
+            scanRevoke(device, j, sequence);
+        }
+    }
+
+    // A revoke record cancels every earlier journaled copy of that block
+    for (std::map<uint32_t, uint32_t>::const_iterator it = revokedBlocks.begin(); it != revokedBlocks.end(); ++it)
+    {
+        std::map<uint32_t, std::vector<size_t> >::const_iterator found = imagesByBlock.find(it->first);
+        if (found == imagesByBlock.end())
+        {
+            continue;
+        }
+        for (size_t i = 0; i < found->second.size(); ++i)
+        {
+            InodeImage &image = images[found->second[i]];
+            if (image.sequence <= it->second)
+            {
+                image.revoked = true;
+            }
+        }
+    }
+
+    // Prefer committed, unrevoked and then newest copies of each block map
+    for (size_t i = 0; i < images.size(); ++i)
+    {
+        InodeImage &image = images[i];
+        image.committed = committedSequences.count(image.sequence) != 0;
+
+        std::map<uint32_t, size_t>::iterator best = byFirstBlock.find(image.inode.block[0]);
+        if (best == byFirstBlock.end())
+        {
+            byFirstBlock[image.inode.block[0]] = i;
+            continue;
+        }
+
+        const InodeImage &current = images[best->second];
+        if (image.committed != current.committed)
+        {
+            if (image.committed)
+                best->second = i;
+        }
+        else if (image.revoked != current.revoked)
+        {
+            if (!image.revoked)
+                best->second = i;
+        }
+        else if (image.sequence > current.sequence)
+        {
+            best->second = i;
+        }
+    }
+
+    return true;
+}
+
+/**************************************************************************************
+ * Function: findByFirstBlock
+ * Description: Finds the best journaled inode whose first data block is firstBlock.
+ * Parameters:
+ *    - firstBlock: The first data block of the file, e.g. a signature hit.
+ * Returns:
+ *    - The inode image, or null if the journal holds none for that block.
+ **************************************************************************************/
+const InodeImage *JournalScanner::findByFirstBlock(uint32_t firstBlock) const
+{
+    std::map<uint32_t, size_t>::const_iterator found = byFirstBlock.find(firstBlock);
+    return found == byFirstBlock.end() ? 0 : &images[found->second];
+}
+
+/**************************************************************************************
+ * Function: mapJournal
+ * Description: Resolves the journal inode's block map into a list of physical blocks.
+ * Parameters:
+ *    - device: The USB device.
+ *    - journalInode: The journal's inode.
+ *    - blockSize: The size of each block.
+ * Returns:
+ *    - True if the journal has at least one block.
+ **************************************************************************************/
+bool JournalScanner::mapJournal(const BlockDevice &device, const Inode &journalInode, int blockSize)
+{
+    size_t wanted = journalInode.size / blockSize;
+    journalBlocks.clear();
+
+    for (int i = 0; i < 12 && journalBlocks.size() < wanted; ++i)
+    {
+        journalBlocks.push_back(journalInode.block[i]);
+    }
+
+    // Walk the single, double and triple indirect trees in order
+    std::vector<std::pair<uint32_t, int> > stack;
+    for (int level = 3; level >= 1; --level)
+    {
+        if (journalInode.block[11 + level] != 0)
+        {
+            stack.push_back(std::make_pair(journalInode.block[11 + level], level));
+        }
+    }
+
+    while (!stack.empty() && journalBlocks.size() < wanted)
+    {
+        std::pair<uint32_t, int> node = stack.back();
+        stack.pop_back();
+
+        BlockView block = device.block(node.first);
+        int count = block.pointerCount();
+
+        if (node.second == 1)
+        {
+            for (int i = 0; i < count && journalBlocks.size() < wanted; ++i)
+            {
+                journalBlocks.push_back(block.pointer(i));
+            }
+            continue;
+        }
+
+        for (int i = count - 1; i >= 0; --i)
+        {
+            if (block.pointer(i) != 0)
+            {
+                stack.push_back(std::make_pair(block.pointer(i), node.second - 1));
+            }
+        }
+    }
+
+    return !journalBlocks.empty();
+}
+
+/**************************************************************************************
+ * Function: scanDescriptor
+ * Description: Walks the tags of a descriptor block and records the inodes held in any
+ *              journaled inode table block that follows it.
+ * Parameters:
+ *    - device: The USB device.
+ *    - fileSystem: The file system the journal belongs to.
+ *    - descriptorBlock: The logical journal block of the descriptor.
+ *    - sequence: The transaction the descriptor belongs to.
+ **************************************************************************************/
+void JournalScanner::scanDescriptor(const BlockDevice &device, const Ext2FileSystem &fileSystem, uint32_t descriptorBlock, uint32_t sequence)
+{
+    BlockView descriptor = journalBlock(device, descriptorBlock);
+
+    int tagSize;
+    if (incompatFeatures & featureIncompatCsumV3)
+    {
+        tagSize = 16;
+    }
+    else
+    {
+        tagSize = 8 + ((incompatFeatures & featureIncompatCsumV2) ? 2 : 0) + ((incompatFeatures & featureIncompat64Bit) ? 4 : 0);
+    }
+    int tail = (incompatFeatures & (featureIncompatCsumV2 | featureIncompatCsumV3)) ? 4 : 0;
+
+    uint32_t dataBlock = descriptorBlock;
+    std::vector<char> copy;
+
+    for (int pos = 12; pos + tagSize <= descriptor.size() - tail;)
+    {
+        const char *tag = descriptor.data() + pos;
+        uint32_t fsBlock = be32(tag);
+        uint16_t flags = be16(tag + 6);
+
+        pos += tagSize;
+        if (!(flags & tagFlagSameUuid))
+        {
+            pos += 16;
+        }
+
+        if (++dataBlock >= journalBlocks.size())
+        {
+            dataBlock = firstLogBlock;
+        }
+
+        uint32_t firstInode;
+        if (fileSystem.isInodeTableBlock(fsBlock, firstInode))
+        {
+            BlockView data = journalBlock(device, dataBlock);
+            const char *raw = data.data();
+
+            // Escaped blocks had their leading magic number zeroed when journaled
+            if (flags & tagFlagEscape)
+            {
+                copy.assign(data.data(), data.data() + data.size());
+                copy[0] = 0xC0;
+                copy[1] = 0x3B;
+                copy[2] = 0x39;
+                copy[3] = static_cast<char>(0x98);
+                raw = copy.data();
+            }
+
+            int inodesPerBlock = data.size() / fileSystem.inodeSize();
+            for (int i = 0; i < inodesPerBlock; ++i)
+            {
+                InodeImage image;
+                Ext2FileSystem::parseInode(raw + i * fileSystem.inodeSize(), image.inode);
+                if ((image.inode.mode & 0xF000) != regularFileMode || image.inode.block[0] == 0 ||
+                    (image.inode.flags & extentsFlag) || image.inode.size == 0)
+                {
+                    continue;
+                }
+
+                image.inodeNumber = firstInode + i;
+                image.sequence = sequence;
+                image.committed = false;
+                image.revoked = false;
+                imagesByBlock[fsBlock].push_back(images.size());
+                images.push_back(image);
+            }
+        }
+
+        if (flags & tagFlagLastTag)
+        {
+            break;
+        }
+    }
+}
+
+/**************************************************************************************
+ * Function: scanRevoke
+ * Description: Records the blocks listed in a revoke block.
+ * Parameters:
+ *    - device: The USB device.
+ *    - revokeBlock: The logical journal block of the revoke block.
+ *    - sequence: The transaction the revoke block belongs to.
+ **************************************************************************************/
+void JournalScanner::scanRevoke(const BlockDevice &device, uint32_t revokeBlock, uint32_t sequence)
+{
+    BlockView block = journalBlock(device, revokeBlock);
+    int recordSize = (incompatFeatures & featureIncompat64Bit) ? 8 : 4;
+    int used = std::min<int>(be32(block.data() + 12), block.size());
+
+    for (int pos = 16; pos + recordSize <= used; pos += recordSize)
+    {
+        uint32_t fsBlock = be32(block.data() + pos + recordSize - 4);
+        uint32_t &latest = revokedBlocks[fsBlock];
+        latest = std::max(latest, sequence);
+    }
+}
+
+BlockView JournalScanner::journalBlock(const BlockDevice &device, uint32_t logicalBlock) const
+{
+    if (logicalBlock >= journalBlocks.size() || journalBlocks[logicalBlock] == 0)
+    {
+        return BlockView();
+    }
+    return device.block(journalBlocks[logicalBlock]);
+}
@@ -0,0 +1,50 @@
+#ifndef JOURNALSCANNER_H
+#define JOURNALSCANNER_H
+
+#include <map>
+#include <set>
+#include <vector>
+#include <stdint.h>
+#include "BlockDevice.h"
+#include "Ext2FileSystem.h"
+
+// A copy of an inode found in a journaled inode table block
+struct InodeImage
+{
+    uint32_t inodeNumber;
+    uint32_t sequence;
+    bool committed;
+    bool revoked;
+    Inode inode;
+};
+
+class JournalScanner
+{
+public:
+    JournalScanner();
+
+    bool load(const BlockDevice &device, const Ext2FileSystem &fileSystem);
+
+    const InodeImage *findByFirstBlock(uint32_t firstBlock) const;
+    size_t imageCount() const { return images.size(); }
+    size_t transactionCount() const { return committedSequences.size(); }
+
+private:
+    bool mapJournal(const BlockDevice &device, const Inode &journalInode, int blockSize);
+    void scanDescriptor(const BlockDevice &device, const Ext2FileSystem &fileSystem, uint32_t descriptorBlock, uint32_t sequence);
+    void scanRevoke(const BlockDevice &device, uint32_t revokeBlock, uint32_t sequence);
+    BlockView journalBlock(const BlockDevice &device, uint32_t logicalBlock) const;
+
+    std::vector<uint32_t> journalBlocks;
+    uint32_t firstLogBlock;
+    uint32_t incompatFeatures;
+    bool jbd2;
+
+    std::vector<InodeImage> images;
+    std::set<uint32_t> committedSequences;
+    std::map<uint32_t, uint32_t> revokedBlocks;
+    std::map<uint32_t, std::vector<size_t> > imagesByBlock;
+    std::map<uint32_t, size_t> byFirstBlock;
+};
+
+#endif // JOURNALSCANNER_H
@@ -0,0 +1,356 @@
+#include "OutputWriter.h"
+#include "BufferArena.h"
+#include "RecoveryStatus.h"
+#include "RunStats.h"
+#include <algorithm>
+#include <cstdlib>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+// Blocks are gathered into bufferCount aligned buffers of bufferSize bytes and written
+// with a single pwritev once all of them are full.
+static const size_t bufferSize = 1 << 20;
+static const size_t bufferCount = 8;
+
+/**************************************************************************************
+ * Function: OutputWriter
+ * Description: Wraps an output file descriptor with buffered, coalescing writes.
+ * Parameters:
+ *    - out_fd: The file descriptor of the output file. The writer takes ownership.
+ *    - durability: When to flush written data to disk: never, once when the writer is
+ *                  closed, or every syncIntervalMiB of output plus once at close.
+ *    - syncIntervalMiB: The interval used by SyncEveryInterval.
+ **************************************************************************************/
+OutputWriter::OutputWriter(int out_fd, Durability durability, size_t syncIntervalMiB)
+    : out_fd(out_fd), durability(durability), syncInterval(syncIntervalMiB << 20), unsynced(0),
+      pending(0), writeOffset(0), method(CopyFileRange)
+{
+    pipeFds[0] = pipeFds[1] = -1;
+    for (size_t i = 0; i < bufferCount; ++i)
+    {
+        char *buffer = BufferArena::shared().acquire(bufferSize);
+        if (!buffer)
+        {
+            releaseBuffers();
+            ::close(out_fd);
+            throw RecoveryError(RecoveryStatus::OutOfMemory, "Failed to allocate output buffers.");
+        }
+        buffers.push_back(buffer);
+    }
+}
+
+OutputWriter::~OutputWriter()
+{
+    if (out_fd != -1)
+    {
+        // Only reached without close() when an error is unwinding the stack; that error
+        // is the one reported, so a second one from the final flush is dropped
+        try
+        {
+            close();
+        }
+        catch (const RecoveryError &)
+        {
+            ::close(out_fd);
+        }
+    }
+    releaseBuffers();
+    if (pipeFds[0] != -1)
+    {
+        ::close(pipeFds[0]);
+        ::close(pipeFds[1]);
+    }
+}
+
+void OutputWriter::releaseBuffers()
+{
+    for (size_t i = 0; i < buffers.size(); ++i)
+    {
+        BufferArena::shared().release(buffers[i], bufferSize);
+    }
+    buffers.clear();
+}
+
+/**************************************************************************************
+ * Function: append
+ * Description: Appends data at the current end of the output, buffering it until a
+ *              large write can be issued.
+ * Parameters:
+ *    - data: The data to write.
+ *    - length: The number of bytes to write.
+ **************************************************************************************/
+void OutputWriter::append(const char *data, size_t length)
+{
+    while (length > 0)
+    {
+        size_t index = pending / bufferSize;
+        size_t used = pending % bufferSize;
+        size_t chunk = std::min(length, bufferSize - used);
+
+        memcpy(buffers[index] + used, data, chunk);
+        pending += chunk;
+        data += chunk;
+        length -= chunk;
+
+        if (pending == bufferSize * bufferCount)
+        {
+            flush();
+        }
+    }
+}
+
+/**************************************************************************************
+ * Function: appendRange
+ * Description: Appends a byte range of another file, e.g. a run of contiguous device
+ *              blocks. The data is moved inside the kernel with copy_file_range where
+ *              the kernel and file systems allow it, then with splice through a pipe,
+ *              and only read into the output buffers when neither works.
+ * Parameters:
+ *    - in_fd: The file descriptor to copy from.
+ *    - offset: The byte offset of the range in in_fd.
+ *    - length: The number of bytes to copy. Copying stops early at the end of in_fd.
+ **************************************************************************************/
+void OutputWriter::appendRange(int in_fd, off_t offset, size_t length)
+{
+    // Kernel copies write at writeOffset, so anything buffered has to land first
+    if (method != Buffered)
+    {
+        flush();
+    }
+
+    size_t done = 0;
+    while (done < length)
+    {
+        ssize_t copied;
+        if (method == CopyFileRange)
+        {
+            copied = copyFileRange(in_fd, offset + done, length - done);
+        }
+        else if (method == Splice)
+        {
+            copied = splice(in_fd, offset + done, length - done);
+        }
+        else
+        {
+            copied = readBuffered(in_fd, offset + done, length - done);
+        }
+
+        // -1 means the method was just given up on; retry the same range with the next one
+        if (copied == 0)
+        {
+            break;
+        }
+        if (copied > 0)
+        {
+            done += copied;
+        }
+    }
+}
+
+ssize_t OutputWriter::copyFileRange(int in_fd, off_t offset, size_t length)
+{
+    loff_t in = offset;
+    loff_t out = writeOffset;
+    ssize_t copied = copy_file_range(in_fd, &in, out_fd, &out, length, 0);
+    RunStats::count(RunStats::Syscalls);
+    if (copied >= 0)
+    {
+        RunStats::countRead(offset, copied, 0);
+        RunStats::countWrite(copied, 0);
+        wroteDirect(copied);
+        return copied;
+    }
+
+    if (errno == ENOSYS || errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP || errno == EBADF)
+    {
+        method = Splice;
+        return -1;
+    }
+    throw RecoveryError(RecoveryStatus::OutputError, "Failed to copy blocks to output file.");
+}
+
+ssize_t OutputWriter::splice(int in_fd, off_t offset, size_t length)
+{
+    if (pipeFds[0] == -1 && pipe2(pipeFds, O_CLOEXEC) != 0)
+    {
+        pipeFds[0] = pipeFds[1] = -1;
+        method = Buffered;
+        return -1;
+    }
+
+    // A pipe holds 64 KiB by default, so move the range through it in pieces
+    loff_t in = offset;
+    ssize_t moved = ::splice(in_fd, &in, pipeFds[1], 0, std::min<size_t>(length, 1 << 16), SPLICE_F_MOVE);
+    RunStats::count(RunStats::Syscalls);
+    if (moved == -1)
+    {
+        if (errno == EINVAL || errno == ENOSYS)
+        {
+            method = Buffered;
+            return -1;
+        }
+        throw RecoveryError(RecoveryStatus::OutputError, "Failed to copy blocks to output file.");
+    }
+
+    loff_t out = writeOffset;
+    for (ssize_t drained = 0; drained < moved;)
+    {
+        ssize_t written = ::splice(pipeFds[0], 0, out_fd, &out, moved - drained, SPLICE_F_MOVE);
+        if (written <= 0)
+        {
+            throw RecoveryError(RecoveryStatus::OutputError, "Failed to write block to output file.");
+        }
+        RunStats::countWrite(written, 1);
+        drained += written;
+    }
+    RunStats::countRead(offset, moved, 0);
+
+    wroteDirect(moved);
+    return moved;
+}
+
+ssize_t OutputWriter::readBuffered(int in_fd, off_t offset, size_t length)
+{
+    size_t index = pending / bufferSize;
+    size_t used = pending % bufferSize;
+    size_t chunk = std::min(length, bufferSize - used);
+
+    ssize_t bytesRead = pread(in_fd, buffers[index] + used, chunk, offset);
+    if (bytesRead == -1)
+    {
+        throw RecoveryError(RecoveryStatus::DeviceError, "Failed to read block from USB device.");
+    }
+    RunStats::countRead(offset, bytesRead, 1);
+
+    pending += bytesRead;
+    if (pending == bufferSize * bufferCount)
+    {
+        flush();
+    }
+    return bytesRead;
+}
+
+// Accounts for data the kernel wrote at writeOffset on the writer's behalf
+void OutputWriter::wroteDirect(size_t length)
+{
+    writeOffset += length;
+    unsynced += length;
+    if (durability == SyncEveryInterval && unsynced >= syncInterval)
+    {
+        sync();
+    }
+}
+
+/**************************************************************************************
+ * Function: seek
+ * Description: Moves where the next append lands, e.g. to place blocks that were read
+ *              out of order at their offset in the file. Appends that follow on from
+ *              each other are still gathered into large writes.
+ * Parameters:
+ *    - offset: The file offset of the next append.
+ **************************************************************************************/
+void OutputWriter::seek(off_t offset)
+{
+    if (offset == this->offset())
+    {
+        return;
+    }
+    flush();
+    writeOffset = offset;
+}
+
+/**************************************************************************************
+ * Function: flush
+ * Description: Writes all buffered data at its file offset with pwritev.
+ **************************************************************************************/
+void OutputWriter::flush()
+{
+    struct iovec iov[bufferCount];
+    int iovcnt = 0;
+    for (size_t remaining = pending; remaining > 0; ++iovcnt)
+    {
+        iov[iovcnt].iov_base = buffers[iovcnt];
+        iov[iovcnt].iov_len = std::min(remaining, bufferSize);
+        remaining -= iov[iovcnt].iov_len;
+    }
+
+    size_t written = 0;
+    int first = 0;
+    while (written < pending)
+    {
+        ssize_t bytesWritten = pwritev(out_fd, iov + first, iovcnt - first, writeOffset + written);
+        if (bytesWritten == -1)
+        {
+            throw RecoveryError(RecoveryStatus::OutputError, "Failed to write block to output file.");
+        }
+        RunStats::countWrite(bytesWritten, 1);
+        written += bytesWritten;
+
+        // Skip past whatever a short write already covered
+        while (first < iovcnt && static_cast<size_t>(bytesWritten) >= iov[first].iov_len)
+        {
+            bytesWritten -= iov[first].iov_len;
+            ++first;
+        }
+        if (first < iovcnt)
+        {
+            iov[first].iov_base = static_cast<char *>(iov[first].iov_base) + bytesWritten;
+            iov[first].iov_len -= bytesWritten;
+        }
+    }
+
+    writeOffset += pending;
+    unsynced += pending;
+    pending = 0;
+
+    if (durability == SyncEveryInterval && unsynced >= syncInterval)
+    {
+        sync();
+    }
+}
+
+/**************************************************************************************
+ * Function: truncate
+ * Description: Flushes buffered data and sets the final size of the output file.
+ * Parameters:
+ *    - length: The size of the output file in bytes.
+ **************************************************************************************/
+void OutputWriter::truncate(off_t length)
+{
+    flush();
+    RunStats::count(RunStats::Syscalls);
+    if (ftruncate(out_fd, length) != 0)
+    {
+        throw RecoveryError(RecoveryStatus::OutputError, "Failed to set file size on output file.");
+    }
+    writeOffset = length;
+}
+
+/**************************************************************************************
+ * Function: close
+ * Description: Flushes buffered data, applies the final sync if the durability mode
+ *              asks for one, and closes the output file.
+ **************************************************************************************/
+void OutputWriter::close()
+{
+    flush();
+    if (durability != NoSync)
+    {
+        sync();
+    }
+    ::close(out_fd);
+    out_fd = -1;
+}
+
+void OutputWriter::sync()
+{
+    RunStats::count(RunStats::Syscalls);
+    if (fsync(out_fd) == -1)
+    {
+        throw RecoveryError(RecoveryStatus::OutputError, "Failed to flush data to disk.");
+    }
+    unsynced = 0;
+}
@@ -0,0 +1,63 @@
+#ifndef OUTPUTWRITER_H
+#define OUTPUTWRITER_H
+
+#include <vector>
+#include <sys/types.h>
+
+class OutputWriter
+{
+public:
+    enum Durability
+    {
+        NoSync,
+        SyncAtEnd,
+        SyncEveryInterval
+    };
+
+    // How appendRange moves data, from fastest to slowest. A writer starts at
+    // CopyFileRange and steps down for good the first time the kernel refuses.
+    enum CopyMethod
+    {
+        CopyFileRange,
+        Splice,
+        Buffered
+    };
+
+    OutputWriter(int out_fd, Durability durability = SyncAtEnd, size_t syncIntervalMiB = 64);
+    ~OutputWriter();
+
+    void append(const char *data, size_t length);
+    void appendRange(int in_fd, off_t offset, size_t length);
+    void seek(off_t offset);
+    void flush();
+    void truncate(off_t length);
+    void close();
+
+    int fd() const { return out_fd; }
+    off_t offset() const { return writeOffset + pending; }
+    CopyMethod copyMethod() const { return method; }
+
+private:
+    OutputWriter(const OutputWriter &);
+    OutputWriter &operator=(const OutputWriter &);
+
+    void sync();
+    void releaseBuffers();
+    void wroteDirect(size_t length);
+    ssize_t copyFileRange(int in_fd, off_t offset, size_t length);
+    ssize_t splice(int in_fd, off_t offset, size_t length);
+    ssize_t readBuffered(int in_fd, off_t offset, size_t length);
+
+    int out_fd;
+    Durability durability;
+    size_t syncInterval;
+    size_t unsynced;
+
+    std::vector<char *> buffers;
+    size_t pending;
+    off_t writeOffset;
+    CopyMethod method;
+    int pipeFds[2];
+};
+
+#endif // OUTPUTWRITER_H
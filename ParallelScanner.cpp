@@ -0,0 +1,164 @@
+#include "ParallelScanner.h"
+#include "ThreadPool.h"
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Chunks still to be scanned by one worker. The owner takes from the front; idle
+// workers steal from the back, so the owner keeps reading sequentially.
+struct WorkQueue
+{
+    std::mutex lock;
+    std::deque<int> chunks;
+};
+
+static bool popFront(WorkQueue &queue, int &chunk)
+{
+    std::lock_guard<std::mutex> guard(queue.lock);
+    if (queue.chunks.empty())
+    {
+        return false;
+    }
+    chunk = queue.chunks.front();
+    queue.chunks.pop_front();
+    return true;
+}
+
+static bool stealBack(std::vector<WorkQueue> &queues, int thief, int &chunk)
+{
+    for (size_t i = 1; i < queues.size(); ++i)
+    {
+        WorkQueue &victim = queues[(thief + i) % queues.size()];
+        std::lock_guard<std::mutex> guard(victim.lock);
+        if (!victim.chunks.empty())
+        {
+            chunk = victim.chunks.back();
+            victim.chunks.pop_back();
+            return true;
+        }
+    }
+    return false;
+}
+
+/**************************************************************************************
+ * Function: ParallelScanner
+ * Description: Splits the device into block-aligned chunks for scanning on the shared
+ *              thread pool.
+ * Parameters:
+ *    - device: The USB device.
+ *    - threadCount: The number of scanning workers; 0 uses one per hardware thread.
+ *    - chunkBytes: The approximate size of each chunk, rounded to whole blocks.
+ **************************************************************************************/
+ParallelScanner::ParallelScanner(const BlockDevice &device, int threadCount, int chunkBytes)
+    : device(device), threadCount(threadCount), rangeStart(0), rangeEnd(device.blockCount()), skip(0)
+{
+    if (this->threadCount <= 0)
+    {
+        this->threadCount = std::max(1u, std::thread::hardware_concurrency());
+    }
+    chunkBlocks = std::max(1, chunkBytes / device.blockSize());
+    chunks = (device.blockCount() + chunkBlocks - 1) / chunkBlocks;
+}
+
+/**************************************************************************************
+ * Function: blockRange
+ * Description: Limits the scan to part of the device. Chunk numbers passed to the
+ *              visitor then count from the start of the range.
+ * Parameters:
+ *    - firstBlock: The first block to scan.
+ *    - blockCount: The number of blocks to scan; clipped to the end of the device.
+ **************************************************************************************/
+void ParallelScanner::blockRange(BlockNumber firstBlock, BlockNumber blockCount)
+{
+    rangeStart = std::max<BlockNumber>(0, std::min(firstBlock, device.blockCount()));
+    rangeEnd = rangeStart + std::max<BlockNumber>(0, std::min(blockCount, device.blockCount() - rangeStart));
+    chunks = (rangeEnd - rangeStart + chunkBlocks - 1) / chunkBlocks;
+}
+
+/**************************************************************************************
+ * Function: run
+ * Description: Visits every chunk of the device. Each thread starts with a contiguous
+ *              range of chunks and steals from the tail of other threads' ranges once
+ *              its own is exhausted, so a slow region does not hold up the others.
+ *              Visitors should store per-chunk results by chunk index and merge them in
+ *              chunk order afterwards to get block order.
+ * Parameters:
+ *    - visitor: Called for each chunk, possibly from several threads at once.
+ *    - overlap: Extra bytes past the end of each chunk to include in its view, for
+ *               matches that can straddle a chunk boundary.
+ **************************************************************************************/
+void ParallelScanner::run(const ChunkVisitor &visitor, size_t overlap) const
+{
+    int workers = std::min(threadCount, std::max(1, chunks));
+    std::vector<WorkQueue> queues(workers);
+    for (int chunk = 0; chunk < chunks; ++chunk)
+    {
+        queues[static_cast<long>(chunk) * workers / chunks].chunks.push_back(chunk);
+    }
+
+    // Lowest chunk whose visitor asked to stop; later chunks are skipped
+    std::atomic<int> stopChunk(chunks);
+    int blockSize = device.blockSize();
+
+    auto work = [&](int self)
+    {
+        int chunk;
+        while (popFront(queues[self], chunk) || stealBack(queues, self, chunk))
+        {
+            if (chunk > stopChunk.load())
+            {
+                continue;
+            }
+
+            BlockNumber chunkStart = rangeStart + static_cast<BlockNumber>(chunk) * chunkBlocks;
+            BlockNumber chunkEnd = std::min(chunkStart + chunkBlocks, rangeEnd);
+            bool stop = false;
+
+            // Only read the runs of blocks that are not skipped. A failed read ends the
+            // whole scan, and run() passes the error on once every worker has stopped.
+            try
+            {
+                for (BlockNumber firstBlock = chunkStart; firstBlock < chunkEnd && !stop;)
+                {
+                    if (skip && skip->test(firstBlock))
+                    {
+                        ++firstBlock;
+                        continue;
+                    }
+
+                    BlockNumber lastBlock = firstBlock + 1;
+                    while (lastBlock < chunkEnd && !(skip && skip->test(lastBlock)))
+                    {
+                        ++lastBlock;
+                    }
+
+                    int blockCount = lastBlock - firstBlock;
+                    BlockView window = device.view(device.offsetOf(firstBlock), static_cast<size_t>(blockCount) * blockSize + overlap);
+                    stop = visitor(chunk, firstBlock, blockCount, window);
+                    firstBlock = lastBlock;
+                }
+            }
+            catch (...)
+            {
+                stopChunk = -1;
+                throw;
+            }
+
+            if (stop)
+            {
+                int current = stopChunk.load();
+                while (chunk < current && !stopChunk.compare_exchange_weak(current, chunk))
+                {
+                }
+            }
+        }
+    };
+
+    // Workers run on the shared pool, so engines scanning other devices at the same time
+    // split its threads instead of each starting their own. A worker that starts after
+    // the others finds its chunks already stolen.
+    ThreadPool::shared().run(workers, work);
+}
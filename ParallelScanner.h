@@ -0,0 +1,34 @@
+#ifndef PARALLELSCANNER_H
+#define PARALLELSCANNER_H
+
+#include <functional>
+#include "BlockBitmap.h"
+#include "BlockDevice.h"
+
+class ParallelScanner
+{
+public:
+    // Called once per chunk with a view that starts at firstBlock and covers blockCount
+    // blocks plus up to overlap bytes of the next chunk. Returning true cancels every
+    // chunk after this one. When blocks are skipped, a chunk is visited once per run of
+    // blocks that are not skipped, always on the same thread.
+    typedef std::function<bool(int chunk, BlockNumber firstBlock, int blockCount, const BlockView &window)> ChunkVisitor;
+
+    explicit ParallelScanner(const BlockDevice &device, int threadCount = 0, int chunkBytes = 1 << 20);
+
+    int chunkCount() const { return chunks; }
+    void skipBlocks(const BlockBitmap *blocks) { skip = blocks; }
+    void blockRange(BlockNumber firstBlock, BlockNumber blockCount);
+    void run(const ChunkVisitor &visitor, size_t overlap = 0) const;
+
+private:
+    const BlockDevice &device;
+    int threadCount;
+    int chunkBlocks;
+    int chunks;
+    BlockNumber rangeStart;
+    BlockNumber rangeEnd;
+    const BlockBitmap *skip;
+};
+
+#endif // PARALLELSCANNER_H
@@ -0,0 +1,518 @@
+#include "RecoveryEngine.h"
+#include "AsyncBlockReader.h"
+#include "BatchRecovery.h"
+#include "BlockCache.h"
+#include "BlockIO.h"
+#include "BlockRecovery.h"
+#include "Ext2FileSystem.h"
+#include "FileGlue.h"
+#include "FormatCarver.h"
+#include "JournalScanner.h"
+#include "RunStats.h"
+#include "ScanIndex.h"
+#include "StreamCarver.h"
+#include <iostream>
+#include <new>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+RecoveryOptions::RecoveryOptions()
+    : formats(1, Zip), readQueueDepth(32), blockCacheSize(1024), batchResolvers(2), batchWriters(2),
+      durability(OutputWriter::SyncAtEnd), streamWindowMiB(64), directIO(false), log(&std::cout), errorLog(&std::cerr)
+{
+}
+
+RecoveredFile::RecoveredFile()
+    : format(Zip), startBlock(-1), size(-1), fromJournal(false)
+{
+}
+
+BatchResult::BatchResult()
+    : candidates(0), recovered(0)
+{
+}
+
+/**************************************************************************************
+ * Function: RecoveryEngine
+ * Description: Sets up an engine for one source. Nothing is opened until a recovery
+ *              is asked for.
+ * Parameters:
+ *    - sourcePath: The USB device or image file, or for recoverStream a pipe, file or
+ *                  "-" for stdin.
+ *    - options: The formats to recover and how to go about it.
+ **************************************************************************************/
+RecoveryEngine::RecoveryEngine(const std::string &sourcePath, const RecoveryOptions &options)
+    : sourcePath(sourcePath), options(options), quiet(0)
+{
+}
+
+/**************************************************************************************
+ * Function: recoverFile
+ * Description: Recovers the first candidate file on the source into outputPath.
+ * Parameters:
+ *    - outputPath: The file to write; created if needed.
+ * Returns:
+ *    - The status and what was found. Whatever was written before a failure is left in
+ *      the output file.
+ **************************************************************************************/
+RecoveredFile RecoveryEngine::recoverFile(const std::string &outputPath)
+{
+    RecoveredFile result;
+    result.status = checkFormats();
+    if (!result.status.ok())
+    {
+        return result;
+    }
+
+    try
+    {
+        recoverFileTo(outputPath, result);
+    }
+    catch (const RecoveryError &error)
+    {
+        result.status = error.status();
+    }
+    catch (const std::bad_alloc &)
+    {
+        result.status = RecoveryStatus(RecoveryStatus::OutOfMemory, "Out of memory.");
+    }
+    return result;
+}
+
+/**************************************************************************************
+ * Function: recoverAll
+ * Description: Recovers every candidate file on the source into a directory, named
+ *              <start block><extension>.
+ * Parameters:
+ *    - outputDirectory: The directory to write to; created if needed.
+ * Returns:
+ *    - The status and counts. Candidates that fail on their own are skipped and counted
+ *      as not recovered; the status only reports errors that stopped the whole run.
+ **************************************************************************************/
+BatchResult RecoveryEngine::recoverAll(const std::string &outputDirectory)
+{
+    BatchResult result;
+    result.status = checkFormats();
+    if (!result.status.ok())
+    {
+        return result;
+    }
+
+    try
+    {
+        recoverAllTo(outputDirectory, result);
+    }
+    catch (const RecoveryError &error)
+    {
+        result.status = error.status();
+    }
+    catch (const std::bad_alloc &)
+    {
+        result.status = RecoveryStatus(RecoveryStatus::OutOfMemory, "Out of memory.");
+    }
+    return result;
+}
+
+/**************************************************************************************
+ * Function: recoverStream
+ * Description: Carves every candidate file out of the source in one forward pass, for
+ *              pipes and other inputs that cannot seek.
+ * Parameters:
+ *    - outputDirectory: The directory to write to; created if needed.
+ * Returns:
+ *    - The status and counts.
+ **************************************************************************************/
+BatchResult RecoveryEngine::recoverStream(const std::string &outputDirectory)
+{
+    BatchResult result;
+    result.status = checkFormats();
+    if (!result.status.ok())
+    {
+        return result;
+    }
+
+    try
+    {
+        recoverStreamTo(outputDirectory, result);
+    }
+    catch (const RecoveryError &error)
+    {
+        result.status = error.status();
+    }
+    catch (const std::bad_alloc &)
+    {
+        result.status = RecoveryStatus(RecoveryStatus::OutOfMemory, "Out of memory.");
+    }
+    return result;
+}
+
+RecoveryStatus RecoveryEngine::checkFormats() const
+{
+    if (options.formats.empty())
+    {
+        return RecoveryStatus(RecoveryStatus::InvalidArgument, "No file formats to recover.");
+    }
+    return RecoveryStatus();
+}
+
+// Opens the output file, keeping what is already in it
+static int openOutputFile(const std::string &outputPath)
+{
+    int out_fd = open(outputPath.c_str(), O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+    if (out_fd == -1)
+    {
+        throw RecoveryError(RecoveryStatus::OutputError, "Failed to open output file.");
+    }
+    return out_fd;
+}
+
+// Creates the directory recovered files are written to
+static void makeOutputDirectory(const std::string &outputDirectory)
+{
+    if (mkdir(outputDirectory.c_str(), S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH) != 0 && errno != EEXIST)
+    {
+        throw RecoveryError(RecoveryStatus::OutputError, "Failed to create output directory.");
+    }
+}
+
+// Counts the bytes a full scan reads: the free blocks, or the whole device
+static uint64_t scanBytes(const BlockDevice &device, const Ext2FileSystem &fileSystem, const BlockBitmap *allocatedBlocks)
+{
+    return allocatedBlocks ? static_cast<uint64_t>(fileSystem.freeBlockCount()) * fileSystem.blockSize() : device.size();
+}
+
+// Copies a list of data blocks to the end of the output file, returning true once a tracked file has ended
+bool RecoveryEngine::copyBlocks(AsyncBlockReader &reader, const ExtentList &blocks, OutputWriter &writer, ExtentList &totalBlocks, BlockCache &cache, EndDetector *end)
+{
+    RunStats::PhaseTimer timer(RunStats::Copy);
+    int blockSize = cache.device().blockSize();
+    off_t fileOffset = static_cast<off_t>(totalBlocks.blockCount()) * blockSize;
+    totalBlocks.append(blocks);
+
+    // Blocks are read in device order and placed at their offset in the file, so check
+    // that every one of them arrived
+    size_t copied = copyScheduled(cache.device(), blocks, fileOffset, writer, reader, &cache);
+    if (copied != blocks.blockCount())
+    {
+        throw RecoveryError(RecoveryStatus::DeviceError, "Failed to read " + std::to_string(blocks.blockCount() - copied) + " of " +
+                                                             std::to_string(blocks.blockCount()) + " data blocks from USB device.");
+    }
+
+    // Nothing after the end of the file belongs to it
+    return end && detectEnd(*end, writer, fileOffset, fileOffset + static_cast<off_t>(blocks.blockCount()) * blockSize);
+}
+
+// Recovers a file whose exact block map was found in the journal
+void RecoveryEngine::recoverFromInodeImage(BlockCache &cache, const InodeImage &image, AsyncBlockReader &reader, OutputWriter &writer)
+{
+    const BlockDevice &device = cache.device();
+    const Inode &inode = image.inode;
+    for (int i = 0; i < 15; ++i)
+    {
+        log() << "\ti_block[" << i << "] = " << inode.block[i] << "\n";
+    }
+
+    ExtentList blocks;
+    {
+        RunStats::PhaseTimer timer(RunStats::IndirectSearch);
+        for (int i = 0; i < 12; ++i)
+        {
+            blocks.append(inode.block[i]);
+        }
+        if (inode.block[12] != 0)
+        {
+            blocks.append(BlockRecovery::getBlockNumbersFromIndirect(cache, inode.block[12]));
+        }
+        if (inode.block[13] != 0)
+        {
+            blocks.append(BlockRecovery::findDoubleIndirectBlocks(cache, inode.block[13]));
+        }
+        if (inode.block[14] != 0)
+        {
+            blocks.append(BlockRecovery::findTripleIndirectBlocks(cache, inode.block[14]));
+        }
+
+        // The inode's size says exactly how many blocks belong to the file
+        blocks.truncate((inode.size + device.blockSize() - 1) / device.blockSize());
+    }
+
+    RunStats::beginProgress("copy", inode.size);
+    ExtentList totalBlocks;
+    copyBlocks(reader, blocks, writer, totalBlocks, cache);
+
+    RunStats::PhaseTimer timer(RunStats::Finalize);
+    writer.truncate(inode.size);
+}
+
+// Reads the file system metadata and journal, returning the allocated blocks to skip
+const BlockBitmap *RecoveryEngine::loadFileSystem(BlockDevice &device, Ext2FileSystem &fileSystem, JournalScanner &journal)
+{
+    if (options.directIO && !device.isDirect())
+    {
+        log() << "Direct I/O is not supported on " << sourcePath << "; reading through the page cache and dropping the pages read\n\n";
+    }
+
+    // Deleted data can only live in free blocks, so skip allocated ones when the
+    // partition's ext2/ext3 metadata is readable
+    const BlockBitmap *allocatedBlocks = 0;
+    fileSystem.logTo(options.errorLog);
+    if (fileSystem.load(device))
+    {
+        allocatedBlocks = &fileSystem.allocatedBlocks();
+        log() << "ext2/ext3 file system: " << fileSystem.blockSize() << "-byte blocks, "
+              << fileSystem.freeBlockCount() << " of " << fileSystem.blockCount() << " blocks free\n\n";
+    }
+
+    // Older copies of the deleted inode in the journal give its exact block map
+    if (allocatedBlocks && journal.load(device, fileSystem))
+    {
+        log() << "ext3 journal: " << journal.imageCount() << " inode copies in "
+              << journal.transactionCount() << " committed transactions\n\n";
+    }
+
+    return allocatedBlocks;
+}
+
+// Builds, resumes or opens the scan index, if one was asked for
+bool RecoveryEngine::openScanIndex(ScanIndex &scanIndex, const BlockDevice &device, const Ext2FileSystem &fileSystem, const BlockBitmap *allocatedBlocks)
+{
+    if (options.indexPath.empty())
+    {
+        return false;
+    }
+
+    scanIndex.logTo(options.log, options.errorLog);
+    ScanKey key = ScanIndex::makeKey(device, allocatedBlocks ? fileSystem.uuid() : 0, options.formats);
+    if (!scanIndex.update(options.indexPath, device, key, options.formats, allocatedBlocks))
+    {
+        errors() << "Continuing without a scan index.\n";
+        return false;
+    }
+
+    log() << "Scan index " << options.indexPath << ": " << scanIndex.hitCount() << " candidate files\n\n";
+    return true;
+}
+
+void RecoveryEngine::recoverFileTo(const std::string &outputPath, RecoveredFile &result)
+{
+    const std::vector<FileFormat> &formats = options.formats;
+    BlockDevice device(sourcePath, 4096, options.directIO ? BlockDevice::Direct : BlockDevice::Auto);
+    Ext2FileSystem fileSystem;
+    JournalScanner journal;
+    const BlockBitmap *allocatedBlocks = loadFileSystem(device, fileSystem, journal);
+
+    OutputWriter writer(openOutputFile(outputPath), options.durability);
+    AsyncBlockReader reader(device, options.readQueueDepth);
+    BlockCache cache(device, options.blockCacheSize);
+
+    // A saved scan index answers every lookup below without touching the device
+    ScanIndex scanIndex;
+    BlockClassMap blockClasses;
+    bool indexed;
+    SignatureHit first;
+    {
+        RunStats::PhaseTimer timer(RunStats::Scan);
+        RunStats::beginProgress("scan", scanBytes(device, fileSystem, allocatedBlocks));
+        indexed = openScanIndex(scanIndex, device, fileSystem, allocatedBlocks);
+        if (indexed)
+        {
+            blockClasses = scanIndex.blockClasses();
+        }
+
+        first = indexed ? BlockRecovery::findFirstBlockOfType(scanIndex)
+                        : BlockRecovery::findFirstBlockOfType(device, formats, allocatedBlocks);
+    }
+    BlockNumber startBlock = first.blockNumber;
+    FileFormat format = formats[first.signatureIndex];
+    result.startBlock = startBlock;
+    result.format = format;
+    log() << "Found a " << formatTable[format].name << " file at block " << startBlock << "\n";
+
+    const InodeImage *image = startBlock <= UINT32_MAX ? journal.findByFirstBlock(startBlock) : 0;
+    if (image)
+    {
+        log() << "Block map of inode " << image->inodeNumber << " found in journal transaction " << image->sequence << "\n";
+        recoverFromInodeImage(cache, *image, reader, writer);
+        writer.close();
+        result.fromJournal = true;
+        result.size = image->inode.size;
+        return;
+    }
+
+    // Without an index the scan stopped at the first hit, so there is no class map and
+    // the direct blocks are read and checked one by one
+    ExtentList directBlocks = BlockRecovery::findDirectBlocks(device, startBlock, 12, indexed ? &blockClasses : 0);
+    ExtentList totalBlocks;
+
+    // The file is parsed by its format as it is copied, so the traversal can stop at
+    // the file's end, e.g. a ZIP file's End of Central Directory record
+    std::unique_ptr<EndDetector> endDetector = makeEndDetector(format);
+    EndDetector *end = endDetector.get();
+
+    // Write the direct blocks to the output file
+    RunStats::beginProgress("copy");
+    for (size_t i = 0; i < directBlocks.blockCount(); ++i)
+    {
+        log() << "\ti_block[" << i << "] = " << (directBlocks.firstBlock() + i) << "\n";
+        log().flush();
+    }
+    bool fileEnded = copyBlocks(reader, directBlocks, writer, totalBlocks, cache, end);
+
+    // Get indirect block if exists
+    BlockNumber indirectBlock;
+    if (directBlocks.blockCount() == 12 && !fileEnded)
+    {
+        bool indirectFull;
+        ExtentList directBlockNumbers;
+        {
+            RunStats::PhaseTimer timer(RunStats::IndirectSearch);
+            if (indexed)
+            {
+                indirectBlock = BlockRecovery::findIndirectBlock(scanIndex, directBlocks.lastBlock() + 1);
+            }
+            else
+            {
+                RunStats::beginProgress("indirect search", scanBytes(device, fileSystem, allocatedBlocks));
+                indirectBlock = BlockRecovery::findIndirectBlock(device, directBlocks.lastBlock() + 1, allocatedBlocks);
+            }
+            log() << "\ti_block[12] = " << indirectBlock << "\n";
+
+            directBlockNumbers = BlockRecovery::getBlockNumbersFromIndirect(cache, indirectBlock, &indirectFull);
+        }
+
+        // Write the indirect blocks to the output file
+        RunStats::beginProgress("copy");
+        fileEnded = copyBlocks(reader, directBlockNumbers, writer, totalBlocks, cache, end);
+
+        // Get and write double indirect blocks
+        if (indirectFull && !fileEnded)
+        {
+            log() << "\ti_block[13] = " << (indirectBlock + 1) << "\n";
+            bool doubleIndirectFull;
+            ExtentList blocksFromDoubleIndirect;
+            {
+                RunStats::PhaseTimer timer(RunStats::IndirectSearch);
+                blocksFromDoubleIndirect = BlockRecovery::findDoubleIndirectBlocks(cache, indirectBlock + 1, &doubleIndirectFull);
+            }
+            fileEnded = copyBlocks(reader, blocksFromDoubleIndirect, writer, totalBlocks, cache, end);
+
+            // Write the triple indirect blocks
+            if (doubleIndirectFull && !blocksFromDoubleIndirect.empty() && !fileEnded)
+            {
+                log() << "\ti_block[14] = " << (indirectBlock + 2) << "\n";
+                ExtentList tripleIndirectBlocks;
+                {
+                    RunStats::PhaseTimer timer(RunStats::IndirectSearch);
+                    tripleIndirectBlocks = BlockRecovery::findTripleIndirectBlocks(cache, blocksFromDoubleIndirect.lastBlock() + 1);
+                }
+
+                copyBlocks(reader, tripleIndirectBlocks, writer, totalBlocks, cache, end);
+            }
+            else
+                log() << "\ti_block[14] = 0\n";
+        }
+        else
+        {
+            log() << "\ti_block[13] = 0\n";
+            log() << "\ti_block[14] = 0\n";
+        }
+    }
+    else
+    {
+        log() << "\ti_block[12] = 0\n";
+        log() << "\ti_block[13] = 0\n";
+        log() << "\ti_block[14] = 0\n";
+    }
+
+    // The end of the file's format gives the exact size; otherwise finalize the file
+    // and remove any trailing 0s
+    RunStats::PhaseTimer timer(RunStats::Finalize);
+    RunStats::beginProgress("finalize");
+    off_t fileSize;
+    if (end->complete())
+    {
+        fileSize = end->fileSize();
+        result.endSummary = end->summary();
+        log() << "\nEnd of " << formatTable[format].name << " file found: " << fileSize << " bytes (" << result.endSummary << ")\n";
+    }
+    else
+    {
+        fileSize = finalizeFile(totalBlocks, cache, writer);
+    }
+
+    writer.truncate(fileSize);
+    writer.close();
+    result.size = fileSize;
+
+    log() << "\nBlock cache: " << cache.hits() << " hits, " << cache.misses() << " misses\n";
+}
+
+void RecoveryEngine::recoverAllTo(const std::string &outputDirectory, BatchResult &result)
+{
+    BlockDevice device(sourcePath, 4096, options.directIO ? BlockDevice::Direct : BlockDevice::Auto);
+    Ext2FileSystem fileSystem;
+    JournalScanner journal;
+    const BlockBitmap *allocatedBlocks = loadFileSystem(device, fileSystem, journal);
+    makeOutputDirectory(outputDirectory);
+
+    ScanIndex scanIndex;
+    bool indexed;
+    {
+        RunStats::PhaseTimer timer(RunStats::Scan);
+        RunStats::beginProgress("scan index", scanBytes(device, fileSystem, allocatedBlocks));
+        indexed = openScanIndex(scanIndex, device, fileSystem, allocatedBlocks);
+    }
+
+    // The stages overlap, so progress covers the whole run; the scan reads the most
+    RunStats::beginProgress("batch", indexed ? 0 : scanBytes(device, fileSystem, allocatedBlocks));
+    BatchRecovery batch(device, options.formats, outputDirectory);
+    batch.skipBlocks(allocatedBlocks);
+    batch.useIndex(indexed ? &scanIndex : 0);
+    batch.useJournal(&journal);
+    batch.finalizeWith(finalizeFile);
+    batch.logTo(options.log, options.errorLog);
+    batch.run(options.batchResolvers, options.batchWriters);
+
+    result.candidates = batch.candidateCount();
+    result.recovered = batch.recoveredCount();
+    log() << "\nRecovered " << result.recovered << " of " << result.candidates << " candidate files.\n";
+}
+
+void RecoveryEngine::recoverStreamTo(const std::string &outputDirectory, BatchResult &result)
+{
+    bool standardInput = sourcePath == "-";
+    int in_fd = standardInput ? STDIN_FILENO : open(sourcePath.c_str(), O_RDONLY);
+    if (in_fd == -1)
+    {
+        throw RecoveryError(RecoveryStatus::DeviceError, "Failed to open the input stream.");
+    }
+
+    try
+    {
+        makeOutputDirectory(outputDirectory);
+
+        RunStats::beginProgress("stream");
+        StreamCarver carver(in_fd, options.formats, outputDirectory, options.streamWindowMiB);
+        carver.logTo(options.log, options.errorLog);
+        carver.run();
+
+        result.candidates = carver.candidateCount();
+        result.recovered = carver.recoveredCount();
+    }
+    catch (...)
+    {
+        if (!standardInput)
+        {
+            close(in_fd);
+        }
+        throw;
+    }
+    if (!standardInput)
+    {
+        close(in_fd);
+    }
+
+    log() << "\nRecovered " << result.recovered << " of " << result.candidates << " candidate files.\n";
+}
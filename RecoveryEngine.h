@@ -0,0 +1,104 @@
+#ifndef RECOVERYENGINE_H
+#define RECOVERYENGINE_H
+
+#include <ostream>
+#include <string>
+#include <vector>
+#include <sys/types.h>
+#include "BlockDevice.h"
+#include "ExtentList.h"
+#include "FileFormat.h"
+#include "OutputWriter.h"
+#include "RecoveryStatus.h"
+
+class AsyncBlockReader;
+class BlockBitmap;
+class BlockCache;
+class EndDetector;
+class Ext2FileSystem;
+class JournalScanner;
+class ScanIndex;
+struct InodeImage;
+
+// Settings of one engine; the defaults are the ones the command line program uses
+struct RecoveryOptions
+{
+    RecoveryOptions();
+
+    std::vector<FileFormat> formats;     // formats to recover
+    std::string indexPath;               // scan index to build, resume or open; empty for none
+    int readQueueDepth;                  // block reads kept in flight by the copy loops
+    int blockCacheSize;                  // indirect and metadata blocks kept in memory
+    int batchResolvers;                  // worker threads for each batch stage after the scanner
+    int batchWriters;
+    OutputWriter::Durability durability; // when a single recovered file is flushed to disk
+    size_t streamWindowMiB;              // most recent input the stream carver keeps
+    bool directIO;                       // scan with O_DIRECT, bypassing the page cache
+    std::ostream *log;                   // receives the engine's progress lines; null for none
+    std::ostream *errorLog;              // receives warnings and files that failed; null for none
+};
+
+// The outcome of RecoveryEngine::recoverFile
+struct RecoveredFile
+{
+    RecoveredFile();
+
+    RecoveryStatus status;
+    FileFormat format;
+    BlockNumber startBlock;  // -1 if no candidate was found
+    off_t size;              // -1 unless the file was written
+    bool fromJournal;        // the block map came from a journaled copy of the inode
+    std::string endSummary;  // what the format's end detector found; empty if it found no end
+};
+
+// The outcome of RecoveryEngine::recoverAll and recoverStream
+struct BatchResult
+{
+    BatchResult();
+
+    RecoveryStatus status;
+    int candidates;
+    int recovered;
+};
+
+// Recovers deleted files from one USB device, image file or forward-only stream.
+// Failures come back as statuses rather than ending the process, and an engine keeps
+// no state between calls, so a service can run one engine per device on as many
+// threads as it likes. Every engine shares the process's ThreadPool and BufferArena;
+// the RunStats counters and progress line are process-wide as well.
+class RecoveryEngine
+{
+public:
+    explicit RecoveryEngine(const std::string &sourcePath, const RecoveryOptions &options = RecoveryOptions());
+
+    RecoveredFile recoverFile(const std::string &outputPath);
+    BatchResult recoverAll(const std::string &outputDirectory);
+    BatchResult recoverStream(const std::string &outputDirectory);
+
+    const std::string &source() const { return sourcePath; }
+    const RecoveryOptions &settings() const { return options; }
+
+private:
+    RecoveryEngine(const RecoveryEngine &);
+    RecoveryEngine &operator=(const RecoveryEngine &);
+
+    std::ostream &log() { return options.log ? *options.log : quiet; }
+    std::ostream &errors() { return options.errorLog ? *options.errorLog : quiet; }
+    RecoveryStatus checkFormats() const;
+
+    void recoverFileTo(const std::string &outputPath, RecoveredFile &result);
+    void recoverAllTo(const std::string &outputDirectory, BatchResult &result);
+    void recoverStreamTo(const std::string &outputDirectory, BatchResult &result);
+
+    const BlockBitmap *loadFileSystem(BlockDevice &device, Ext2FileSystem &fileSystem, JournalScanner &journal);
+    bool openScanIndex(ScanIndex &scanIndex, const BlockDevice &device, const Ext2FileSystem &fileSystem, const BlockBitmap *allocatedBlocks);
+    void recoverFromInodeImage(BlockCache &cache, const InodeImage &image, AsyncBlockReader &reader, OutputWriter &writer);
+    bool copyBlocks(AsyncBlockReader &reader, const ExtentList &blocks, OutputWriter &writer, ExtentList &totalBlocks, BlockCache &cache,
+                    EndDetector *end = 0);
+
+    std::string sourcePath;
+    RecoveryOptions options;
+    std::ostream quiet; // discards the logs that are null in options
+};
+
+#endif // RECOVERYENGINE_H
@@ -0,0 +1,43 @@
+#ifndef RECOVERYSTATUS_H
+#define RECOVERYSTATUS_H
+
+#include <stdexcept>
+#include <string>
+
+// The outcome of a library call: Ok, or what went wrong with a message for the user
+struct RecoveryStatus
+{
+    enum Code
+    {
+        Ok,
+        NotFound,      // no candidate file, or no block a heuristic needs
+        DeviceError,   // the device or input stream could not be opened or read
+        OutputError,   // an output file or directory could not be created or written
+        OutOfMemory,
+        InvalidArgument
+    };
+
+    RecoveryStatus() : code(Ok) {}
+    RecoveryStatus(Code code, const std::string &message) : code(code), message(message) {}
+
+    bool ok() const { return code == Ok; }
+
+    Code code;
+    std::string message;
+};
+
+// Thrown by the library in place of ending the process. RecoveryEngine catches it at
+// the API boundary and returns its status, so one failed device or file does not take
+// the other engines in the process down with it.
+class RecoveryError : public std::runtime_error
+{
+public:
+    RecoveryError(RecoveryStatus::Code code, const std::string &message) : std::runtime_error(message), errorCode(code) {}
+
+    RecoveryStatus status() const { return RecoveryStatus(errorCode, what()); }
+
+private:
+    RecoveryStatus::Code errorCode;
+};
+
+#endif // RECOVERYSTATUS_H
@@ -0,0 +1,210 @@
+#include "RunStats.h"
+#include <algorithm>
+#include <condition_variable>
+#include <cstdio>
+#include <iomanip>
+#include <mutex>
+#include <sstream>
+#include <thread>
+
+std::atomic<uint64_t> RunStats::counters[RunStats::CounterCount];
+std::atomic<uint64_t> RunStats::phaseNanos[RunStats::PhaseCount];
+
+// Where the calling thread's last device read ended. Each scanner and copy thread reads
+// its own range in order, so seeks are counted against that thread's reads only.
+static thread_local uint64_t nextReadOffset = 0;
+
+static const char *counterNames[RunStats::CounterCount] = {"bytes_read", "bytes_written", "syscalls", "seeks", "cache_hits", "cache_misses"};
+static const char *phaseNames[RunStats::PhaseCount] = {"scan", "indirect_search", "copy", "finalize"};
+
+typedef std::chrono::steady_clock Clock;
+static const Clock::time_point runStart = Clock::now();
+
+// State shared with the progress thread, guarded by progressMutex
+static std::mutex progressMutex;
+static std::condition_variable progressWake;
+static std::thread progressThread;
+static bool progressStopping = false;
+static std::string progressLabel;
+static uint64_t progressBase = 0;
+static uint64_t progressExpected = 0;
+static Clock::time_point progressStart;
+
+static double secondsBetween(Clock::time_point from, Clock::time_point to)
+{
+    return std::chrono::duration<double>(to - from).count();
+}
+
+// Formats a byte count with a decimal unit, e.g. "1.25 GB"
+static std::string formatBytes(double bytes)
+{
+    static const char *units[] = {"B", "KB", "MB", "GB", "TB"};
+    int unit = 0;
+    while (bytes >= 1000 && unit < 4)
+    {
+        bytes /= 1000;
+        ++unit;
+    }
+    std::ostringstream out;
+    out << std::fixed << std::setprecision(unit == 0 ? 0 : 2) << bytes << " " << units[unit];
+    return out.str();
+}
+
+static std::string formatDuration(double seconds)
+{
+    long total = static_cast<long>(seconds + 0.5);
+    char text[32];
+    snprintf(text, sizeof(text), "%ld:%02ld:%02ld", total / 3600, total / 60 % 60, total % 60);
+    return text;
+}
+
+RunStats::PhaseTimer::~PhaseTimer()
+{
+    phaseNanos[phase].fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count(),
+                                std::memory_order_relaxed);
+}
+
+double RunStats::phaseSeconds(Phase phase)
+{
+    return phaseNanos[phase].load(std::memory_order_relaxed) / 1e9;
+}
+
+/**************************************************************************************
+ * Function: countRead
+ * Description: Records a read from the device. A read that does not start where the
+ *              same thread's previous read ended counts as a seek.
+ * Parameters:
+ *    - offset: The byte offset the read started at.
+ *    - length: The number of bytes read.
+ *    - syscalls: The number of system calls the read took; 0 for the mmap backend.
+ **************************************************************************************/
+void RunStats::countRead(uint64_t offset, uint64_t length, int syscalls)
+{
+    if (nextReadOffset != offset)
+    {
+        count(Seeks);
+    }
+    nextReadOffset = offset + length;
+    count(BytesRead, length);
+    if (syscalls)
+    {
+        count(Syscalls, syscalls);
+    }
+}
+
+void RunStats::countWrite(uint64_t length, int syscalls)
+{
+    count(BytesWritten, length);
+    count(Syscalls, syscalls);
+}
+
+/**************************************************************************************
+ * Function: beginProgress
+ * Description: Starts a new step for the progress line, which then reports the bytes
+ *              read since this call.
+ * Parameters:
+ *    - label: The name shown on the progress line, e.g. "scan".
+ *    - expectedBytes: How many bytes the step should read, for the percentage and the
+ *                     ETA; 0 if unknown.
+ **************************************************************************************/
+void RunStats::beginProgress(const std::string &label, uint64_t expectedBytes)
+{
+    std::lock_guard<std::mutex> lock(progressMutex);
+    progressLabel = label;
+    progressBase = value(BytesRead);
+    progressExpected = expectedBytes;
+    progressStart = Clock::now();
+}
+
+/**************************************************************************************
+ * Function: startProgress
+ * Description: Starts a thread that prints a progress line every interval: the
+ *              current step, bytes read, read rate over the last interval and, when the
+ *              step's size is known, the percentage done and an ETA.
+ * Parameters:
+ *    - intervalSeconds: The time between progress lines.
+ *    - out: The stream the lines are written to. It must outlive the thread, which
+ *           runs until stopProgress().
+ **************************************************************************************/
+void RunStats::startProgress(int intervalSeconds, std::ostream &out)
+{
+    progressThread = std::thread([intervalSeconds, &out]
+    {
+        std::unique_lock<std::mutex> lock(progressMutex);
+        uint64_t lastBytes = value(BytesRead);
+        Clock::time_point lastTime = Clock::now();
+
+        while (!progressWake.wait_for(lock, std::chrono::seconds(intervalSeconds), [] { return progressStopping; }))
+        {
+            uint64_t bytes = value(BytesRead);
+            Clock::time_point now = Clock::now();
+            double rate = (bytes - lastBytes) / secondsBetween(lastTime, now);
+            lastBytes = bytes;
+            lastTime = now;
+
+            if (progressLabel.empty())
+            {
+                continue;
+            }
+
+            uint64_t done = bytes - progressBase;
+            std::ostringstream line;
+            line << "[" << progressLabel << "] " << formatBytes(done);
+            if (progressExpected > 0)
+            {
+                line << " of " << formatBytes(progressExpected) << " (" << std::min<uint64_t>(100, done * 100 / progressExpected) << "%)";
+            }
+            line << ", " << formatBytes(rate) << "/s";
+
+            // The ETA uses the step's average rate, which is steadier than the last interval's
+            double elapsed = secondsBetween(progressStart, now);
+            if (progressExpected > done && done > 0)
+            {
+                line << ", ETA " << formatDuration((progressExpected - done) * elapsed / done);
+            }
+            line << ", " << value(Syscalls) << " syscalls, " << value(Seeks) << " seeks\n";
+            out << line.str();
+            out.flush();
+        }
+    });
+}
+
+void RunStats::stopProgress()
+{
+    {
+        std::lock_guard<std::mutex> lock(progressMutex);
+        progressStopping = true;
+    }
+    progressWake.notify_all();
+    if (progressThread.joinable() && progressThread.get_id() != std::this_thread::get_id())
+    {
+        progressThread.join();
+    }
+}
+
+/**************************************************************************************
+ * Function: writeJson
+ * Description: Writes every counter and phase time as a JSON object.
+ * Parameters:
+ *    - out: The stream to write to.
+ **************************************************************************************/
+void RunStats::writeJson(std::ostream &out)
+{
+    double elapsed = secondsBetween(runStart, Clock::now());
+
+    std::ostringstream json;
+    json << std::fixed << std::setprecision(6) << "{\n";
+    json << "  \"elapsed_seconds\": " << elapsed << ",\n";
+    for (int i = 0; i < CounterCount; ++i)
+    {
+        json << "  \"" << counterNames[i] << "\": " << value(static_cast<Counter>(i)) << ",\n";
+    }
+    json << "  \"read_mb_per_second\": " << (elapsed > 0 ? value(BytesRead) / elapsed / 1e6 : 0) << ",\n";
+    json << "  \"phase_seconds\": {";
+    for (int i = 0; i < PhaseCount; ++i)
+    {
+        json << (i ? ", " : "") << "\"" << phaseNames[i] << "\": " << phaseSeconds(static_cast<Phase>(i));
+    }
+    json << "}\n}\n";
+    out << json.str();
+}
@@ -0,0 +1,74 @@
+#ifndef RUNSTATS_H
+#define RUNSTATS_H
+
+#include <atomic>
+#include <chrono>
+#include <ostream>
+#include <string>
+#include <stdint.h>
+
+// Process-wide counters and phase timers for a recovery run. The counters are updated
+// from the I/O paths on any thread, feed the periodic progress line, and can be written
+// out as JSON. The library prints nothing itself: the progress line and the JSON go to
+// streams the program supplies.
+class RunStats
+{
+public:
+    enum Counter
+    {
+        BytesRead,
+        BytesWritten,
+        Syscalls,
+        Seeks,
+        CacheHits,
+        CacheMisses,
+        CounterCount
+    };
+
+    enum Phase
+    {
+        Scan,
+        IndirectSearch,
+        Copy,
+        Finalize,
+        PhaseCount
+    };
+
+    // Adds the time from construction to destruction to a phase. Phases timed on
+    // several threads at once add up, so their total can exceed the run's wall time.
+    class PhaseTimer
+    {
+    public:
+        explicit PhaseTimer(Phase phase) : phase(phase), start(std::chrono::steady_clock::now()) {}
+        ~PhaseTimer();
+
+    private:
+        PhaseTimer(const PhaseTimer &);
+        PhaseTimer &operator=(const PhaseTimer &);
+
+        Phase phase;
+        std::chrono::steady_clock::time_point start;
+    };
+
+    static void count(Counter counter, uint64_t amount = 1)
+    {
+        counters[counter].fetch_add(amount, std::memory_order_relaxed);
+    }
+    static uint64_t value(Counter counter) { return counters[counter].load(std::memory_order_relaxed); }
+    static double phaseSeconds(Phase phase);
+
+    static void countRead(uint64_t offset, uint64_t length, int syscalls);
+    static void countWrite(uint64_t length, int syscalls);
+
+    static void beginProgress(const std::string &label, uint64_t expectedBytes = 0);
+    static void startProgress(int intervalSeconds, std::ostream &out);
+    static void stopProgress();
+
+    static void writeJson(std::ostream &out);
+
+private:
+    static std::atomic<uint64_t> counters[CounterCount];
+    static std::atomic<uint64_t> phaseNanos[PhaseCount];
+};
+
+#endif // RUNSTATS_H
@@ -0,0 +1,420 @@
+#include "ScanIndex.h"
+#include "BlockClassifier.h"
+#include "ParallelScanner.h"
+#include "SignatureScanner.h"
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Bumped whenever the layout below changes; older files are then rescanned
+static const char indexMagic[8] = {'F', 'R', 'S', 'C', 'A', 'N', 'I', 'X'};
+static const uint32_t indexVersion = 3;
+static const uint32_t completeFlag = 0x1;
+
+// The device is scanned in segments of this many blocks, and the results so far are
+// saved after a segment once checkpointSeconds have passed since the last save
+static const int segmentBlocks = 1 << 18;
+static const int checkpointSeconds = 30;
+
+// Sections are page-aligned so each can be mapped and read in place
+static const size_t sectionAlignment = 4096;
+
+struct ScanIndex::Header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t flags;
+    uint64_t deviceSize;
+    uint32_t blockSize;
+    uint32_t signatureHash;
+    unsigned char uuid[16];
+    uint64_t scannedBlocks;
+    uint64_t hitCount;
+    uint64_t hitOffset;
+    uint64_t indirectCount;
+    uint64_t indirectOffset;
+    uint64_t classWords;
+    uint64_t classOffset;
+};
+
+static uint64_t alignSection(uint64_t offset)
+{
+    return (offset + sectionAlignment - 1) / sectionAlignment * sectionAlignment;
+}
+
+static bool lessByPointer(const IndexedIndirect &a, const IndexedIndirect &b)
+{
+    return a.firstPointer < b.firstPointer || (a.firstPointer == b.firstPointer && a.blockNumber < b.blockNumber);
+}
+
+// Writes all of a section, resuming after a short write or a signal; false on any error
+static bool writeSection(int fd, const void *data, size_t length, off_t offset)
+{
+    const char *bytes = static_cast<const char *>(data);
+    for (size_t done = 0; done < length;)
+    {
+        ssize_t bytesWritten = pwrite(fd, bytes + done, length - done, offset + done);
+        if (bytesWritten == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (bytesWritten <= 0)
+        {
+            return false;
+        }
+        done += bytesWritten;
+    }
+    return true;
+}
+
+ScanIndex::ScanIndex()
+    : mapping(0), mappingSize(0), header(0), progressLog(0), errorLog(0)
+{
+}
+
+ScanIndex::~ScanIndex()
+{
+    close();
+}
+
+/**************************************************************************************
+ * Function: makeKey
+ * Description: Builds the key an index file must match to be used for a device.
+ * Parameters:
+ *    - device: The USB device.
+ *    - uuid: The file system's 16-byte UUID, or null if there is no file system.
+ *    - formats: The file formats the scan looks for.
+ * Returns:
+ *    - The key.
+ **************************************************************************************/
+ScanKey ScanIndex::makeKey(const BlockDevice &device, const unsigned char *uuid, const std::vector<FileFormat> &formats)
+{
+    ScanKey key;
+    key.deviceSize = device.size();
+    key.blockSize = device.blockSize();
+    memset(key.uuid, 0, sizeof(key.uuid));
+    if (uuid)
+    {
+        memcpy(key.uuid, uuid, sizeof(key.uuid));
+    }
+
+    // FNV-1a over the formats' signatures, each followed by its length
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < formats.size(); ++i)
+    {
+        std::string signature = formatSignature(formats[i]);
+        std::string field = signature + std::string(1, static_cast<char>(signature.size()));
+        for (size_t j = 0; j < field.size(); ++j)
+        {
+            hash = (hash ^ static_cast<unsigned char>(field[j])) * 16777619u;
+        }
+    }
+    key.signatureHash = hash;
+    return key;
+}
+
+/**************************************************************************************
+ * Function: open
+ * Description: Maps an existing index file if it was written for this key.
+ * Parameters:
+ *    - path: The index file.
+ *    - key: The device and scan the index must belong to.
+ * Returns:
+ *    - True if the file was mapped. It may still be an incomplete, checkpointed scan.
+ **************************************************************************************/
+bool ScanIndex::open(const std::string &path, const ScanKey &key)
+{
+    close();
+
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd == -1)
+    {
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(Header))
+    {
+        ::close(fd);
+        return false;
+    }
+
+    void *addr = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (addr == MAP_FAILED)
+    {
+        return false;
+    }
+    mapping = static_cast<char *>(addr);
+    mappingSize = st.st_size;
+
+    const Header *h = reinterpret_cast<const Header *>(mapping);
+    bool valid = memcmp(h->magic, indexMagic, sizeof(indexMagic)) == 0 && h->version == indexVersion &&
+                 h->deviceSize == key.deviceSize && h->blockSize == key.blockSize &&
+                 h->signatureHash == key.signatureHash && memcmp(h->uuid, key.uuid, sizeof(key.uuid)) == 0 &&
+                 h->hitOffset + h->hitCount * sizeof(IndexedHit) <= mappingSize &&
+                 h->indirectOffset + h->indirectCount * sizeof(IndexedIndirect) <= mappingSize &&
+                 h->classOffset + h->classWords * sizeof(uint64_t) <= mappingSize;
+    if (!valid)
+    {
+        close();
+        return false;
+    }
+
+    header = h;
+    return true;
+}
+
+/**************************************************************************************
+ * Function: update
+ * Description: Makes sure path holds a complete index for the device. A complete index
+ *              is just opened; a checkpointed one is resumed; otherwise the device is
+ *              scanned from the start. Each segment is scanned in parallel for signature
+ *              hits and block classes in a single pass; the blocks classified as
+ *              pointer arrays are the indirect block candidates.
+ * Parameters:
+ *    - path: The index file.
+ *    - device: The USB device.
+ *    - key: The key from makeKey.
+ *    - formats: The file formats to look for.
+ *    - skipBlocks: If not null, blocks set in this map are neither read nor indexed.
+ * Returns:
+ *    - True if a complete index is open; false if it could not be written.
+ **************************************************************************************/
+bool ScanIndex::update(const std::string &path, const BlockDevice &device, const ScanKey &key,
+                       const std::vector<FileFormat> &formats, const BlockBitmap *skipBlocks)
+{
+    if (open(path, key) && isComplete())
+    {
+        return true;
+    }
+
+    std::vector<IndexedHit> hitList;
+    std::vector<IndexedIndirect> indirectList;
+    BlockClassMap classMap(device.blockCount());
+    BlockNumber startBlock = 0;
+
+    if (header)
+    {
+        const IndexedHit *savedHits = hits();
+        hitList.assign(savedHits, savedHits + hitCount());
+        const IndexedIndirect *savedIndirect = reinterpret_cast<const IndexedIndirect *>(mapping + header->indirectOffset);
+        indirectList.assign(savedIndirect, savedIndirect + header->indirectCount);
+        memcpy(classMap.data(), mapping + header->classOffset, std::min<size_t>(header->classWords, classMap.wordCount()) * sizeof(uint64_t));
+        startBlock = header->scannedBlocks;
+        if (progressLog)
+        {
+            *progressLog << "Resuming scan index at block " << startBlock << " of " << device.blockCount() << "\n";
+        }
+        close();
+    }
+
+    SignatureScanner matcher(formats);
+    size_t overlap = 0;
+    for (size_t i = 0; i < formats.size(); ++i)
+    {
+        overlap = std::max(overlap, formatTable[formats[i]].signatureLength);
+    }
+    int blockSize = device.blockSize();
+    BlockClassifier classifier(blockSize, device.blockCount());
+    std::chrono::steady_clock::time_point lastSave = std::chrono::steady_clock::now();
+
+    for (BlockNumber segment = startBlock; segment < device.blockCount(); segment += segmentBlocks)
+    {
+        ParallelScanner scanner(device);
+        scanner.skipBlocks(skipBlocks);
+        scanner.blockRange(segment, segmentBlocks);
+        std::vector<std::vector<SignatureHit> > chunkHits(scanner.chunkCount());
+        std::vector<std::vector<IndexedIndirect> > chunkIndirect(scanner.chunkCount());
+
+        scanner.run([&](int chunk, BlockNumber firstBlock, int count, const BlockView &window)
+        {
+            for (int i = 0; i < count; ++i)
+            {
+                ssize_t pos = static_cast<ssize_t>(i) * blockSize;
+                if (pos >= window.size())
+                {
+                    break;
+                }
+                ssize_t length = std::min<ssize_t>(blockSize, window.size() - pos);
+                const char *block = window.data() + pos;
+
+                matcher.match(block, std::min<ssize_t>(overlap, window.size() - pos), firstBlock + i, chunkHits[chunk]);
+                BlockClass blockClass = classifier.classify(block, length, firstBlock + i);
+                classMap.set(firstBlock + i, blockClass);
+                if (blockClass == PointerArray)
+                {
+                    IndexedIndirect candidate = {window.pointer(pos / sizeof(uint32_t)), static_cast<uint32_t>(firstBlock + i)};
+                    chunkIndirect[chunk].push_back(candidate);
+                }
+            }
+            return false;
+        }, overlap > 0 ? overlap - 1 : 0);
+
+        for (size_t chunk = 0; chunk < chunkHits.size(); ++chunk)
+        {
+            for (size_t i = 0; i < chunkHits[chunk].size(); ++i)
+            {
+                IndexedHit hit = {static_cast<uint64_t>(chunkHits[chunk][i].blockNumber), static_cast<uint32_t>(chunkHits[chunk][i].signatureIndex), 0};
+                hitList.push_back(hit);
+            }
+            indirectList.insert(indirectList.end(), chunkIndirect[chunk].begin(), chunkIndirect[chunk].end());
+        }
+
+        BlockNumber scanned = std::min<BlockNumber>(segment + segmentBlocks, device.blockCount());
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        if (scanned < device.blockCount() && now - lastSave >= std::chrono::seconds(checkpointSeconds))
+        {
+            if (!save(path, key, scanned, false, hitList, indirectList, classMap))
+            {
+                reportSaveFailure(path);
+                return false;
+            }
+            lastSave = now;
+        }
+    }
+
+    if (!save(path, key, device.blockCount(), true, hitList, indirectList, classMap))
+    {
+        reportSaveFailure(path);
+        return false;
+    }
+    return open(path, key);
+}
+
+void ScanIndex::reportSaveFailure(const std::string &path) const
+{
+    if (errorLog)
+    {
+        *errorLog << "Failed to write scan index " << path << ".\n";
+    }
+}
+
+bool ScanIndex::isComplete() const
+{
+    return header && (header->flags & completeFlag);
+}
+
+size_t ScanIndex::hitCount() const
+{
+    return header ? header->hitCount : 0;
+}
+
+// Hits are in block order
+const IndexedHit *ScanIndex::hits() const
+{
+    return header ? reinterpret_cast<const IndexedHit *>(mapping + header->hitOffset) : 0;
+}
+
+/**************************************************************************************
+ * Function: findIndirect
+ * Description: Looks up the indirect block candidate with the given first pointer by
+ *              binary search over the mapped, sorted candidates.
+ * Parameters:
+ *    - firstPointer: The first block pointer to look for.
+ * Returns:
+ *    - The lowest block number holding that first pointer, or -1 if there is none.
+ **************************************************************************************/
+BlockNumber ScanIndex::findIndirect(BlockNumber firstPointer) const
+{
+    if (!header || firstPointer <= 0 || firstPointer > UINT32_MAX)
+    {
+        return -1;
+    }
+
+    const IndexedIndirect *begin = reinterpret_cast<const IndexedIndirect *>(mapping + header->indirectOffset);
+    const IndexedIndirect *end = begin + header->indirectCount;
+    IndexedIndirect probe = {static_cast<uint32_t>(firstPointer), 0};
+    const IndexedIndirect *found = std::lower_bound(begin, end, probe, lessByPointer);
+    return found != end && found->firstPointer == firstPointer ? static_cast<BlockNumber>(found->blockNumber) : -1;
+}
+
+// A copy of the block class map in the form findDirectBlocks takes
+BlockClassMap ScanIndex::blockClasses() const
+{
+    if (!header)
+    {
+        return BlockClassMap();
+    }
+
+    BlockClassMap classMap(header->deviceSize / header->blockSize + (header->deviceSize % header->blockSize != 0));
+    memcpy(classMap.data(), mapping + header->classOffset, std::min<size_t>(header->classWords, classMap.wordCount()) * sizeof(uint64_t));
+    return classMap;
+}
+
+void ScanIndex::close()
+{
+    if (mapping)
+    {
+        munmap(mapping, mappingSize);
+    }
+    mapping = 0;
+    mappingSize = 0;
+    header = 0;
+}
+
+/**************************************************************************************
+ * Function: save
+ * Description: Writes the scan results to a temporary file and renames it over path, so
+ *              a crash mid-save leaves the previous checkpoint intact. A write that
+ *              fails part way drops the temporary file and keeps the old checkpoint.
+ * Parameters:
+ *    - path: The index file.
+ *    - key: The key the index is written for.
+ *    - scannedBlocks: Every block below this one has been scanned.
+ *    - complete: Whether the whole device has been scanned.
+ *    - hits: The signature hits, in block order.
+ *    - indirect: The indirect block candidates; sorted here by first pointer.
+ *    - classes: The block classes found so far.
+ * Returns:
+ *    - True if the file was written.
+ **************************************************************************************/
+bool ScanIndex::save(const std::string &path, const ScanKey &key, uint64_t scannedBlocks, bool complete,
+                     const std::vector<IndexedHit> &hits, std::vector<IndexedIndirect> &indirect, const BlockClassMap &classes)
+{
+    std::sort(indirect.begin(), indirect.end(), lessByPointer);
+
+    Header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, indexMagic, sizeof(indexMagic));
+    h.version = indexVersion;
+    h.flags = complete ? completeFlag : 0;
+    h.deviceSize = key.deviceSize;
+    h.blockSize = key.blockSize;
+    h.signatureHash = key.signatureHash;
+    memcpy(h.uuid, key.uuid, sizeof(h.uuid));
+    h.scannedBlocks = scannedBlocks;
+    h.hitCount = hits.size();
+    h.hitOffset = alignSection(sizeof(Header));
+    h.indirectCount = indirect.size();
+    h.indirectOffset = alignSection(h.hitOffset + hits.size() * sizeof(IndexedHit));
+    h.classWords = classes.wordCount();
+    h.classOffset = alignSection(h.indirectOffset + indirect.size() * sizeof(IndexedIndirect));
+
+    std::string temporary = path + ".tmp";
+    int fd = ::open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    if (fd == -1)
+    {
+        return false;
+    }
+
+    bool ok = writeSection(fd, &h, sizeof(h), 0) &&
+              writeSection(fd, hits.data(), hits.size() * sizeof(IndexedHit), h.hitOffset) &&
+              writeSection(fd, indirect.data(), indirect.size() * sizeof(IndexedIndirect), h.indirectOffset) &&
+              writeSection(fd, classes.data(), h.classWords * sizeof(uint64_t), h.classOffset) &&
+              fsync(fd) == 0;
+    ::close(fd);
+
+    if (!ok || rename(temporary.c_str(), path.c_str()) != 0)
+    {
+        unlink(temporary.c_str());
+        return false;
+    }
+    return true;
+}
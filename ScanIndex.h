@@ -0,0 +1,78 @@
+#ifndef SCANINDEX_H
+#define SCANINDEX_H
+
+#include <ostream>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include "BlockBitmap.h"
+#include "BlockClassMap.h"
+#include "BlockDevice.h"
+#include "FileFormat.h"
+
+// Identifies the device and scan an index file belongs to
+struct ScanKey
+{
+    uint64_t deviceSize;
+    uint32_t blockSize;
+    unsigned char uuid[16];
+    uint32_t signatureHash;
+};
+
+struct IndexedHit
+{
+    uint64_t blockNumber;
+    uint32_t signatureIndex;
+    uint32_t reserved;
+};
+
+// Indirect blocks are addressed by u32 on-disk pointers, so 32 bits hold any of them
+struct IndexedIndirect
+{
+    uint32_t firstPointer;
+    uint32_t blockNumber;
+};
+
+// The results of a full scan saved to a file, so later runs on the same device can skip
+// the scan. The file is memory-mapped and queried in place: signature hits in block
+// order, indirect block candidates sorted by first pointer, and the 2-bit block class map.
+// A scan that is interrupted resumes from its last checkpoint.
+class ScanIndex
+{
+public:
+    ScanIndex();
+    ~ScanIndex();
+
+    static ScanKey makeKey(const BlockDevice &device, const unsigned char *uuid, const std::vector<FileFormat> &formats);
+
+    void logTo(std::ostream *progress, std::ostream *errors) { progressLog = progress; errorLog = errors; }
+
+    bool open(const std::string &path, const ScanKey &key);
+    bool update(const std::string &path, const BlockDevice &device, const ScanKey &key,
+                const std::vector<FileFormat> &formats, const BlockBitmap *skipBlocks = 0);
+
+    bool isComplete() const;
+    size_t hitCount() const;
+    const IndexedHit *hits() const;
+    BlockNumber findIndirect(BlockNumber firstPointer) const;
+    BlockClassMap blockClasses() const;
+
+private:
+    ScanIndex(const ScanIndex &);
+    ScanIndex &operator=(const ScanIndex &);
+
+    struct Header;
+
+    void close();
+    void reportSaveFailure(const std::string &path) const;
+    static bool save(const std::string &path, const ScanKey &key, uint64_t scannedBlocks, bool complete,
+                     const std::vector<IndexedHit> &hits, std::vector<IndexedIndirect> &indirect, const BlockClassMap &classes);
+
+    char *mapping;
+    size_t mappingSize;
+    const Header *header;
+    std::ostream *progressLog; // receives resume notices; null for none
+    std::ostream *errorLog;    // receives why the index could not be written; null for none
+};
+
+#endif // SCANINDEX_H
@@ -0,0 +1,199 @@
+#include "SignatureScanner.h"
+#include "BlockDevice.h"
+#include "ParallelScanner.h"
+#include "BlockBitmap.h"
+#include "BlockClassifier.h"
+#include <iostream>
+#include <algorithm>
+#include <cstdlib>
+
+/**************************************************************************************
+ * Function: SignatureScanner
+ * Description: Picks the matcher for a set of file formats. Each matcher is a FormatSet
+ *              expanded at compile time; a single format gets its own fixed compare,
+ *              and any other set uses the matcher for all formats, with hits of formats
+ *              outside the set dropped.
+ * Parameters:
+ *    - formats: The formats to look for. A format's position in this list is the
+ *               signatureIndex reported in each hit.
+ **************************************************************************************/
+SignatureScanner::SignatureScanner(const std::vector<FileFormat> &formats)
+    : formats(formats), maxLength(0), runMatcher(&matchRun<AllFormats>)
+{
+    std::fill(slotOf, slotOf + FormatCount, -1);
+    for (size_t i = 0; i < formats.size(); ++i)
+    {
+        slotOf[formats[i]] = i;
+        maxLength = std::max(maxLength, formatTable[formats[i]].signatureLength);
+    }
+
+    if (formats.size() == 1)
+    {
+        switch (formats[0])
+        {
+        case Zip:
+            runMatcher = &matchRun<FormatSet<Zip> >;
+            break;
+        case Pdf:
+            runMatcher = &matchRun<FormatSet<Pdf> >;
+            break;
+        case Jpeg:
+            runMatcher = &matchRun<FormatSet<Jpeg> >;
+            break;
+        case Png:
+            runMatcher = &matchRun<FormatSet<Png> >;
+            break;
+        case Sqlite:
+            runMatcher = &matchRun<FormatSet<Sqlite> >;
+            break;
+        case Gzip:
+            runMatcher = &matchRun<FormatSet<Gzip> >;
+            break;
+        default:
+            break;
+        }
+    }
+}
+
+/**************************************************************************************
+ * Function: match
+ * Description: Matches every format in the set against the start of one block.
+ * Parameters:
+ *    - block: The block contents.
+ *    - length: The number of valid bytes in block.
+ *    - blockNumber: The block number recorded in any hits.
+ *    - hits: Receives an entry if the block starts with the signature of a format.
+ **************************************************************************************/
+void SignatureScanner::match(const char *block, int length, BlockNumber blockNumber, std::vector<SignatureHit> &hits) const
+{
+    int format = AllFormats::match(block, length);
+    if (format >= 0 && slotOf[format] >= 0)
+    {
+        SignatureHit hit = {blockNumber, slotOf[format]};
+        hits.push_back(hit);
+    }
+}
+
+/**************************************************************************************
+ * Function: matchRun
+ * Description: Matches the start of each block in a run against a compile-time set of
+ *              formats, and optionally records the class of each block.
+ * Parameters:
+ *    - scanner: The scanner whose format list numbers the hits.
+ *    - window: The run's blocks, extended far enough for the longest signature.
+ *    - blockSize: The device's block size.
+ *    - firstBlock: The block number of the first block in window.
+ *    - blockCount: The number of blocks in the run.
+ *    - hits: Receives the hits, in block order.
+ *    - classes: If not null, receives the class of each block in the run.
+ **************************************************************************************/
+template <class Set>
+void SignatureScanner::matchRun(const SignatureScanner &scanner, const BlockView &window, int blockSize, BlockNumber firstBlock, int blockCount,
+                                std::vector<SignatureHit> &hits, BlockClassMap *classes)
+{
+    BlockClassifier classifier(blockSize, classes ? classes->blockCount() : 0);
+    for (int i = 0; i < blockCount; ++i)
+    {
+        ssize_t pos = static_cast<ssize_t>(i) * blockSize;
+        if (pos >= window.size())
+        {
+            break;
+        }
+
+        int format = Set::match(window.data() + pos, window.size() - pos);
+        if (format >= 0 && scanner.slotOf[format] >= 0)
+        {
+            SignatureHit hit = {firstBlock + i, scanner.slotOf[format]};
+            hits.push_back(hit);
+        }
+        if (classes)
+        {
+            classes->set(firstBlock + i, classifier.classify(window.data() + pos, std::min<ssize_t>(blockSize, window.size() - pos), firstBlock + i));
+        }
+    }
+}
+
+/**************************************************************************************
+ * Function: scan
+ * Description: Scans the whole device for blocks that start with any of the signatures.
+ *              The device is split into chunks that are scanned in parallel; each chunk
+ *              view extends into the next chunk far enough for the longest signature.
+ * Parameters:
+ *    - device: The USB device.
+ *    - maxHits: Stop once this many hits have been found; 0 scans the whole device.
+ *    - classes: If not null, reset to a map of the class of every block. Only filled
+ *               when the whole device is scanned (maxHits is 0); skipped blocks are
+ *               left unclassified.
+ *    - skipBlocks: If not null, blocks set in this map are neither read nor matched.
+ * Returns:
+ *    - The hits in block order.
+ **************************************************************************************/
+std::vector<SignatureHit> SignatureScanner::scan(const BlockDevice &device, size_t maxHits, BlockClassMap *classes, const BlockBitmap *skipBlocks) const
+{
+    if (classes)
+    {
+        *classes = maxHits == 0 ? BlockClassMap(device.blockCount()) : BlockClassMap();
+    }
+    BlockClassMap *classMap = classes && !classes->empty() ? classes : 0;
+
+    ParallelScanner scanner(device);
+    scanner.skipBlocks(skipBlocks);
+    std::vector<std::vector<SignatureHit> > chunkHits(scanner.chunkCount());
+    int blockSize = device.blockSize();
+
+    scanner.run([&](int chunk, BlockNumber firstBlock, int blockCount, const BlockView &window)
+    {
+        std::vector<SignatureHit> &hits = chunkHits[chunk];
+        runMatcher(*this, window, blockSize, firstBlock, blockCount, hits, classMap);
+        return maxHits != 0 && hits.size() >= maxHits;
+    }, maxLength > 0 ? maxLength - 1 : 0);
+
+    std::vector<SignatureHit> hits;
+    for (size_t chunk = 0; chunk < chunkHits.size(); ++chunk)
+    {
+        hits.insert(hits.end(), chunkHits[chunk].begin(), chunkHits[chunk].end());
+        if (maxHits != 0 && hits.size() >= maxHits)
+        {
+            hits.resize(maxHits);
+            break;
+        }
+    }
+
+    return hits;
+}
+
+/**************************************************************************************
+ * Function: scan
+ * Description: Scans the whole device like the overload above, but hands each run's hits
+ *              to sink as soon as the run is scanned instead of collecting them, so later
+ *              stages can start on early hits while the scan is still going.
+ * Parameters:
+ *    - device: The USB device.
+ *    - sink: Called with the hits of each scanned run of blocks, in block order within
+ *            the run but in no particular order across runs.
+ *    - classes: If not null, reset to a map of the class of every block, filled in as
+ *               the scan goes.
+ *    - skipBlocks: If not null, blocks set in this map are neither read nor matched.
+ **************************************************************************************/
+void SignatureScanner::scan(const BlockDevice &device, const HitSink &sink, BlockClassMap *classes, const BlockBitmap *skipBlocks) const
+{
+    if (classes)
+    {
+        *classes = BlockClassMap(device.blockCount());
+    }
+
+    ParallelScanner scanner(device);
+    scanner.skipBlocks(skipBlocks);
+    int blockSize = device.blockSize();
+
+    scanner.run([&](int, BlockNumber firstBlock, int blockCount, const BlockView &window)
+    {
+        std::vector<SignatureHit> hits;
+        runMatcher(*this, window, blockSize, firstBlock, blockCount, hits, classes);
+        if (!hits.empty())
+        {
+            sink(hits);
+        }
+        return false;
+    }, maxLength > 0 ? maxLength - 1 : 0);
+}
@@ -0,0 +1,49 @@
+#ifndef SIGNATURESCANNER_H
+#define SIGNATURESCANNER_H
+
+#include <functional>
+#include <vector>
+
+#include "BlockDevice.h"
+#include "FileFormat.h"
+
+class BlockBitmap;
+class BlockClassMap;
+
+struct SignatureHit
+{
+    BlockNumber blockNumber;
+    int signatureIndex;
+};
+
+class SignatureScanner
+{
+public:
+    // Receives the hits of one scanned run of blocks, possibly from several threads at once
+    typedef std::function<void(const std::vector<SignatureHit> &hits)> HitSink;
+
+    explicit SignatureScanner(const std::vector<FileFormat> &formats);
+
+    void match(const char *block, int length, BlockNumber blockNumber, std::vector<SignatureHit> &hits) const;
+    std::vector<SignatureHit> scan(const BlockDevice &device, size_t maxHits = 0, BlockClassMap *classes = 0, const BlockBitmap *skipBlocks = 0) const;
+    void scan(const BlockDevice &device, const HitSink &sink, BlockClassMap *classes = 0, const BlockBitmap *skipBlocks = 0) const;
+
+    size_t signatureCount() const { return formats.size(); }
+    FileFormat format(int index) const { return formats[index]; }
+
+private:
+    // Matches the start of each block in a run, appending hits and classifying the blocks
+    typedef void (*RunMatcher)(const SignatureScanner &scanner, const BlockView &window, int blockSize, BlockNumber firstBlock,
+                               int blockCount, std::vector<SignatureHit> &hits, BlockClassMap *classes);
+
+    template <class Set>
+    static void matchRun(const SignatureScanner &scanner, const BlockView &window, int blockSize, BlockNumber firstBlock, int blockCount,
+                         std::vector<SignatureHit> &hits, BlockClassMap *classes);
+
+    std::vector<FileFormat> formats;
+    int slotOf[FormatCount]; // a format's position in formats, or -1
+    size_t maxLength;
+    RunMatcher runMatcher;
+};
+
+#endif // SIGNATURESCANNER_H
@@ -0,0 +1,569 @@
+#include "StreamCarver.h"
+#include "BlockRecovery.h"
+#include "Ext2FileSystem.h"
+#include "IndirectIndex.h"
+#include "RecoveryStatus.h"
+#include "RunStats.h"
+#include "ZeroDetect.h"
+#include "FormatCarver.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+
+// Number of i_block entries that point straight at data
+static const int directBlockCount = 12;
+
+// Block size assumed when the stream does not start with an ext2/ext3 superblock
+static const int defaultBlockSize = 4096;
+
+// Largest read issued on the input
+static const size_t readChunkSize = 1 << 20;
+
+// Number of pointer blocks remembered after they leave the window
+static const size_t recordLimit = 1 << 20;
+
+// Number of output files carved at the same time
+static const size_t maxOpenFiles = 256;
+
+/**************************************************************************************
+ * Function: StreamCarver
+ * Description: Sets up a carver for a forward-only input.
+ * Parameters:
+ *    - in_fd: The input, e.g. STDIN_FILENO. It is only ever read forward.
+ *    - formats: The file formats to carve.
+ *    - outputDirectory: The directory the files are written to, named <block><extension>
+ *                       with the extension of each file's format.
+ *    - windowMiB: How much of the most recent input is kept for blocks that are only
+ *                 known to be needed after they have streamed past.
+ **************************************************************************************/
+StreamCarver::StreamCarver(int in_fd, const std::vector<FileFormat> &formats, const std::string &outputDirectory, size_t windowMiB)
+    : in_fd(in_fd), scanner(formats), outputDirectory(outputDirectory), windowBytes(windowMiB << 20), blockSize(0), deviceBlocks(0), windowBlocks(0), received(0), current(0), candidates(0), recovered(0),
+      progressLog(0), errorLog(0), quiet(0)
+{
+}
+
+// Files still open here were cut short by an error; what was written of them is kept
+StreamCarver::~StreamCarver()
+{
+    for (std::map<BlockNumber, Job>::iterator it = jobs.begin(); it != jobs.end(); ++it)
+    {
+        close(it->second.fd);
+    }
+}
+
+/**************************************************************************************
+ * Function: run
+ * Description: Reads the input to its end, carving files as their blocks arrive. The
+ *              block size comes from the superblock when the input starts with an
+ *              ext2/ext3 file system. Files still waiting for blocks at the end of the
+ *              input are written with what arrived.
+ **************************************************************************************/
+void StreamCarver::run()
+{
+    std::vector<char> head(Ext2FileSystem::superblockOffset + Ext2FileSystem::superblockSize);
+    size_t headBytes = 0;
+    while (headBytes < head.size())
+    {
+        ssize_t bytesRead = readInput(&head[headBytes], head.size() - headBytes, headBytes);
+        if (bytesRead == 0)
+        {
+            break;
+        }
+        headBytes += bytesRead;
+    }
+
+    uint32_t fsBlocks;
+    if (headBytes == head.size() && Ext2FileSystem::parseGeometry(&head[Ext2FileSystem::superblockOffset], blockSize, fsBlocks))
+    {
+        deviceBlocks = fsBlocks;
+        progress() << "ext2/ext3 file system in stream: " << blockSize << "-byte blocks, " << fsBlocks << " blocks\n\n";
+    }
+    else
+    {
+        blockSize = defaultBlockSize;
+        deviceBlocks = static_cast<BlockNumber>(1) << 32;
+        progress() << "No ext2/ext3 superblock at the start of the stream, assuming " << blockSize << "-byte blocks\n\n";
+    }
+
+    windowBlocks = std::max<BlockNumber>(windowBytes / blockSize, 2 * directBlockCount);
+    ring.assign(static_cast<size_t>(windowBlocks) * blockSize, 0);
+    memcpy(&ring[0], &head[0], headBytes);
+    received = headBytes;
+
+    for (;;)
+    {
+        for (; static_cast<uint64_t>(current + 1) * blockSize <= received; ++current)
+        {
+            processBlock(current, &ring[static_cast<size_t>(current % windowBlocks) * blockSize]);
+        }
+
+        // Reads stop at the end of the ring, so a block never wraps around it
+        size_t ringOffset = received % ring.size();
+        ssize_t bytesRead = readInput(&ring[ringOffset], std::min(readChunkSize, ring.size() - ringOffset), received);
+        if (bytesRead == 0)
+        {
+            break;
+        }
+        received += bytesRead;
+    }
+
+    // A partial last block is padded with zeros
+    if (received > static_cast<uint64_t>(current) * blockSize)
+    {
+        char *slot = &ring[static_cast<size_t>(current % windowBlocks) * blockSize];
+        size_t partial = received - static_cast<uint64_t>(current) * blockSize;
+        memset(slot + partial, 0, blockSize - partial);
+        processBlock(current, slot);
+        ++current;
+    }
+
+    while (!jobs.empty())
+    {
+        finish(jobs.begin()->first);
+    }
+}
+
+// Reads whatever the input has, up to length bytes; returns 0 at its end
+ssize_t StreamCarver::readInput(char *buffer, size_t length, uint64_t offset)
+{
+    for (;;)
+    {
+        ssize_t bytesRead;
+        {
+            RunStats::PhaseTimer timer(RunStats::Scan);
+            bytesRead = read(in_fd, buffer, length);
+        }
+        if (bytesRead == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (bytesRead == -1)
+        {
+            throw RecoveryError(RecoveryStatus::DeviceError, "Failed to read from the input stream.");
+        }
+        RunStats::countRead(offset, bytesRead, 1);
+        return bytesRead;
+    }
+}
+
+/**************************************************************************************
+ * Function: processBlock
+ * Description: Handles the next block of the input: records it if it looks like a
+ *              pointer block, hands it to every file waiting for it, and starts a new
+ *              file if it begins with the signature.
+ * Parameters:
+ *    - block: The block number, counted from the start of the input.
+ *    - data: The block's contents.
+ **************************************************************************************/
+void StreamCarver::processBlock(BlockNumber block, const char *data)
+{
+    // Record pointer blocks first, so everything resolved below can already use this one
+    ExtentList pointers;
+    bool pointerBlock = block <= UINT32_MAX && IndirectIndex::looksLikeIndirect(data, blockSize, deviceBlocks);
+    if (pointerBlock)
+    {
+        BlockView view(data, blockSize);
+        int used = firstZeroPointer(data, view.pointerCount());
+        for (int i = 0; i < used; ++i)
+        {
+            pointers.append(view.pointer(i));
+        }
+        record(block, pointers);
+    }
+
+    std::vector<Placement> arrived;
+    std::pair<std::unordered_multimap<BlockNumber, Placement>::iterator, std::unordered_multimap<BlockNumber, Placement>::iterator> range =
+        pending.equal_range(block);
+    for (; range.first != range.second; ++range.first)
+    {
+        arrived.push_back(range.first->second);
+    }
+    pending.erase(block);
+
+    for (size_t i = 0; i < arrived.size(); ++i)
+    {
+        const Placement &placement = arrived[i];
+        if (jobs.find(placement.job) == jobs.end())
+        {
+            continue;
+        }
+
+        --jobs[placement.job].pending;
+        if (placement.level == 0)
+        {
+            writeBlock(placement.job, placement.logical, data);
+        }
+        else if (pointerBlock)
+        {
+            expand(placement.job, block, placement.level, placement.logical, pointers);
+        }
+        settle(placement.job);
+    }
+
+    // A file whose direct blocks are followed by this indirect block
+    if (pointerBlock)
+    {
+        std::unordered_map<BlockNumber, BlockNumber>::iterator waiting = awaitingIndirect.find(pointers.firstBlock());
+        if (waiting != awaitingIndirect.end())
+        {
+            BlockNumber jobStart = waiting->second;
+            awaitingIndirect.erase(waiting);
+            deadlines.erase(std::make_pair(jobStart + directBlockCount + windowBlocks, jobStart));
+            jobs[jobStart].state = Mapped;
+            need(jobStart, block, 1, directBlockCount);
+            settle(jobStart);
+        }
+    }
+
+    std::vector<BlockNumber> continued;
+    std::pair<std::unordered_multimap<BlockNumber, BlockNumber>::iterator, std::unordered_multimap<BlockNumber, BlockNumber>::iterator> next =
+        directNext.equal_range(block);
+    for (; next.first != next.second; ++next.first)
+    {
+        continued.push_back(next.first->second);
+    }
+    directNext.erase(block);
+    for (size_t i = 0; i < continued.size(); ++i)
+    {
+        advanceDirect(continued[i], block, data);
+    }
+
+    std::vector<SignatureHit> hits;
+    scanner.match(data, blockSize, block, hits);
+    if (!hits.empty())
+    {
+        startJob(block, scanner.format(hits[0].signatureIndex), data);
+    }
+
+    // Files whose indirect block never came end in their direct blocks
+    while (!deadlines.empty() && deadlines.begin()->first < block)
+    {
+        finish(deadlines.begin()->second);
+    }
+}
+
+/**************************************************************************************
+ * Function: startJob
+ * Description: Opens the output file of a new candidate and writes its first block.
+ * Parameters:
+ *    - block: The candidate's first block.
+ *    - format: The format whose signature the block starts with.
+ *    - data: The block's contents.
+ **************************************************************************************/
+void StreamCarver::startJob(BlockNumber block, FileFormat format, const char *data)
+{
+    ++candidates;
+    if (jobs.size() >= maxOpenFiles)
+    {
+        errors() << "Skipping candidate at block " << block << ": " << maxOpenFiles << " files are already being carved\n";
+        return;
+    }
+
+    std::string path = outputDirectory + "/" + std::to_string(block) + formatTable[format].extension;
+    int out_fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    if (out_fd == -1)
+    {
+        errors() << "Failed to open output file " << path << "\n";
+        return;
+    }
+
+    Job job = {path, out_fd, format, Direct, 0, 0, 0, 0};
+    jobs[block] = job;
+    advanceDirect(block, block, data);
+}
+
+// Takes the next block of a file's direct run; an empty or pointer block ends the run
+// early, as in BlockRecovery::findDirectBlocks
+void StreamCarver::advanceDirect(BlockNumber jobStart, BlockNumber block, const char *data)
+{
+    Job &job = jobs[jobStart];
+    if (BlockRecovery::endsDirectRun(data, blockSize, blockSize, deviceBlocks))
+    {
+        job.state = Mapped;
+        settle(jobStart);
+        return;
+    }
+
+    writeBlock(jobStart, job.directBlocks, data);
+    if (++job.directBlocks == directBlockCount)
+    {
+        awaitIndirect(jobStart);
+    }
+    else
+    {
+        directNext.insert(std::make_pair(block + 1, jobStart));
+    }
+}
+
+/**************************************************************************************
+ * Function: awaitIndirect
+ * Description: Looks for the indirect block whose first pointer follows a file's direct
+ *              blocks, among the pointer blocks already seen. If it has not arrived yet,
+ *              the file waits for it for one window's worth of input.
+ * Parameters:
+ *    - jobStart: The file's first block.
+ **************************************************************************************/
+void StreamCarver::awaitIndirect(BlockNumber jobStart)
+{
+    Job &job = jobs[jobStart];
+    BlockNumber target = jobStart + directBlockCount;
+
+    std::unordered_map<BlockNumber, BlockNumber>::const_iterator found = byFirstPointer.find(target);
+    if (found != byFirstPointer.end())
+    {
+        job.state = Mapped;
+        need(jobStart, found->second, 1, directBlockCount);
+        settle(jobStart);
+        return;
+    }
+
+    job.state = AwaitIndirect;
+    awaitingIndirect[target] = jobStart;
+    deadlines.insert(std::make_pair(target + windowBlocks, jobStart));
+}
+
+/**************************************************************************************
+ * Function: need
+ * Description: Places a block in a file. A block still to come is waited for; one that
+ *              has streamed past is taken from the window or, for pointer blocks, from
+ *              the record. A data block no longer in the window is counted as missing
+ *              and left as a hole in the output.
+ * Parameters:
+ *    - jobStart: The file's first block.
+ *    - block: The block to place.
+ *    - level: 0 for a data block, 1 to 3 for an indirect to triple indirect block.
+ *    - logical: The file's first logical block at or below this one.
+ **************************************************************************************/
+void StreamCarver::need(BlockNumber jobStart, BlockNumber block, int level, uint64_t logical)
+{
+    Job &job = jobs[jobStart];
+    if (block > current)
+    {
+        Placement placement = {jobStart, level, logical};
+        pending.insert(std::make_pair(block, placement));
+        ++job.pending;
+        return;
+    }
+
+    if (level == 0)
+    {
+        const char *data = windowBlock(block);
+        if (data)
+        {
+            writeBlock(jobStart, logical, data);
+        }
+        else
+        {
+            ++job.missing;
+            job.blockTotal = std::max(job.blockTotal, logical + 1);
+        }
+        return;
+    }
+
+    // Every pointer block seen is recorded, so one that is not is where the file ends
+    std::unordered_map<BlockNumber, ExtentList>::const_iterator found = pointerBlocks.find(block);
+    if (found != pointerBlocks.end())
+    {
+        expand(jobStart, block, level, logical, found->second);
+    }
+}
+
+/**************************************************************************************
+ * Function: expand
+ * Description: Places the blocks a pointer block points to, then follows the same
+ *              contiguity heuristic as the recovery program: a full indirect block is
+ *              followed by the double indirect block, and a full double indirect block
+ *              by the triple indirect block right after its last data block.
+ * Parameters:
+ *    - jobStart: The file's first block.
+ *    - block: The pointer block.
+ *    - level: 1 to 3 for an indirect to triple indirect block.
+ *    - logical: The file's first logical block below this pointer block.
+ *    - pointers: The pointers in the block, up to the first unused one.
+ **************************************************************************************/
+void StreamCarver::expand(BlockNumber jobStart, BlockNumber block, int level, uint64_t logical, const ExtentList &pointers)
+{
+    uint64_t pointersPerBlock = blockSize / sizeof(uint32_t);
+    uint64_t blocksPerPointer = 1;
+    for (int i = 1; i < level; ++i)
+    {
+        blocksPerPointer *= pointersPerBlock;
+    }
+
+    uint64_t index = 0;
+    for (ExtentList::const_iterator it = pointers.begin(); it != pointers.end(); ++it)
+    {
+        for (BlockNumber pointer = it->start; pointer < it->start + it->length; ++pointer, ++index)
+        {
+            need(jobStart, pointer, level - 1, logical + index * blocksPerPointer);
+        }
+    }
+
+    uint64_t doubleStart = directBlockCount + pointersPerBlock;
+    if (level == 1 && logical == directBlockCount && pointers.blockCount() == pointersPerBlock)
+    {
+        need(jobStart, block + 1, 2, doubleStart);
+    }
+    else if (level == 1 && logical == doubleStart + (pointersPerBlock - 1) * pointersPerBlock)
+    {
+        need(jobStart, pointers.lastBlock() + 1, 3, doubleStart + pointersPerBlock * pointersPerBlock);
+    }
+}
+
+// Writes a data block at its logical offset in the file's output
+void StreamCarver::writeBlock(BlockNumber jobStart, uint64_t logical, const char *data)
+{
+    Job &job = jobs[jobStart];
+    RunStats::PhaseTimer timer(RunStats::Copy);
+    off_t offset = static_cast<off_t>(logical) * blockSize;
+    for (ssize_t done = 0; done < blockSize;)
+    {
+        ssize_t bytesWritten = pwrite(job.fd, data + done, blockSize - done, offset + done);
+        if (bytesWritten == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (bytesWritten == -1)
+        {
+            throw RecoveryError(RecoveryStatus::OutputError, "Failed to write block to output file.");
+        }
+        RunStats::countWrite(bytesWritten, 1);
+        done += bytesWritten;
+    }
+    job.blockTotal = std::max(job.blockTotal, logical + 1);
+}
+
+// Finishes a file once its block map is known and nothing it needs is still to come
+void StreamCarver::settle(BlockNumber jobStart)
+{
+    const Job &job = jobs[jobStart];
+    if (job.state == Mapped && job.pending == 0)
+    {
+        finish(jobStart);
+    }
+}
+
+/**************************************************************************************
+ * Function: finish
+ * Description: Sets a file's final size, closes it and reports it. Blocks it was still
+ *              waiting for are counted as missing.
+ * Parameters:
+ *    - jobStart: The file's first block.
+ **************************************************************************************/
+void StreamCarver::finish(BlockNumber jobStart)
+{
+    std::map<BlockNumber, Job>::iterator it = jobs.find(jobStart);
+    Job &job = it->second;
+
+    if (job.state == Direct)
+    {
+        std::pair<std::unordered_multimap<BlockNumber, BlockNumber>::iterator, std::unordered_multimap<BlockNumber, BlockNumber>::iterator> next =
+            directNext.equal_range(jobStart + job.directBlocks);
+        for (; next.first != next.second; ++next.first)
+        {
+            if (next.first->second == jobStart)
+            {
+                directNext.erase(next.first);
+                break;
+            }
+        }
+    }
+    else if (job.state == AwaitIndirect)
+    {
+        awaitingIndirect.erase(jobStart + directBlockCount);
+        deadlines.erase(std::make_pair(jobStart + directBlockCount + windowBlocks, jobStart));
+    }
+    job.missing += job.pending;
+
+    RunStats::PhaseTimer timer(RunStats::Finalize);
+    std::string endSummary;
+    off_t fileSize = finalSize(job, endSummary);
+    RunStats::count(RunStats::Syscalls);
+    if (ftruncate(job.fd, fileSize) != 0)
+    {
+        throw RecoveryError(RecoveryStatus::OutputError, "Failed to set file size on output file.");
+    }
+    close(job.fd);
+
+    if (job.missing == 0 || !endSummary.empty())
+    {
+        ++recovered;
+        progress() << "Recovered " << job.path << " (" << job.blockTotal << " blocks"
+                  << (endSummary.empty() ? std::string(")") : ", end found: " + endSummary + ")") << "\n";
+    }
+    else
+    {
+        errors() << "Recovered " << job.path << " with " << job.missing << " of " << job.blockTotal
+                  << " blocks missing; they streamed past before the file's pointer blocks\n";
+    }
+    jobs.erase(it);
+}
+
+// The file's format gives its exact size when its end is found; anything else is cut
+// after the last non-zero byte of its last block
+off_t StreamCarver::finalSize(const Job &job, std::string &endSummary) const
+{
+    off_t length = static_cast<off_t>(job.blockTotal) * blockSize;
+    std::vector<char> buffer(std::max<size_t>(readChunkSize, blockSize));
+
+    std::unique_ptr<EndDetector> end = makeEndDetector(job.format);
+    for (off_t offset = 0; offset < length && !end->complete();)
+    {
+        RunStats::count(RunStats::Syscalls);
+        ssize_t bytesRead = pread(job.fd, &buffer[0], std::min<off_t>(buffer.size(), length - offset), offset);
+        if (bytesRead <= 0)
+        {
+            break;
+        }
+        end->feed(&buffer[0], bytesRead);
+        offset += bytesRead;
+    }
+    if (end->complete())
+    {
+        endSummary = end->summary();
+        return end->fileSize();
+    }
+
+    if (job.blockTotal == 0)
+    {
+        return 0;
+    }
+    RunStats::count(RunStats::Syscalls);
+    ssize_t bytesRead = pread(job.fd, &buffer[0], blockSize, length - blockSize);
+    return length - blockSize + (bytesRead > 0 ? lastNonZeroOffset(&buffer[0], bytesRead) + 1 : 0);
+}
+
+// Remembers a pointer block, forgetting the oldest once recordLimit are held
+void StreamCarver::record(BlockNumber block, const ExtentList &pointers)
+{
+    pointerBlocks[block] = pointers;
+    byFirstPointer[pointers.firstBlock()] = block;
+    recordOrder.push_back(block);
+
+    if (recordOrder.size() > recordLimit)
+    {
+        BlockNumber oldest = recordOrder.front();
+        recordOrder.pop_front();
+        std::unordered_map<BlockNumber, ExtentList>::iterator found = pointerBlocks.find(oldest);
+        std::unordered_map<BlockNumber, BlockNumber>::iterator first = byFirstPointer.find(found->second.firstBlock());
+        if (first != byFirstPointer.end() && first->second == oldest)
+        {
+            byFirstPointer.erase(first);
+        }
+        pointerBlocks.erase(found);
+    }
+}
+
+// Returns a block that has streamed past if it is still in the window, otherwise null
+const char *StreamCarver::windowBlock(BlockNumber block) const
+{
+    BlockNumber oldest = static_cast<BlockNumber>((received + blockSize - 1) / blockSize) - windowBlocks;
+    if (block > current || block < oldest)
+    {
+        return 0;
+    }
+    return &ring[static_cast<size_t>(block % windowBlocks) * blockSize];
+}
@@ -0,0 +1,116 @@
+#ifndef STREAMCARVER_H
+#define STREAMCARVER_H
+
+#include <deque>
+#include <map>
+#include <ostream>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include <stdint.h>
+#include "BlockDevice.h"
+#include "ExtentList.h"
+#include "FileFormat.h"
+#include "SignatureScanner.h"
+
+// Carves every candidate file out of a forward-only input such as a pipe from dd, ssh
+// or a decompressor, in one pass and without seeking. The last window of blocks is
+// kept in a ring buffer, and every block that looks like an indirect block is recorded
+// by its pointers, so a file can still be resolved when its pointer blocks stream past
+// before the file is known to need them. Blocks are written to each output file at
+// their logical offset as they arrive.
+class StreamCarver
+{
+public:
+    StreamCarver(int in_fd, const std::vector<FileFormat> &formats, const std::string &outputDirectory, size_t windowMiB = 64);
+    ~StreamCarver();
+
+    void logTo(std::ostream *progress, std::ostream *errors) { progressLog = progress; errorLog = errors; }
+    void run();
+
+    int candidateCount() const { return candidates; }
+    int recoveredCount() const { return recovered; }
+
+private:
+    enum JobState
+    {
+        Direct,        // the direct blocks are still streaming in
+        AwaitIndirect, // all 12 direct blocks were seen, the indirect block was not yet
+        Mapped         // the block map is known; only pending blocks remain
+    };
+
+    // A file being carved
+    struct Job
+    {
+        std::string path;
+        int fd;
+        FileFormat format;
+        JobState state;
+        int directBlocks;
+        uint64_t blockTotal; // highest logical block written so far, plus one
+        int pending;         // data and pointer blocks the file waits for
+        uint64_t missing;    // blocks that left the window before the file knew it needed them
+    };
+
+    // Where a block belongs: the file (by start block), its level (0 for data, 1 to 3
+    // for indirect to triple indirect) and the file's first logical block below it
+    struct Placement
+    {
+        BlockNumber job;
+        int level;
+        uint64_t logical;
+    };
+
+    ssize_t readInput(char *buffer, size_t length, uint64_t offset);
+    void processBlock(BlockNumber block, const char *data);
+
+    void startJob(BlockNumber block, FileFormat format, const char *data);
+    void advanceDirect(BlockNumber jobStart, BlockNumber block, const char *data);
+    void awaitIndirect(BlockNumber jobStart);
+    void need(BlockNumber jobStart, BlockNumber block, int level, uint64_t logical);
+    void expand(BlockNumber jobStart, BlockNumber block, int level, uint64_t logical, const ExtentList &pointers);
+    void writeBlock(BlockNumber jobStart, uint64_t logical, const char *data);
+    void settle(BlockNumber jobStart);
+    void finish(BlockNumber jobStart);
+    off_t finalSize(const Job &job, std::string &endSummary) const;
+
+    std::ostream &progress() { return progressLog ? *progressLog : quiet; }
+    std::ostream &errors() { return errorLog ? *errorLog : quiet; }
+
+    void record(BlockNumber block, const ExtentList &pointers);
+    const char *windowBlock(BlockNumber block) const;
+
+    int in_fd;
+    SignatureScanner scanner;
+    std::string outputDirectory;
+    size_t windowBytes;
+
+    int blockSize;
+    BlockNumber deviceBlocks;
+    BlockNumber windowBlocks;
+    std::vector<char> ring;
+    uint64_t received;
+    BlockNumber current;
+
+    std::map<BlockNumber, Job> jobs;
+    std::unordered_multimap<BlockNumber, BlockNumber> directNext; // next direct block -> file
+    std::unordered_map<BlockNumber, BlockNumber> awaitingIndirect; // first pointer -> file
+    std::set<std::pair<BlockNumber, BlockNumber> > deadlines;      // (give up after, file)
+    std::unordered_multimap<BlockNumber, Placement> pending;
+
+    // Pointer blocks seen so far, oldest first in recordOrder, bounded by recordLimit
+    std::unordered_map<BlockNumber, ExtentList> pointerBlocks;
+    std::unordered_map<BlockNumber, BlockNumber> byFirstPointer;
+    std::deque<BlockNumber> recordOrder;
+
+    int candidates;
+    int recovered;
+
+    std::ostream *progressLog; // receives what the input holds and each recovered file; null for none
+    std::ostream *errorLog;    // receives skipped candidates and incomplete files; null for none
+    std::ostream quiet;        // discards output that has no log
+};
+
+#endif // STREAMCARVER_H
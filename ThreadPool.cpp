@@ -0,0 +1,152 @@
+#include "ThreadPool.h"
+#include <algorithm>
+#include <atomic>
+#include <exception>
+
+// The tasks of one run() call. Tasks are claimed by index, so workers that pick the job
+// up late find nothing left and move on.
+struct ThreadPool::Job
+{
+    Job(int taskCount, const Task &task) : task(task), taskCount(taskCount), next(0), finished(0) {}
+
+    const Task &task;
+    int taskCount;
+    std::atomic<int> next;
+
+    std::mutex lock;
+    std::condition_variable done;
+    int finished;
+    std::exception_ptr error;
+};
+
+/**************************************************************************************
+ * Function: ThreadPool
+ * Description: Starts the worker threads.
+ * Parameters:
+ *    - threadCount: The number of workers; 0 runs every task on the calling thread.
+ **************************************************************************************/
+ThreadPool::ThreadPool(int threadCount)
+    : stopping(false)
+{
+    for (int i = 0; i < threadCount; ++i)
+    {
+        threads.push_back(std::thread(&ThreadPool::work, this));
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> guard(mutex);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (size_t i = 0; i < threads.size(); ++i)
+    {
+        threads[i].join();
+    }
+}
+
+/**************************************************************************************
+ * Function: run
+ * Description: Runs task(0) to task(taskCount - 1) and waits for all of them. If tasks
+ *              throw, the rest still run and the first exception is rethrown here.
+ * Parameters:
+ *    - taskCount: The number of tasks.
+ *    - task: Called once per task index, possibly from several threads at once.
+ **************************************************************************************/
+void ThreadPool::run(int taskCount, const Task &task)
+{
+    if (taskCount <= 0)
+    {
+        return;
+    }
+
+    std::shared_ptr<Job> job = std::make_shared<Job>(taskCount, task);
+    if (taskCount > 1 && !threads.empty())
+    {
+        {
+            std::lock_guard<std::mutex> guard(mutex);
+            jobs.push_back(job);
+        }
+        wake.notify_all();
+    }
+
+    runTasks(*job);
+
+    {
+        std::unique_lock<std::mutex> guard(job->lock);
+        job->done.wait(guard, [&job] { return job->finished == job->taskCount; });
+    }
+    {
+        std::lock_guard<std::mutex> guard(mutex);
+        std::deque<std::shared_ptr<Job> >::iterator queued = std::find(jobs.begin(), jobs.end(), job);
+        if (queued != jobs.end())
+        {
+            jobs.erase(queued);
+        }
+    }
+
+    if (job->error)
+    {
+        std::rethrow_exception(job->error);
+    }
+}
+
+// Worker loop: helps with the oldest job that still has unclaimed tasks
+void ThreadPool::work()
+{
+    for (;;)
+    {
+        std::shared_ptr<Job> job;
+        {
+            std::unique_lock<std::mutex> guard(mutex);
+            wake.wait(guard, [this] { return stopping || !jobs.empty(); });
+            if (jobs.empty())
+            {
+                return;
+            }
+
+            job = jobs.front();
+            if (job->next.load() >= job->taskCount)
+            {
+                jobs.pop_front();
+                continue;
+            }
+        }
+        runTasks(*job);
+    }
+}
+
+// Claims and runs tasks of a job until none are left
+void ThreadPool::runTasks(Job &job)
+{
+    for (int index = job.next++; index < job.taskCount; index = job.next++)
+    {
+        std::exception_ptr error;
+        try
+        {
+            job.task(index);
+        }
+        catch (...)
+        {
+            error = std::current_exception();
+        }
+
+        std::lock_guard<std::mutex> guard(job.lock);
+        if (error && !job.error)
+        {
+            job.error = error;
+        }
+        if (++job.finished == job.taskCount)
+        {
+            job.done.notify_all();
+        }
+    }
+}
+
+ThreadPool &ThreadPool::shared()
+{
+    static ThreadPool pool(std::max(1u, std::thread::hardware_concurrency()));
+    return pool;
+}
@@ -0,0 +1,46 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A fixed set of worker threads shared by every engine in the process. run() spreads
+// the tasks of one job over whichever workers are idle, and the calling thread runs
+// tasks too, so a job always finishes even while every worker is busy with another
+// engine's job.
+class ThreadPool
+{
+public:
+    typedef std::function<void(int task)> Task;
+
+    explicit ThreadPool(int threadCount);
+    ~ThreadPool();
+
+    void run(int taskCount, const Task &task);
+    int threadCount() const { return static_cast<int>(threads.size()); }
+
+    // The pool every engine in the process shares, one thread per hardware thread
+    static ThreadPool &shared();
+
+private:
+    struct Job;
+
+    ThreadPool(const ThreadPool &);
+    ThreadPool &operator=(const ThreadPool &);
+
+    void work();
+    static void runTasks(Job &job);
+
+    std::vector<std::thread> threads;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::deque<std::shared_ptr<Job> > jobs;
+    bool stopping;
+};
+
+#endif // THREADPOOL_H
@@ -0,0 +1,204 @@
+#include "ZeroDetect.h"
+#include <cstring>
+#include <stdint.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define ZERODETECT_X86 1
+#endif
+
+/**************************************************************************************
+ * Scalar kernels, used on non-x86 builds and for the ragged ends of a buffer.
+ **************************************************************************************/
+static bool isZeroScalar(const char *data, size_t length)
+{
+    size_t i = 0;
+    for (; i + sizeof(uint64_t) <= length; i += sizeof(uint64_t))
+    {
+        uint64_t word;
+        memcpy(&word, data + i, sizeof(word));
+        if (word != 0)
+        {
+            return false;
+        }
+    }
+    for (; i < length; ++i)
+    {
+        if (data[i] != 0)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+static ssize_t lastNonZeroScalar(const char *data, size_t length)
+{
+    for (ssize_t i = static_cast<ssize_t>(length) - 1; i >= 0; --i)
+    {
+        if (data[i] != 0)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static size_t firstZeroPointerScalar(const char *data, size_t pointerCount)
+{
+    for (size_t i = 0; i < pointerCount; ++i)
+    {
+        uint32_t pointer;
+        memcpy(&pointer, data + i * sizeof(uint32_t), sizeof(pointer));
+        if (pointer == 0)
+        {
+            return i;
+        }
+    }
+    return pointerCount;
+}
+
+#ifdef ZERODETECT_X86
+
+/**************************************************************************************
+ * SSE2 kernels. SSE2 is part of the x86-64 baseline, so these need no runtime check.
+ **************************************************************************************/
+static bool isZeroSse2(const char *data, size_t length)
+{
+    size_t i = 0;
+    for (; i + 64 <= length; i += 64)
+    {
+        const __m128i *p = reinterpret_cast<const __m128i *>(data + i);
+        __m128i v = _mm_or_si128(_mm_or_si128(_mm_loadu_si128(p), _mm_loadu_si128(p + 1)),
+                                 _mm_or_si128(_mm_loadu_si128(p + 2), _mm_loadu_si128(p + 3)));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128())) != 0xFFFF)
+        {
+            return false;
+        }
+    }
+    return isZeroScalar(data + i, length - i);
+}
+
+static ssize_t lastNonZeroSse2(const char *data, size_t length)
+{
+    size_t end = length;
+    for (; end >= 16; end -= 16)
+    {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + end - 16));
+        unsigned nonZero = ~_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128())) & 0xFFFF;
+        if (nonZero)
+        {
+            return end - 16 + (31 - __builtin_clz(nonZero));
+        }
+    }
+    return lastNonZeroScalar(data, end);
+}
+
+static size_t firstZeroPointerSse2(const char *data, size_t pointerCount)
+{
+    size_t i = 0;
+    for (; i + 4 <= pointerCount; i += 4)
+    {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i * sizeof(uint32_t)));
+        unsigned zero = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(v, _mm_setzero_si128())));
+        if (zero)
+        {
+            return i + __builtin_ctz(zero);
+        }
+    }
+    return i + firstZeroPointerScalar(data + i * sizeof(uint32_t), pointerCount - i);
+}
+
+/**************************************************************************************
+ * AVX2 kernels, selected at startup when the CPU supports them.
+ **************************************************************************************/
+__attribute__((target("avx2"))) static bool isZeroAvx2(const char *data, size_t length)
+{
+    size_t i = 0;
+    for (; i + 128 <= length; i += 128)
+    {
+        const __m256i *p = reinterpret_cast<const __m256i *>(data + i);
+        __m256i v = _mm256_or_si256(_mm256_or_si256(_mm256_loadu_si256(p), _mm256_loadu_si256(p + 1)),
+                                    _mm256_or_si256(_mm256_loadu_si256(p + 2), _mm256_loadu_si256(p + 3)));
+        if (!_mm256_testz_si256(v, v))
+        {
+            return false;
+        }
+    }
+    return isZeroSse2(data + i, length - i);
+}
+
+__attribute__((target("avx2"))) static ssize_t lastNonZeroAvx2(const char *data, size_t length)
+{
+    size_t end = length;
+    for (; end >= 32; end -= 32)
+    {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + end - 32));
+        unsigned nonZero = ~static_cast<unsigned>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_setzero_si256())));
+        if (nonZero)
+        {
+            return end - 32 + (31 - __builtin_clz(nonZero));
+        }
+    }
+    return lastNonZeroSse2(data, end);
+}
+
+static bool hasAvx2()
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+}
+
+static bool (*const isZeroKernel)(const char *, size_t) = hasAvx2() ? isZeroAvx2 : isZeroSse2;
+static ssize_t (*const lastNonZeroKernel)(const char *, size_t) = hasAvx2() ? lastNonZeroAvx2 : lastNonZeroSse2;
+static size_t (*const firstZeroPointerKernel)(const char *, size_t) = firstZeroPointerSse2;
+
+#else
+
+static bool (*const isZeroKernel)(const char *, size_t) = isZeroScalar;
+static ssize_t (*const lastNonZeroKernel)(const char *, size_t) = lastNonZeroScalar;
+static size_t (*const firstZeroPointerKernel)(const char *, size_t) = firstZeroPointerScalar;
+
+#endif
+
+/**************************************************************************************
+ * Function: isZeroBlock
+ * Description: Checks whether a buffer is entirely zero bytes.
+ * Parameters:
+ *    - data: The buffer to check.
+ *    - length: The number of bytes in the buffer.
+ * Returns:
+ *    - True if every byte is zero.
+ **************************************************************************************/
+bool isZeroBlock(const char *data, size_t length)
+{
+    return isZeroKernel(data, length);
+}
+
+/**************************************************************************************
+ * Function: lastNonZeroOffset
+ * Description: Finds the last non-zero byte in a buffer.
+ * Parameters:
+ *    - data: The buffer to check.
+ *    - length: The number of bytes in the buffer.
+ * Returns:
+ *    - The offset of the last non-zero byte, or -1 if the buffer is all zeros.
+ **************************************************************************************/
+ssize_t lastNonZeroOffset(const char *data, size_t length)
+{
+    return lastNonZeroKernel(data, length);
+}
+
+/**************************************************************************************
+ * Function: firstZeroPointer
+ * Description: Finds the first zero entry in an array of u32 block pointers.
+ * Parameters:
+ *    - data: The pointer array.
+ *    - pointerCount: The number of pointers in the array.
+ * Returns:
+ *    - The index of the first zero pointer, or pointerCount if there is none.
+ **************************************************************************************/
+size_t firstZeroPointer(const char *data, size_t pointerCount)
+{
+    return firstZeroPointerKernel(data, pointerCount);
+}
@@ -0,0 +1,11 @@
+#ifndef ZERODETECT_H
+#define ZERODETECT_H
+
+#include <cstddef>
+#include <sys/types.h>
+
+bool isZeroBlock(const char *data, size_t length);
+ssize_t lastNonZeroOffset(const char *data, size_t length);
+size_t firstZeroPointer(const char *data, size_t pointerCount);
+
+#endif // ZERODETECT_H
@@ -0,0 +1,227 @@
+#include "ZipStream.h"
+#include "Crc32.h"
+#include <algorithm>
+#include <cstring>
+
+static const uint32_t localHeaderSignature = 0x04034B50;
+static const size_t localHeaderSize = 30;
+static const size_t endRecordSize = 22;
+static const uint16_t dataDescriptorFlag = 0x8;
+static const uint16_t storedMethod = 0;
+
+static inline uint16_t le16(const unsigned char *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static inline uint32_t le32(const unsigned char *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | (static_cast<uint32_t>(p[3]) << 24);
+}
+
+ZipStream::ZipStream()
+    : position(0), state(Header), remaining(0), dataLength(0), checkCrc(false), crc(0), expectedCrc(0),
+      entries(0), checked(0), errors(0), endFound(false), endOffset(0)
+{
+}
+
+/**************************************************************************************
+ * Function: feed
+ * Description: Passes the next bytes of the carved file through the parser.
+ * Parameters:
+ *    - data: The next bytes of the file, in file order.
+ *    - length: The number of bytes in data.
+ * Returns:
+ *    - How many of the bytes belong to the file. This is less than length only for the
+ *      chunk holding the end of the End of Central Directory record; everything after
+ *      it is past the end of the file.
+ **************************************************************************************/
+size_t ZipStream::feed(const char *data, size_t length)
+{
+    if (!endFound)
+    {
+        findEnd(data, length);
+    }
+
+    size_t used = length;
+    if (endFound)
+    {
+        used = endOffset > position ? std::min<uint64_t>(length, endOffset - position) : 0;
+    }
+
+    walkEntries(data, used);
+    position += used;
+    return used;
+}
+
+/**************************************************************************************
+ * Function: walkEntries
+ * Description: Steps through local file headers and entry data. Stored entries with
+ *              their sizes in the header get a running CRC-32 that is checked at the end
+ *              of the entry. The walk stops at the central directory, or at an entry
+ *              whose size is only given in a trailing data descriptor.
+ * Parameters:
+ *    - data: The next bytes of the file.
+ *    - length: The number of bytes in data.
+ **************************************************************************************/
+void ZipStream::walkEntries(const char *data, size_t length)
+{
+    while (length > 0 && state != Untracked)
+    {
+        if (state == Header)
+        {
+            size_t want = localHeaderSize - header.size();
+            size_t take = std::min(want, length);
+            header.insert(header.end(), data, data + take);
+            data += take;
+            length -= take;
+
+            if (header.size() >= 4 && le32(reinterpret_cast<unsigned char *>(header.data())) != localHeaderSignature)
+            {
+                state = Untracked;
+                break;
+            }
+            if (header.size() < localHeaderSize)
+            {
+                continue;
+            }
+
+            const unsigned char *h = reinterpret_cast<unsigned char *>(header.data());
+            uint16_t flags = le16(h + 6);
+            uint16_t method = le16(h + 8);
+            expectedCrc = le32(h + 14);
+            dataLength = le32(h + 18);
+            remaining = le16(h + 26) + le16(h + 28);
+            ++entries;
+
+            // Sizes in a data descriptor (or ZIP64 extra field) are not known up front,
+            // so the next header cannot be found without decompressing
+            if ((flags & dataDescriptorFlag) || dataLength == 0xFFFFFFFF)
+            {
+                state = Untracked;
+                break;
+            }
+            checkCrc = method == storedMethod;
+            crc = 0;
+            header.clear();
+            state = Fields;
+        }
+        else if (state == Fields)
+        {
+            size_t take = std::min<uint64_t>(remaining, length);
+            data += take;
+            length -= take;
+            remaining -= take;
+            if (remaining == 0)
+            {
+                remaining = dataLength;
+                state = Data;
+            }
+        }
+        else if (state == Data)
+        {
+            size_t take = std::min<uint64_t>(remaining, length);
+            if (checkCrc)
+            {
+                crc = crc32Update(crc, data, take);
+            }
+            data += take;
+            length -= take;
+            remaining -= take;
+        }
+
+        if (state == Data && remaining == 0)
+        {
+            if (checkCrc)
+            {
+                ++checked;
+                if (crc != expectedCrc)
+                {
+                    ++errors;
+                }
+            }
+            state = Header;
+        }
+    }
+}
+
+/**************************************************************************************
+ * Function: findEnd
+ * Description: Looks for the End of Central Directory record. The last 21 bytes of each
+ *              chunk are kept so a record split across chunks is still found.
+ * Parameters:
+ *    - data: The next bytes of the file.
+ *    - length: The number of bytes in data.
+ **************************************************************************************/
+void ZipStream::findEnd(const char *data, size_t length)
+{
+    const unsigned char *bytes = reinterpret_cast<const unsigned char *>(data);
+
+    // Records starting in the carried tail, completed by the start of this chunk
+    if (!tail.empty())
+    {
+        std::vector<unsigned char> joined(tail);
+        joined.insert(joined.end(), bytes, bytes + std::min(length, endRecordSize - 1));
+        uint64_t base = position - tail.size();
+        for (size_t i = 0; i < tail.size() && i + endRecordSize <= joined.size(); ++i)
+        {
+            if (checkEnd(joined.data() + i, base + i))
+            {
+                return;
+            }
+        }
+    }
+
+    // Records entirely inside this chunk
+    for (size_t i = 0; i + endRecordSize <= length;)
+    {
+        const void *hit = memmem(data + i, length - i - (endRecordSize - 4), "PK\x05\x06", 4);
+        if (!hit)
+        {
+            break;
+        }
+        size_t at = static_cast<const char *>(hit) - data;
+        if (checkEnd(bytes + at, position + at))
+        {
+            return;
+        }
+        i = at + 1;
+    }
+
+    // Carry the bytes a record could still start in
+    std::vector<unsigned char> joined(tail);
+    joined.insert(joined.end(), bytes + length - std::min(length, endRecordSize - 1), bytes + length);
+    size_t keep = std::min(joined.size(), endRecordSize - 1);
+    tail.assign(joined.end() - keep, joined.end());
+}
+
+/**************************************************************************************
+ * Function: checkEnd
+ * Description: Accepts an End of Central Directory record only if it describes a
+ *              single-disk archive whose central directory ends right where the record
+ *              starts, which rules out stray signature bytes inside entry data.
+ * Parameters:
+ *    - record: The 22 bytes of a candidate record.
+ *    - offset: The record's offset from the start of the file.
+ * Returns:
+ *    - True if the record was accepted and the file's end is now known.
+ **************************************************************************************/
+bool ZipStream::checkEnd(const unsigned char *record, uint64_t offset)
+{
+    if (le32(record) != 0x06054B50 || le16(record + 4) != 0 || le16(record + 6) != 0 ||
+        le16(record + 8) != le16(record + 10))
+    {
+        return false;
+    }
+
+    uint64_t directorySize = le32(record + 12);
+    uint64_t directoryOffset = le32(record + 16);
+    if (directoryOffset + directorySize != offset)
+    {
+        return false;
+    }
+
+    endFound = true;
+    endOffset = offset + endRecordSize + le16(record + 20);
+    return true;
+}
@@ -0,0 +1,59 @@
+#ifndef ZIPSTREAM_H
+#define ZIPSTREAM_H
+
+#include <cstddef>
+#include <vector>
+#include <stdint.h>
+
+// Follows the structure of a carved ZIP file (.zip, .docx, .pptx, ...) as its bytes are
+// copied out. It walks the local file headers, checks the CRC-32 of stored entries, and
+// finds the End of Central Directory record, which gives the file's exact size.
+class ZipStream
+{
+public:
+    ZipStream();
+
+    size_t feed(const char *data, size_t length);
+
+    bool complete() const { return endFound && position >= endOffset; }
+    uint64_t fileSize() const { return endOffset; }
+    uint64_t bytesSeen() const { return position; }
+
+    int entryCount() const { return entries; }
+    int checkedEntries() const { return checked; }
+    int crcErrors() const { return errors; }
+
+private:
+    enum State
+    {
+        Header,
+        Fields,
+        Data,
+        Untracked
+    };
+
+    void walkEntries(const char *data, size_t length);
+    void findEnd(const char *data, size_t length);
+    bool checkEnd(const unsigned char *record, uint64_t offset);
+
+    uint64_t position;
+
+    // Local header walk
+    State state;
+    std::vector<char> header;
+    uint64_t remaining;
+    uint64_t dataLength;
+    bool checkCrc;
+    uint32_t crc;
+    uint32_t expectedCrc;
+    int entries;
+    int checked;
+    int errors;
+
+    // End of Central Directory search
+    std::vector<unsigned char> tail;
+    bool endFound;
+    uint64_t endOffset;
+};
+
+#endif // ZIPSTREAM_H
@@ -0,0 +1,960 @@
+#include <iostream>
+#include <algorithm>
+#include <fstream>
+#include <functional>
+#include <random>
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <cstring>
+#include <stdint.h>
+#include "Crc32.h"
+#include "FileFormat.h"
+
+// Writes a deterministic ext3-like image holding deleted files of every carved format,
+// plus a manifest and a copy of every original, for the recovery benchmark and as a
+// correctness check of each format's end detection.
+//
+// Each deleted file is laid out the way the recovery heuristic expects: twelve direct
+// blocks followed by a contiguous first indirect data block, the double indirect block
+// right after the indirect block, and the triple indirect block right after the last
+// data block of the double indirect tree. Every other data block may be fragmented,
+// with the gaps filled by allocated "live" data the scanner is expected to skip.
+
+static const uint16_t ext2Magic = 0xEF53;
+static const int inodeSize = 128;
+
+struct Options
+{
+    int blockSize;
+    int imageMiB;
+    double fragmentation;
+    uint32_t seed;
+    std::vector<FileFormat> formats;
+    std::vector<std::string> layouts;
+};
+
+struct PlacedFile
+{
+    FileFormat format;
+    std::string layout;
+    uint32_t startBlock;
+    size_t size;
+    std::string originalPath;
+};
+
+class Image
+{
+public:
+    Image(const Options &options);
+
+    uint32_t allocRun(int count);
+    uint32_t allocData();
+    void fillRandom(uint32_t block);
+    void putPointers(uint32_t block, const std::vector<uint32_t> &pointers);
+    void putData(uint32_t block, const std::string &data, size_t offset, bool zeroTail);
+    void liveGap(int maxBlocks);
+    bool write(const std::string &path);
+
+    int blockSize;
+    uint32_t blockCount;
+    int pointersPerBlock;
+
+private:
+    void layOutMetadata();
+    bool isFree(uint32_t block) const { return block < blockCount && !allocated[block] && !used[block]; }
+    void markAllocated(uint32_t block) { allocated[block] = true; }
+
+    std::vector<char> bytes;
+    std::vector<bool> allocated;
+    std::vector<bool> used;
+    uint32_t firstDataBlock;
+    uint32_t blocksPerGroup;
+    uint32_t inodesPerGroup;
+    uint32_t groupCount;
+    uint32_t cursor;
+    double fragmentation;
+    std::mt19937 random;
+};
+
+static void put16(char *p, uint16_t value)
+{
+    p[0] = value & 0xFF;
+    p[1] = value >> 8;
+}
+
+static void put32(char *p, uint32_t value)
+{
+    for (int i = 0; i < 4; ++i)
+    {
+        p[i] = (value >> (8 * i)) & 0xFF;
+    }
+}
+
+// Big-endian fields, as PNG, JPEG and SQLite store them
+static void putBe16(char *p, uint16_t value)
+{
+    p[0] = value >> 8;
+    p[1] = value & 0xFF;
+}
+
+static void putBe32(char *p, uint32_t value)
+{
+    for (int i = 0; i < 4; ++i)
+    {
+        p[i] = (value >> (24 - 8 * i)) & 0xFF;
+    }
+}
+
+Image::Image(const Options &options)
+    : blockSize(options.blockSize), fragmentation(options.fragmentation), random(options.seed)
+{
+    blockCount = static_cast<uint64_t>(options.imageMiB) * 1024 * 1024 / blockSize;
+    pointersPerBlock = blockSize / 4;
+    bytes.assign(static_cast<size_t>(blockCount) * blockSize, 0);
+    allocated.assign(blockCount, false);
+    used.assign(blockCount, false);
+
+    firstDataBlock = blockSize == 1024 ? 1 : 0;
+    blocksPerGroup = 8 * blockSize;
+    inodesPerGroup = blockSize / inodeSize;
+    groupCount = (blockCount - firstDataBlock + blocksPerGroup - 1) / blocksPerGroup;
+    layOutMetadata();
+}
+
+/**************************************************************************************
+ * Function: layOutMetadata
+ * Description: Writes the superblock and group descriptor table, and reserves each
+ *              group's block bitmap, inode bitmap and one-block inode table. The block
+ *              bitmaps themselves are written last, once every block is placed.
+ **************************************************************************************/
+void Image::layOutMetadata()
+{
+    char *sb = &bytes[1024];
+    put32(sb + 0, groupCount * inodesPerGroup);
+    put32(sb + 4, blockCount);
+    put32(sb + 20, firstDataBlock);
+    put32(sb + 24, blockSize == 1024 ? 0 : blockSize == 2048 ? 1 : 2);
+    put32(sb + 32, blocksPerGroup);
+    put32(sb + 40, inodesPerGroup);
+    put16(sb + 56, ext2Magic);
+    for (int i = 0; i < 16; ++i)
+    {
+        sb[104 + i] = static_cast<char>(random());
+    }
+
+    for (uint32_t block = 0; block <= firstDataBlock; ++block)
+    {
+        markAllocated(block);
+    }
+
+    uint32_t tableBlocks = (groupCount * 32 + blockSize - 1) / blockSize;
+    char *table = &bytes[static_cast<size_t>(firstDataBlock + 1) * blockSize];
+    for (uint32_t g = 0; g < groupCount; ++g)
+    {
+        uint32_t groupStart = firstDataBlock + g * blocksPerGroup;
+        uint32_t bitmap = g == 0 ? firstDataBlock + 1 + tableBlocks : groupStart;
+        put32(table + g * 32 + 0, bitmap);
+        put32(table + g * 32 + 4, bitmap + 1);
+        put32(table + g * 32 + 8, bitmap + 2);
+        for (uint32_t block = groupStart; block <= bitmap + 2; ++block)
+        {
+            markAllocated(block);
+        }
+    }
+
+    cursor = firstDataBlock + 1 + tableBlocks + 3;
+}
+
+/**************************************************************************************
+ * Function: allocRun
+ * Description: Claims the next run of free blocks, skipping group metadata.
+ * Parameters:
+ *    - count: The number of contiguous blocks wanted.
+ * Returns:
+ *    - The first block of the run. Exits if the image is full.
+ **************************************************************************************/
+uint32_t Image::allocRun(int count)
+{
+    for (;;)
+    {
+        if (cursor + count > blockCount)
+        {
+            std::cerr << "The image is too small for the requested files; raise --image-mib.\n";
+            exit(1);
+        }
+
+        int free = 0;
+        while (free < count && isFree(cursor + free))
+        {
+            ++free;
+        }
+        if (free == count)
+        {
+            break;
+        }
+        cursor += free + 1;
+    }
+
+    uint32_t start = cursor;
+    for (int i = 0; i < count; ++i)
+    {
+        used[start + i] = true;
+    }
+    cursor += count;
+    return start;
+}
+
+// Claims one data block, first leaving a gap of live data as often as fragmentation asks
+uint32_t Image::allocData()
+{
+    if (std::uniform_real_distribution<double>(0, 1)(random) < fragmentation)
+    {
+        liveGap(16);
+    }
+    return allocRun(1);
+}
+
+// Fills up to maxBlocks blocks with allocated random data belonging to other files
+void Image::liveGap(int maxBlocks)
+{
+    int count = std::uniform_int_distribution<int>(1, maxBlocks)(random);
+    for (int i = 0; i < count; ++i)
+    {
+        uint32_t block = allocRun(1);
+        fillRandom(block);
+        markAllocated(block);
+    }
+}
+
+void Image::fillRandom(uint32_t block)
+{
+    char *p = &bytes[static_cast<size_t>(block) * blockSize];
+    for (int i = 0; i < blockSize; i += 4)
+    {
+        put32(p + i, random() | 1);
+    }
+}
+
+void Image::putPointers(uint32_t block, const std::vector<uint32_t> &pointers)
+{
+    char *p = &bytes[static_cast<size_t>(block) * blockSize];
+    for (size_t i = 0; i < pointers.size(); ++i)
+    {
+        put32(p + i * 4, pointers[i]);
+    }
+}
+
+// Copies the next block of a file; the tail of the last block is left as stale junk,
+// or zeroed as the kernel does for the rest of a page past the end of a file
+void Image::putData(uint32_t block, const std::string &data, size_t offset, bool zeroTail)
+{
+    if (zeroTail)
+    {
+        memset(&bytes[static_cast<size_t>(block) * blockSize], 0, blockSize);
+    }
+    else
+    {
+        fillRandom(block);
+    }
+    size_t length = std::min<size_t>(blockSize, data.size() - offset);
+    memcpy(&bytes[static_cast<size_t>(block) * blockSize], data.data() + offset, length);
+}
+
+/**************************************************************************************
+ * Function: write
+ * Description: Writes every group's block bitmap and then the whole image.
+ * Parameters:
+ *    - path: The image file.
+ * Returns:
+ *    - True if the image was written.
+ **************************************************************************************/
+bool Image::write(const std::string &path)
+{
+    const char *table = &bytes[static_cast<size_t>(firstDataBlock + 1) * blockSize];
+    for (uint32_t g = 0; g < groupCount; ++g)
+    {
+        uint32_t bitmap = static_cast<unsigned char>(table[g * 32]) | (static_cast<unsigned char>(table[g * 32 + 1]) << 8) |
+                          (static_cast<unsigned char>(table[g * 32 + 2]) << 16) | (static_cast<uint32_t>(static_cast<unsigned char>(table[g * 32 + 3])) << 24);
+        char *bits = &bytes[static_cast<size_t>(bitmap) * blockSize];
+        uint32_t groupStart = firstDataBlock + g * blocksPerGroup;
+        for (uint32_t i = 0; i < blocksPerGroup; ++i)
+        {
+            // Blocks past the end of the device are marked in use, as mke2fs does
+            if (groupStart + i >= blockCount || allocated[groupStart + i])
+            {
+                bits[i / 8] |= 1 << (i % 8);
+            }
+        }
+    }
+
+    std::ofstream out(path.c_str(), std::ios::binary | std::ios::trunc);
+    out.write(bytes.data(), bytes.size());
+    return out.good();
+}
+
+static std::string randomBytes(size_t length, std::mt19937 &random)
+{
+    std::string data(length, 0);
+    for (size_t i = 0; i < length; ++i)
+    {
+        data[i] = static_cast<char>(random());
+    }
+    return data;
+}
+
+/**************************************************************************************
+ * Function: makeZip
+ * Description: Builds a ZIP file of stored entries of random data.
+ * Parameters:
+ *    - size: The approximate size wanted, in bytes.
+ *    - random: The generator to draw entry sizes and contents from.
+ * Returns:
+ *    - The ZIP file.
+ **************************************************************************************/
+static std::string makeZip(size_t size, std::mt19937 &random)
+{
+    std::string zip;
+    std::string directory;
+    int entries = 0;
+
+    while (zip.size() + directory.size() + 22 < size || entries == 0)
+    {
+        size_t used = zip.size() + directory.size() + 200;
+        size_t remaining = size > used ? size - used : 1;
+        size_t length = std::min<size_t>(remaining, std::uniform_int_distribution<size_t>(1, 1 << 20)(random));
+        std::string name = "entry" + std::to_string(entries) + ".bin";
+
+        std::string data = randomBytes(length, random);
+        uint32_t crc = crc32Update(0, data.data(), data.size());
+
+        char header[30] = {};
+        put32(header + 0, 0x04034B50);
+        put16(header + 4, 10);
+        put32(header + 14, crc);
+        put32(header + 18, length);
+        put32(header + 22, length);
+        put16(header + 26, name.size());
+
+        char central[46] = {};
+        put32(central + 0, 0x02014B50);
+        put16(central + 4, 10);
+        put16(central + 6, 10);
+        put32(central + 16, crc);
+        put32(central + 20, length);
+        put32(central + 24, length);
+        put16(central + 28, name.size());
+        put32(central + 42, zip.size());
+
+        zip.append(header, sizeof(header)).append(name).append(data);
+        directory.append(central, sizeof(central)).append(name);
+        ++entries;
+    }
+
+    char end[22] = {};
+    put32(end + 0, 0x06054B50);
+    put16(end + 8, entries);
+    put16(end + 10, entries);
+    put32(end + 12, directory.size());
+    put32(end + 16, zip.size());
+    return zip + directory + std::string(end, sizeof(end));
+}
+
+/**************************************************************************************
+ * Function: makePdf
+ * Description: Builds a PDF of two revisions, each with a stream of random data, so the
+ *              second revision is an incremental update after the first %%EOF.
+ * Parameters:
+ *    - size: The approximate size wanted, in bytes.
+ *    - random: The generator to draw the stream contents from.
+ * Returns:
+ *    - The PDF file.
+ **************************************************************************************/
+static std::string makePdf(size_t size, std::mt19937 &random)
+{
+    std::string pdf = "%PDF-1.4\n%\xE2\xE3\xCF\xD3\n";
+    for (int revision = 1; revision <= 2; ++revision)
+    {
+        // The first stream takes half of what is left and the second the rest, less room
+        // for the objects around them
+        size_t room = size > pdf.size() + 240 ? size - pdf.size() - 120 : 120;
+        std::string stream = randomBytes(revision == 1 ? room / 2 : room, random);
+        std::replace(stream.begin(), stream.end(), '%', '#');
+
+        pdf += std::to_string(revision) + " 0 obj\n<< /Length " + std::to_string(stream.size()) + " >>\nstream\n";
+        pdf += stream + "\nendstream\nendobj\n";
+        pdf += "trailer\n<< /Size " + std::to_string(revision + 1) + " /Root 1 0 R >>\nstartxref\n0\n%%EOF\n";
+    }
+    return pdf;
+}
+
+// Appends a JPEG marker segment; length counts itself but not the marker
+static void appendSegment(std::string &jpeg, unsigned char marker, const std::string &body)
+{
+    char header[4] = {static_cast<char>(0xFF), static_cast<char>(marker)};
+    putBe16(header + 2, body.size() + 2);
+    jpeg.append(header, sizeof(header)).append(body);
+}
+
+/**************************************************************************************
+ * Function: makeJpeg
+ * Description: Builds a baseline JPEG with an Exif thumbnail, which has its own End Of
+ *              Image marker, and two scans of random entropy-coded data, with 0xFF
+ *              bytes stuffed and restart markers every so often.
+ * Parameters:
+ *    - size: The approximate size wanted, in bytes.
+ *    - random: The generator to draw the entropy-coded data from.
+ * Returns:
+ *    - The JPEG file.
+ **************************************************************************************/
+static std::string makeJpeg(size_t size, std::mt19937 &random)
+{
+    std::string jpeg = "\xFF\xD8";
+    appendSegment(jpeg, 0xE0, std::string("JFIF\0\x01\x01\0\0\x01\0\x01\0\0", 14));
+    appendSegment(jpeg, 0xE1, std::string("Exif\0\0\xFF\xD8\xFF\xDB\0\x04\0\0\xFF\xD9", 16));
+    appendSegment(jpeg, 0xDB, std::string(1, 0) + randomBytes(64, random));
+    appendSegment(jpeg, 0xC0, std::string("\x08\x01\0\x01\0\x03\x01\x22\0\x02\x11\x01\x03\x11\x01", 15));
+
+    const std::string scanHeader("\x03\x01\0\x02\x11\x03\x11\0\x3F\0", 10);
+    for (int scan = 0; scan < 2; ++scan)
+    {
+        appendSegment(jpeg, 0xDA, scanHeader);
+        size_t end = scan == 0 ? jpeg.size() + (size - std::min(size, jpeg.size())) / 2 : size - 2;
+        int restart = 0;
+        while (jpeg.size() < end)
+        {
+            unsigned char c = static_cast<unsigned char>(random());
+            jpeg += static_cast<char>(c);
+            if (c == 0xFF)
+            {
+                jpeg += '\0';
+            }
+            else if (c == 0x5A && jpeg.size() + 2 < end)
+            {
+                jpeg += "\xFF";
+                jpeg += static_cast<char>(0xD0 + restart++ % 8);
+            }
+        }
+    }
+    return jpeg + "\xFF\xD9";
+}
+
+// Appends a PNG chunk with its CRC-32 over the type and data
+static void appendChunk(std::string &png, const char *type, const std::string &data)
+{
+    char length[4];
+    char crc[4];
+    putBe32(length, data.size());
+    putBe32(crc, crc32Update(crc32Update(0, type, 4), data.data(), data.size()));
+    png.append(length, sizeof(length)).append(type, 4).append(data).append(crc, sizeof(crc));
+}
+
+/**************************************************************************************
+ * Function: makePng
+ * Description: Builds a PNG of a header, a text chunk, IDAT chunks of random data of
+ *              up to 64 KiB each and the IEND chunk.
+ * Parameters:
+ *    - size: The approximate size wanted, in bytes.
+ *    - random: The generator to draw the image data from.
+ * Returns:
+ *    - The PNG file.
+ **************************************************************************************/
+static std::string makePng(size_t size, std::mt19937 &random)
+{
+    std::string png = "\x89PNG\r\n\x1A\n";
+    char header[13] = {};
+    putBe32(header + 0, 640);
+    putBe32(header + 4, 480);
+    header[8] = 8;
+    header[9] = 2;
+    appendChunk(png, "IHDR", std::string(header, sizeof(header)));
+    appendChunk(png, "tEXt", std::string("Comment\0recovery bench", 22));
+
+    // Every chunk adds twelve bytes of length, type and CRC, and IEND is one more
+    while (png.size() + 24 < size)
+    {
+        size_t length = std::min<size_t>(size - png.size() - 24, 1 << 16);
+        appendChunk(png, "IDAT", randomBytes(length, random));
+    }
+    appendChunk(png, "IEND", std::string());
+    return png;
+}
+
+/**************************************************************************************
+ * Function: makeSqlite
+ * Description: Builds a SQLite database of 512-byte pages whose header gives the page
+ *              count, with the rest of every page random.
+ * Parameters:
+ *    - size: The approximate size wanted, in bytes; it is rounded up to whole pages.
+ *    - random: The generator to draw the header counters and pages from.
+ * Returns:
+ *    - The database file.
+ **************************************************************************************/
+static std::string makeSqlite(size_t size, std::mt19937 &random)
+{
+    const uint16_t pageSize = 512;
+    uint32_t pageCount = std::max<size_t>(1, (size + pageSize - 1) / pageSize);
+    std::string database = randomBytes(static_cast<size_t>(pageCount) * pageSize, random);
+
+    char *header = &database[0];
+    memcpy(header, "SQLite format 3\0", 16);
+    memset(header + 16, 0, 84);
+    putBe16(header + 16, pageSize);
+    header[18] = 1;
+    header[19] = 1;
+    header[21] = 64;
+    header[22] = 32;
+    header[23] = 32;
+    uint32_t changeCounter = random();
+    putBe32(header + 24, changeCounter);
+    putBe32(header + 28, pageCount);
+    putBe32(header + 44, 4);
+    putBe32(header + 56, 1);
+    putBe32(header + 92, changeCounter);
+    putBe32(header + 96, 3045000);
+    header[100] = 0x0D; // the schema table's root page, a table leaf
+    return database;
+}
+
+// Writes a deflate stream, least significant bit first
+class DeflateWriter
+{
+public:
+    DeflateWriter() : buffer(0), count(0) {}
+
+    void bits(uint32_t value, int length)
+    {
+        buffer |= value << count;
+        count += length;
+        for (; count >= 8; count -= 8, buffer >>= 8)
+        {
+            out += static_cast<char>(buffer & 0xFF);
+        }
+    }
+
+    // Huffman codes are packed starting from their most significant bit
+    void code(uint32_t value, int length)
+    {
+        while (length--)
+        {
+            bits((value >> length) & 1, 1);
+        }
+    }
+
+    void align()
+    {
+        if (count)
+        {
+            bits(0, 8 - count);
+        }
+    }
+
+    std::string out;
+
+private:
+    uint32_t buffer;
+    int count;
+};
+
+// A canonical Huffman code built from code lengths, as deflate defines it
+struct HuffmanCode
+{
+    explicit HuffmanCode(const std::vector<int> &lengths) : lengths(lengths), codes(lengths.size())
+    {
+        int next = 0;
+        for (int length = 1; length <= 15; ++length)
+        {
+            for (size_t symbol = 0; symbol < lengths.size(); ++symbol)
+            {
+                if (lengths[symbol] == length)
+                {
+                    codes[symbol] = next++;
+                }
+            }
+            next <<= 1;
+        }
+    }
+
+    void put(DeflateWriter &writer, int symbol) const { writer.code(codes[symbol], lengths[symbol]); }
+
+    std::vector<int> lengths;
+    std::vector<uint32_t> codes;
+};
+
+static const int lengthBase[29] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+static const int lengthExtra[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+static const int distanceBase[30] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+static const int distanceExtra[30] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+/**************************************************************************************
+ * Function: putSymbols
+ * Description: Writes random literals and back-references, then the end of block, until
+ *              the block has taken about budget bytes of output.
+ * Parameters:
+ *    - writer: The deflate stream.
+ *    - literals: The literal/length code of the block.
+ *    - distances: The distance code of the block.
+ *    - budget: How many bytes of output the block may take.
+ *    - plain: The last of the uncompressed data, extended with what the block decodes to.
+ *    - random: The generator to draw symbols from.
+ **************************************************************************************/
+static void putSymbols(DeflateWriter &writer, const HuffmanCode &literals, const HuffmanCode &distances, size_t budget,
+                       std::string &plain, std::mt19937 &random)
+{
+    size_t end = writer.out.size() + budget;
+    while (writer.out.size() < end)
+    {
+        if (plain.empty() || random() % 16)
+        {
+            unsigned char literal = static_cast<unsigned char>(random());
+            literals.put(writer, literal);
+            plain += static_cast<char>(literal);
+            continue;
+        }
+
+        int length = std::uniform_int_distribution<int>(3, 258)(random);
+        int distance = std::uniform_int_distribution<int>(1, std::min<size_t>(plain.size(), 32768))(random);
+        int l = std::upper_bound(lengthBase, lengthBase + 29, length) - lengthBase - 1;
+        int d = std::upper_bound(distanceBase, distanceBase + 30, distance) - distanceBase - 1;
+        literals.put(writer, 257 + l);
+        writer.bits(length - lengthBase[l], lengthExtra[l]);
+        distances.put(writer, d);
+        writer.bits(distance - distanceBase[d], distanceExtra[d]);
+        for (int i = 0; i < length; ++i)
+        {
+            plain += plain[plain.size() - distance];
+        }
+    }
+    literals.put(writer, 256);
+}
+
+/**************************************************************************************
+ * Function: makeGzip
+ * Description: Builds a gzip member whose deflate stream cycles through stored, fixed
+ *              Huffman and dynamic Huffman blocks of random literals and matches, and
+ *              ends in a stored block sized to reach the wanted size.
+ * Parameters:
+ *    - size: The approximate size wanted, in bytes.
+ *    - random: The generator to draw the data from.
+ * Returns:
+ *    - The gzip file.
+ **************************************************************************************/
+static std::string makeGzip(size_t size, std::mt19937 &random)
+{
+    std::vector<int> fixedLengths(288, 8);
+    std::fill(fixedLengths.begin() + 144, fixedLengths.begin() + 256, 9);
+    std::fill(fixedLengths.begin() + 256, fixedLengths.begin() + 280, 7);
+    HuffmanCode fixedLiterals(fixedLengths);
+    HuffmanCode fixedDistances(std::vector<int>(30, 5));
+
+    // A complete dynamic code of 286 literal/length and 30 distance symbols, its lengths
+    // sent with a code of lengths 4, 5, 8 and 9 only
+    std::vector<int> dynamicLengths(286, 9);
+    std::fill(dynamicLengths.begin(), dynamicLengths.begin() + 226, 8);
+    std::vector<int> distanceLengths(30, 5);
+    distanceLengths[0] = distanceLengths[1] = 4;
+    HuffmanCode dynamicLiterals(dynamicLengths);
+    HuffmanCode dynamicDistances(distanceLengths);
+    std::vector<int> lengthLengths(19, 0);
+    lengthLengths[4] = lengthLengths[5] = lengthLengths[8] = lengthLengths[9] = 2;
+    HuffmanCode lengthCode(lengthLengths);
+    static const int lengthOrder[12] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4};
+
+    DeflateWriter writer;
+    writer.out = std::string("\x1F\x8B\x08\x08\0\0\0\0\0\x03", 10) + "bench.bin" + '\0';
+    size_t budget = std::min<size_t>(16384, size / 8);
+
+    // Only the last 32 KiB of the uncompressed data is kept for matches to refer back to
+    std::string plain;
+    uint32_t crc = 0;
+    uint32_t plainSize = 0;
+    auto settle = [&](size_t keep)
+    {
+        size_t drop = plain.size() - std::min(keep, plain.size());
+        crc = crc32Update(crc, plain.data(), drop);
+        plainSize += drop;
+        plain.erase(0, drop);
+    };
+
+    for (int block = 0; block < 3 || writer.out.size() + 2 * budget < size; ++block)
+    {
+        settle(32768);
+        if (block % 3 == 0)
+        {
+            std::string data = randomBytes(budget, random);
+            writer.bits(0, 3);
+            writer.align();
+            char lengths[4];
+            put16(lengths, data.size());
+            put16(lengths + 2, ~data.size());
+            writer.out.append(lengths, sizeof(lengths)).append(data);
+            plain += data;
+        }
+        else if (block % 3 == 1)
+        {
+            writer.bits(2, 3);
+            putSymbols(writer, fixedLiterals, fixedDistances, budget, plain, random);
+        }
+        else
+        {
+            writer.bits(4, 3);
+            writer.bits(286 - 257, 5);
+            writer.bits(30 - 1, 5);
+            writer.bits(12 - 4, 4);
+            for (int i = 0; i < 12; ++i)
+            {
+                writer.bits(lengthLengths[lengthOrder[i]], 3);
+            }
+            for (size_t i = 0; i < dynamicLengths.size(); ++i)
+            {
+                lengthCode.put(writer, dynamicLengths[i]);
+            }
+            for (size_t i = 0; i < distanceLengths.size(); ++i)
+            {
+                lengthCode.put(writer, distanceLengths[i]);
+            }
+            putSymbols(writer, dynamicLiterals, dynamicDistances, budget, plain, random);
+        }
+    }
+
+    // The final stored block, then the CRC-32 and size of the uncompressed data
+    writer.bits(1, 3);
+    writer.align();
+    size_t used = writer.out.size() + 4 + 8;
+    std::string data = randomBytes(size > used ? std::min<size_t>(size - used, 65535) : 0, random);
+    char trailer[12];
+    put16(trailer, data.size());
+    put16(trailer + 2, ~data.size());
+    plain += data;
+    settle(0);
+    put32(trailer + 4, crc);
+    put32(trailer + 8, plainSize);
+    writer.out.append(trailer, 4).append(data).append(trailer + 4, 8);
+    return writer.out;
+}
+
+/**************************************************************************************
+ * Function: placeFile
+ * Description: Lays a file out on the image the way ext3 maps it: direct blocks, then
+ *              the single, double and triple indirect trees, as far as the file needs.
+ * Parameters:
+ *    - image: The image.
+ *    - data: The file contents.
+ *    - zeroTail: True to zero the rest of the last block instead of leaving junk.
+ * Returns:
+ *    - The file's first block.
+ **************************************************************************************/
+static uint32_t placeFile(Image &image, const std::string &data, bool zeroTail)
+{
+    size_t p = image.pointersPerBlock;
+    size_t blocks = (data.size() + image.blockSize - 1) / image.blockSize;
+    size_t next = 0;
+
+    // Direct blocks and the first indirect data block are one contiguous run
+    uint32_t start = image.allocRun(std::min<size_t>(blocks, 13));
+    for (; next < std::min<size_t>(blocks, 12); ++next)
+    {
+        image.putData(start + next, data, next * image.blockSize, zeroTail);
+    }
+    if (next == blocks)
+    {
+        return start;
+    }
+
+    bool needsDouble = blocks > 12 + p;
+    bool needsTriple = blocks > 12 + p + p * p;
+    uint32_t indirect = image.allocRun(needsDouble ? 2 : 1);
+
+    std::vector<uint32_t> pointers;
+    for (; next < std::min(blocks, 12 + p); ++next)
+    {
+        uint32_t block = next == 12 ? start + 12 : image.allocData();
+        image.putData(block, data, next * image.blockSize, zeroTail);
+        pointers.push_back(block);
+    }
+    image.putPointers(indirect, pointers);
+    if (!needsDouble)
+    {
+        return start;
+    }
+
+    // Fills one indirect block's worth of data blocks; the caller places the block
+    uint32_t tripleIndirect = 0;
+    std::function<uint32_t(size_t)> fillIndirect = [&](size_t limit) -> uint32_t
+    {
+        uint32_t block = image.allocRun(1);
+        std::vector<uint32_t> dataBlocks;
+        for (size_t i = 0; i < p && next < limit; ++i, ++next)
+        {
+            uint32_t dataBlock;
+            if (needsTriple && next == 12 + p + p * p - 1)
+            {
+                // The triple indirect block must directly follow the last double indirect data block
+                dataBlock = image.allocRun(2);
+                tripleIndirect = dataBlock + 1;
+            }
+            else
+            {
+                dataBlock = image.allocData();
+            }
+            image.putData(dataBlock, data, next * image.blockSize, zeroTail);
+            dataBlocks.push_back(dataBlock);
+        }
+        image.putPointers(block, dataBlocks);
+        return block;
+    };
+
+    pointers.clear();
+    while (next < std::min(blocks, 12 + p + p * p))
+    {
+        pointers.push_back(fillIndirect(12 + p + p * p));
+    }
+    image.putPointers(indirect + 1, pointers);
+    if (!needsTriple)
+    {
+        return start;
+    }
+
+    std::vector<uint32_t> doubleIndirects;
+    while (next < blocks)
+    {
+        uint32_t doubleIndirect = image.allocRun(1);
+        pointers.clear();
+        for (size_t i = 0; i < p && next < blocks; ++i)
+        {
+            pointers.push_back(fillIndirect(blocks));
+        }
+        image.putPointers(doubleIndirect, pointers);
+        doubleIndirects.push_back(doubleIndirect);
+    }
+    image.putPointers(tripleIndirect, doubleIndirects);
+    return start;
+}
+
+// Builds a file of each format, indexed by FileFormat
+static std::string (*const makeFile[FormatCount])(size_t, std::mt19937 &) = {makeZip, makePdf, makeJpeg, makePng, makeSqlite, makeGzip};
+
+// The size of a file needing each layout, in blocks
+static size_t blocksForLayout(const std::string &layout, size_t p, std::mt19937 &random)
+{
+    if (layout == "direct")
+        return std::uniform_int_distribution<size_t>(2, 12)(random);
+    if (layout == "single")
+        return std::uniform_int_distribution<size_t>(14, 12 + p)(random);
+    if (layout == "double")
+        return std::uniform_int_distribution<size_t>(13 + p, 12 + p + 4 * p)(random);
+    if (layout == "triple")
+        return std::uniform_int_distribution<size_t>(13 + p + p * p, 12 + p + p * p + 4 * p)(random);
+    return 0;
+}
+
+static void usage()
+{
+    std::cerr << "Usage: genimage [--block-size 1024|2048|4096] [--image-mib N] [--fragmentation 0..1]\n"
+                 "                [--seed N] [--formats all|zip,pdf,...] [--layouts direct,single,double,triple] <image>\n";
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    Options options;
+    options.blockSize = 1024;
+    options.imageMiB = 640;
+    options.fragmentation = 0.05;
+    options.seed = 1;
+    std::string formats = "all";
+    std::string layouts = "direct,single,double,triple";
+    std::string imagePath;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        if (i + 1 < argc && arg == "--block-size")
+            options.blockSize = atoi(argv[++i]);
+        else if (i + 1 < argc && arg == "--image-mib")
+            options.imageMiB = atoi(argv[++i]);
+        else if (i + 1 < argc && arg == "--fragmentation")
+            options.fragmentation = atof(argv[++i]);
+        else if (i + 1 < argc && arg == "--seed")
+            options.seed = strtoul(argv[++i], 0, 10);
+        else if (i + 1 < argc && arg == "--formats")
+            formats = argv[++i];
+        else if (i + 1 < argc && arg == "--layouts")
+            layouts = argv[++i];
+        else if (arg[0] != '-' && imagePath.empty())
+            imagePath = arg;
+        else
+            usage();
+    }
+
+    std::string error;
+    if (!parseFormats(formats, options.formats, error))
+    {
+        std::cerr << (error.empty() ? "No file formats given." : error) << "\n";
+        return 1;
+    }
+    if (imagePath.empty() || (options.blockSize != 1024 && options.blockSize != 2048 && options.blockSize != 4096) ||
+        options.imageMiB <= 0 || options.fragmentation < 0 || options.fragmentation > 1)
+    {
+        usage();
+    }
+
+    for (size_t pos = 0; pos <= layouts.size();)
+    {
+        size_t comma = std::min(layouts.find(',', pos), layouts.size());
+        options.layouts.push_back(layouts.substr(pos, comma - pos));
+        pos = comma + 1;
+    }
+
+    Image image(options);
+    std::mt19937 random(options.seed);
+    std::vector<PlacedFile> files;
+
+    for (size_t i = 0; i < options.formats.size() * options.layouts.size(); ++i)
+    {
+        FileFormat format = options.formats[i / options.layouts.size()];
+        const std::string &layout = options.layouts[i % options.layouts.size()];
+        size_t blocks = blocksForLayout(layout, image.pointersPerBlock, random);
+        if (blocks == 0)
+        {
+            std::cerr << "Unknown layout " << layout << ".\n";
+            return 1;
+        }
+
+        // End partway into the last block, far enough from either edge that the format's
+        // overhead cannot move the file into another layout
+        size_t size = (blocks - 1) * image.blockSize + std::uniform_int_distribution<int>(300, image.blockSize - 300)(random);
+        std::string data = makeFile[format](size, random);
+
+        PlacedFile file;
+        file.format = format;
+        file.layout = layout;
+        file.size = data.size();
+        // Slack after a PDF is zeroed, since junk there can pass for an incremental update
+        file.startBlock = placeFile(image, data, format == Pdf);
+        file.originalPath = imagePath + "." + std::to_string(i) + formatTable[format].extension;
+        files.push_back(file);
+
+        std::ofstream original(file.originalPath.c_str(), std::ios::binary | std::ios::trunc);
+        original.write(data.data(), data.size());
+        image.liveGap(64);
+    }
+
+    if (!image.write(imagePath))
+    {
+        std::cerr << "Failed to write " << imagePath << ".\n";
+        return 1;
+    }
+
+    std::ofstream manifest((imagePath + ".manifest").c_str(), std::ios::trunc);
+    manifest << "# format layout start-block size original\n";
+    for (size_t i = 0; i < files.size(); ++i)
+    {
+        manifest << formatTable[files[i].format].name << " " << files[i].layout << " " << files[i].startBlock << " " << files[i].size << " " << files[i].originalPath << "\n";
+        std::cout << formatTable[files[i].format].name << " " << files[i].layout << ": " << files[i].size << " bytes at block " << files[i].startBlock << "\n";
+    }
+
+    std::cout << "Wrote " << imagePath << ": " << options.imageMiB << " MiB, " << image.blockSize << "-byte blocks, "
+              << files.size() << " deleted files\n";
+    return 0;
+}
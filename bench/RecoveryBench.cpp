@@ -0,0 +1,433 @@
+#include <iostream>
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "BatchRecovery.h"
+#include "BlockCache.h"
+#include "BlockIO.h"
+#include "BlockRecovery.h"
+#include "Ext2FileSystem.h"
+#include "FileGlue.h"
+#include "FormatCarver.h"
+#include "IndirectIndex.h"
+#include "SignatureScanner.h"
+
+// Times the scan, resolve and copy stages of recovery on an image from genimage, and
+// checks every recovered file byte-for-byte against the original the generator kept.
+// The batch pipeline then recovers the image once more and is checked the same way.
+
+static const int benchCacheSize = 1024;
+static const int benchQueueDepth = 32;
+
+struct ManifestEntry
+{
+    FileFormat format;
+    std::string layout;
+    BlockNumber startBlock;
+    off_t size;
+    std::string originalPath;
+};
+
+// Seconds taken by each stage in one run
+struct StageTimes
+{
+    double scan;
+    double index;
+    std::vector<double> resolve;
+    std::vector<double> copy;
+};
+
+typedef std::chrono::steady_clock Clock;
+
+static double secondsSince(Clock::time_point start)
+{
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+static double median(std::vector<double> values)
+{
+    std::sort(values.begin(), values.end());
+    return values.empty() ? 0 : values[values.size() / 2];
+}
+
+/**************************************************************************************
+ * Function: readManifest
+ * Description: Reads the list of deleted files genimage placed on an image.
+ * Parameters:
+ *    - path: The manifest, <image>.manifest.
+ *    - entries: Receives one entry per file.
+ * Returns:
+ *    - True if the manifest was read.
+ **************************************************************************************/
+static bool readManifest(const std::string &path, std::vector<ManifestEntry> &entries)
+{
+    std::ifstream in(path.c_str());
+    std::string line;
+    while (std::getline(in, line))
+    {
+        if (line.empty() || line[0] == '#')
+        {
+            continue;
+        }
+
+        std::istringstream fields(line);
+        ManifestEntry entry;
+        std::string formatName;
+        std::vector<FileFormat> formats;
+        std::string error;
+        if (!(fields >> formatName >> entry.layout >> entry.startBlock >> entry.size >> entry.originalPath) ||
+            !parseFormats(formatName, formats, error) || formats.size() != 1)
+        {
+            return false;
+        }
+        entry.format = formats[0];
+        entries.push_back(entry);
+    }
+    return !entries.empty();
+}
+
+/**************************************************************************************
+ * Function: resolve
+ * Description: Builds a file's block list with the same contiguity heuristic as the
+ *              recovery program: twelve direct blocks, the indirect block found through
+ *              the index, then the double and triple indirect blocks that follow it.
+ * Parameters:
+ *    - cache: The block cache to read the image through.
+ *    - indirectIndex: The indirect block candidates on the image.
+ *    - startBlock: The first block of the file.
+ * Returns:
+ *    - The file's blocks.
+ **************************************************************************************/
+static ExtentList resolve(BlockCache &cache, const IndirectIndex &indirectIndex, BlockNumber startBlock)
+{
+    const BlockDevice &device = cache.device();
+    ExtentList blocks = BlockRecovery::findDirectBlocks(device, startBlock, 12);
+    if (blocks.blockCount() < 12)
+    {
+        return blocks;
+    }
+
+    // Short files are followed by unrelated data, so a missing indirect block just
+    // means the file ends in its direct blocks
+    BlockNumber indirectBlock = indirectIndex.find(blocks.lastBlock() + 1);
+    if (indirectBlock == -1)
+    {
+        return blocks;
+    }
+
+    bool indirectFull;
+    blocks.append(BlockRecovery::getBlockNumbersFromIndirect(cache, indirectBlock, &indirectFull));
+    if (!indirectFull)
+    {
+        return blocks;
+    }
+
+    bool doubleIndirectFull;
+    ExtentList blocksFromDoubleIndirect = BlockRecovery::findDoubleIndirectBlocks(cache, indirectBlock + 1, &doubleIndirectFull);
+    blocks.append(blocksFromDoubleIndirect);
+    if (doubleIndirectFull && !blocksFromDoubleIndirect.empty())
+    {
+        blocks.append(BlockRecovery::findTripleIndirectBlocks(cache, blocksFromDoubleIndirect.lastBlock() + 1));
+    }
+    return blocks;
+}
+
+/**************************************************************************************
+ * Function: copy
+ * Description: Copies a resolved file to outputPath in elevator order, then cuts it
+ *              where its format's end detector finds the end.
+ * Parameters:
+ *    - device: The image.
+ *    - reader: The reader for blocks that cannot be copied in the kernel.
+ *    - format: The file's format.
+ *    - blocks: The file's blocks.
+ *    - outputPath: The file to write.
+ *    - endFound: Set to whether the end detector found the file's end, rather than the
+ *                file being cut after its last non-zero byte.
+ * Returns:
+ *    - The size of the recovered file, or -1 if it could not be written.
+ **************************************************************************************/
+static off_t copy(const BlockDevice &device, AsyncBlockReader &reader, FileFormat format, const ExtentList &blocks,
+                  const std::string &outputPath, bool *endFound)
+{
+    int out_fd = open(outputPath.c_str(), O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    if (out_fd == -1)
+    {
+        return -1;
+    }
+
+    OutputWriter writer(out_fd, OutputWriter::NoSync);
+    if (copyScheduled(device, blocks, 0, writer, reader) != blocks.blockCount())
+    {
+        writer.close();
+        return -1;
+    }
+    std::unique_ptr<EndDetector> end = makeEndDetector(format);
+    *endFound = detectEnd(*end, writer, 0, writer.offset());
+    off_t fileSize = *endFound ? end->fileSize() : writer.offset();
+    writer.truncate(fileSize);
+    writer.close();
+    return fileSize;
+}
+
+/**************************************************************************************
+ * Function: compareFiles
+ * Description: Compares two files byte for byte.
+ * Parameters:
+ *    - recoveredPath: The recovered file.
+ *    - originalPath: The original file.
+ * Returns:
+ *    - An empty string if they match, otherwise where they differ.
+ **************************************************************************************/
+static std::string compareFiles(const std::string &recoveredPath, const std::string &originalPath)
+{
+    std::ifstream recovered(recoveredPath.c_str(), std::ios::binary);
+    std::ifstream original(originalPath.c_str(), std::ios::binary);
+    if (!recovered || !original)
+    {
+        return "cannot open files";
+    }
+
+    std::vector<char> a(1 << 20);
+    std::vector<char> b(1 << 20);
+    off_t offset = 0;
+    for (;;)
+    {
+        recovered.read(a.data(), a.size());
+        original.read(b.data(), b.size());
+        std::streamsize got = recovered.gcount();
+        std::streamsize want = original.gcount();
+
+        std::streamsize same = 0;
+        while (same < std::min(got, want) && a[same] == b[same])
+        {
+            ++same;
+        }
+        if (same < std::min(got, want))
+        {
+            return "differs at byte " + std::to_string(offset + same);
+        }
+        if (got != want)
+        {
+            return got < want ? "short by " + std::to_string(want - got) + "+ bytes"
+                              : "too long, original ends at byte " + std::to_string(offset + want);
+        }
+        if (got == 0)
+        {
+            return "";
+        }
+        offset += got;
+    }
+}
+
+/**************************************************************************************
+ * Function: checkBatch
+ * Description: Recovers the image once more with the batch pipeline and compares every
+ *              file it wrote with its original, so batch mode is held to the same
+ *              results as the timed single-file path.
+ * Parameters:
+ *    - device: The image.
+ *    - allocatedBlocks: The blocks in use on the image, which the scan skips.
+ *    - formats: The formats of the deleted files, all recovered in one batch.
+ *    - files: The deleted files on the image.
+ *    - outputDirectory: The directory the batch writes to.
+ * Returns:
+ *    - The number of files that were not recovered intact.
+ **************************************************************************************/
+static int checkBatch(const BlockDevice &device, const BlockBitmap *allocatedBlocks, const std::vector<FileFormat> &formats,
+                      const std::vector<ManifestEntry> &files, const std::string &outputDirectory)
+{
+    // Files left by an earlier bench must not stand in for ones this batch skips
+    mkdir(outputDirectory.c_str(), S_IRWXU);
+    for (size_t i = 0; i < files.size(); ++i)
+    {
+        unlink((outputDirectory + "/" + std::to_string(files[i].startBlock) + formatTable[files[i].format].extension).c_str());
+    }
+
+    BatchRecovery batch(device, formats, outputDirectory);
+    batch.skipBlocks(allocatedBlocks);
+    batch.finalizeWith(finalizeFile);
+    batch.run();
+
+    int failures = 0;
+    for (size_t i = 0; i < files.size(); ++i)
+    {
+        std::string outputPath = outputDirectory + "/" + std::to_string(files[i].startBlock) + formatTable[files[i].format].extension;
+        std::string mismatch = compareFiles(outputPath, files[i].originalPath);
+        std::cout << "batch " << std::left << std::setw(7) << formatTable[files[i].format].name << std::setw(7) << files[i].layout
+                  << std::right << std::setw(12) << files[i].size << " bytes  "
+                  << (mismatch.empty() ? "OK" : "FAIL: " + mismatch) << "\n";
+        if (!mismatch.empty())
+        {
+            ++failures;
+        }
+    }
+    return failures;
+}
+
+static void printStage(const char *name, double seconds, double bytes, const std::vector<double> &latencies)
+{
+    std::cout << std::left << std::setw(9) << name << std::right << std::fixed << std::setprecision(1)
+              << std::setw(10) << (seconds > 0 ? bytes / seconds / 1e6 : 0) << " MB/s"
+              << std::setprecision(3) << std::setw(11) << seconds * 1e3 << " ms";
+    if (!latencies.empty())
+    {
+        std::cout << std::setw(11) << median(latencies) * 1e3 << " ms/file (median)"
+                  << std::setw(11) << *std::max_element(latencies.begin(), latencies.end()) * 1e3 << " ms/file (max)";
+    }
+    std::cout << "\n";
+}
+
+int main(int argc, char *argv[])
+{
+    int runs = 3;
+    std::string imagePath;
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        if (arg == "--runs" && i + 1 < argc)
+            runs = std::max(1, atoi(argv[++i]));
+        else if (imagePath.empty())
+            imagePath = arg;
+    }
+    if (imagePath.empty())
+    {
+        std::cerr << "Usage: recoverybench [--runs N] <image from genimage>\n";
+        return 1;
+    }
+
+    std::vector<ManifestEntry> files;
+    if (!readManifest(imagePath + ".manifest", files))
+    {
+        std::cerr << "Failed to read " << imagePath << ".manifest.\n";
+        return 1;
+    }
+
+    BlockDevice device(imagePath, 4096);
+    Ext2FileSystem fileSystem;
+    if (!fileSystem.load(device))
+    {
+        std::cerr << "No ext2/ext3 file system on " << imagePath << ".\n";
+        return 1;
+    }
+    const BlockBitmap *allocatedBlocks = &fileSystem.allocatedBlocks();
+    double freeBytes = static_cast<double>(fileSystem.freeBlockCount()) * fileSystem.blockSize();
+
+    // Every format on the image is scanned for at once, as --formats would
+    std::vector<FileFormat> formats;
+    for (size_t i = 0; i < files.size(); ++i)
+    {
+        if (std::find(formats.begin(), formats.end(), files[i].format) == formats.end())
+        {
+            formats.push_back(files[i].format);
+        }
+    }
+    SignatureScanner scanner(formats);
+
+    std::vector<StageTimes> results;
+    int failures = 0;
+
+    for (int run = 0; run < runs; ++run)
+    {
+        StageTimes times;
+
+        Clock::time_point start = Clock::now();
+        BlockClassMap classes;
+        std::vector<SignatureHit> hits = scanner.scan(device, 0, &classes, allocatedBlocks);
+        times.scan = secondsSince(start);
+
+        start = Clock::now();
+        IndirectIndex indirectIndex = IndirectIndex::build(device, classes);
+        times.index = secondsSince(start);
+
+        BlockCache cache(device, benchCacheSize);
+        AsyncBlockReader reader(device, benchQueueDepth);
+        for (size_t i = 0; i < files.size(); ++i)
+        {
+            const ManifestEntry &file = files[i];
+            bool found = false;
+            for (size_t h = 0; h < hits.size() && !found; ++h)
+            {
+                found = hits[h].blockNumber == file.startBlock && scanner.format(hits[h].signatureIndex) == file.format;
+            }
+
+            start = Clock::now();
+            ExtentList blocks = resolve(cache, indirectIndex, file.startBlock);
+            times.resolve.push_back(secondsSince(start));
+
+            std::string outputPath = imagePath + "." + std::to_string(i) + ".out";
+            start = Clock::now();
+            bool endFound = false;
+            off_t recoveredSize = copy(device, reader, file.format, blocks, outputPath, &endFound);
+            times.copy.push_back(secondsSince(start));
+
+            // Correctness is checked on the first run only; later runs just repeat the timing
+            if (run == 0)
+            {
+                std::string mismatch = !found ? "start block not found by the scan"
+                                     : recoveredSize < 0 ? "cannot write " + outputPath
+                                     : !endFound         ? "end not found by the " + std::string(formatTable[file.format].name) + " end detector"
+                                                         : compareFiles(outputPath, file.originalPath);
+                std::cout << std::left << std::setw(7) << formatTable[file.format].name << std::setw(7) << file.layout
+                          << std::right << std::setw(12) << file.size << " bytes "
+                          << std::setw(7) << blocks.extentCount() << " extents  " << (mismatch.empty() ? "OK" : "FAIL: " + mismatch) << "\n";
+                if (!mismatch.empty())
+                {
+                    ++failures;
+                }
+            }
+        }
+        results.push_back(times);
+    }
+    failures += checkBatch(device, allocatedBlocks, formats, files, imagePath + ".batch");
+
+    // Report the run with the median total time, so one slow run does not skew the table
+    std::vector<std::pair<double, size_t> > totals;
+    for (size_t r = 0; r < results.size(); ++r)
+    {
+        double total = results[r].scan + results[r].index;
+        for (size_t i = 0; i < files.size(); ++i)
+        {
+            total += results[r].resolve[i] + results[r].copy[i];
+        }
+        totals.push_back(std::make_pair(total, r));
+    }
+    std::sort(totals.begin(), totals.end());
+    const StageTimes &typical = results[totals[totals.size() / 2].second];
+
+    double fileBytes = 0;
+    for (size_t i = 0; i < files.size(); ++i)
+    {
+        fileBytes += files[i].size;
+    }
+    double resolveTime = 0;
+    double copyTime = 0;
+    for (size_t i = 0; i < files.size(); ++i)
+    {
+        resolveTime += typical.resolve[i];
+        copyTime += typical.copy[i];
+    }
+
+    std::cout << "\n" << imagePath << ": " << fileSystem.blockSize() << "-byte blocks, " << freeBytes / 1e6
+              << " MB free, median of " << runs << " runs\n";
+    printStage("scan", typical.scan, freeBytes, std::vector<double>());
+    printStage("index", typical.index, freeBytes, std::vector<double>());
+    printStage("resolve", resolveTime, fileBytes, typical.resolve);
+    printStage("copy", copyTime, fileBytes, typical.copy);
+
+    if (failures)
+    {
+        std::cerr << failures << " of " << 2 * files.size() << " recovered files did not match their originals.\n";
+        return 1;
+    }
+    std::cout << "All " << files.size() << " files match their originals, in single-file and batch mode.\n";
+    return 0;
+}
@@ -1,161 +1,37 @@
-#include "BlockIO.h"
-#include "BlockRecovery.h"
-#include "FileGlue.cpp"
+#include <iostream>
+#include <fstream>
+#include <sys/stat.h>
+#include "RecoveryEngine.h"
+#include "RunStats.h"
 
-// Function to open the USB device and return the file descriptor
-int openUSBDevice(const std::string &devicePath)
-{
-    int usb_fd = open(devicePath.c_str(), O_RDONLY);
-    if (usb_fd == -1)
-    {
-        std::cerr << "Failed to open USB device.\n";
-        exit(1);
-    }
-    return usb_fd;
-}
+// Seconds between progress lines on stderr
+const int progressInterval = 5;
 
-// Function to open the output file and return the file descriptor
-int openOutputFile(const std::string &outputPath)
+// Function to print why a recovery failed, returning the exit code
+int reportFailure(const RecoveryStatus &status)
 {
-    int out_fd = open(outputPath.c_str(), O_WRONLY | O_CREAT, S_IRUSR | S_IWUSR);
-    if (out_fd == -1)
-    {
-        std::cerr << "Failed to open output file.\n";
-        exit(1);
-    }
-    return out_fd;
+    std::cerr << status.message << "\n";
+    return 1;
 }
 
-// Function to recover the file from the USB device
-void recoverFile(const std::string &usbDevicePath, const std::string &outputPath, const std::string &fileTypeSignature)
+// Function to write the run's counters and phase times as JSON to a file, or to stdout for "-"
+bool writeStats(const std::string &path)
 {
-    int blockSize = 4096;
-    char buffer[4096];
-    int usb_fd = openUSBDevice(usbDevicePath);
-    int out_fd = openOutputFile(outputPath);
-
-    const unsigned char *signature = reinterpret_cast<const unsigned char *>(fileTypeSignature.c_str());
-    int startBlock = BlockRecovery::findFirstBlockOfType(usb_fd, fileTypeSignature);
-
-    std::vector<int> directBlocks = BlockRecovery::findDirectBlocks(usb_fd, startBlock, 4096, 12);
-    std::vector<int> totalBlocks = directBlocks;
-
-    // Write the direct blocks to the output file
-    for (int i = 0; i < directBlocks.size(); ++i)
+    if (path == "-")
     {
-        int block = directBlocks[i];
-        std::cout << "\ti_block[" << i << "] = " << block << "\n";
+        RunStats::writeJson(std::cout);
         std::cout.flush();
-
-        ssize_t bytesRead = readBlock(usb_fd, block, buffer, 4096);
-        if (bytesRead < 0)
-        {
-            std::cerr << "Failed to read direct block " << block << " from USB device.\n";
-            exit(1);
-        }
-
-        writeBlock(out_fd, buffer, 4096);
-    }
-
-    // Get indirect block if exists
-    int indirectBlock;
-    if (directBlocks.size() == 12 && directBlocks.back() != '0')
-    {
-        indirectBlock = BlockRecovery::findIndirectBlock(usb_fd, startBlock, blockSize, directBlocks.back() + 1);
-        std::cout << "\ti_block[12] = " << indirectBlock << "\n";
-
-        std::vector<int> directBlockNumbers = BlockRecovery::getBlockNumbersFromIndirect(usb_fd, indirectBlock, blockSize);
-
-        // Write the indirect blocks to the output file
-        for (int i = 0; i < directBlockNumbers.size(); ++i)
-        {
-            int block = directBlockNumbers[i];
-
-            if (block == 0)
-                continue;
-
-            ssize_t bytesRead = readBlock(usb_fd, block, buffer, 4096);
-            if (bytesRead < 0)
-            {
-                std::cerr << "Failed to read direct block " << block << " from USB device.\n";
-                exit(1);
-            }
-            writeBlock(out_fd, buffer, 4096);
-            totalBlocks.push_back(block);
-        }
-
-        // Get and write double indirect blocks
-        if (directBlockNumbers[directBlockNumbers.size() - 1] != 0)
-        {
-            std::cout << "\ti_block[13] = " << (indirectBlock + 1) << "\n";
-            std::vector<int> blocksFromDoubleIndirect = BlockRecovery::findDoubleIndirectBlocks(usb_fd, indirectBlock + 1, 4096);
-            for (int i = 0; i < blocksFromDoubleIndirect.size(); ++i)
-            {
-                int block = blocksFromDoubleIndirect[i];
-
-                if (block == 0)
-                    continue;
-
-                ssize_t bytesRead = readBlock(usb_fd, block, buffer, 4096);
-                if (bytesRead < 0)
-                {
-                    std::cerr << "Failed to read direct block " << block << " from USB device.\n";
-                    exit(1);
-                }
-                writeBlock(out_fd, buffer, 4096);
-                totalBlocks.push_back(block);
-            }
-
-            // Write the triple indirect blocks
-            if (blocksFromDoubleIndirect.back() != 0)
-            {
-                std::cout << "\ti_block[14] = " << (indirectBlock + 2) << "\n";
-                std::vector<int> tripleIndirectBlocks = BlockRecovery::findTripleIndirectBlocks(usb_fd, blocksFromDoubleIndirect.back() + 1, blockSize);
-
-                for (int i = 0; i < tripleIndirectBlocks.size(); ++i)
-                {
-                    int block = tripleIndirectBlocks[i];
-
-                    if (block == 0)
-                        continue;
-
-                    ssize_t bytesRead = readBlock(usb_fd, block, buffer, 4096);
-                    if (bytesRead < 0)
-                    {
-                        std::cerr << "Failed to read direct block " << block << " from USB device.\n";
-                        exit(1);
-                    }
-                    writeBlock(out_fd, buffer, 4096);
-                    totalBlocks.push_back(block);
-                }
-            }
-            else
-                std::cout << "\ti_block[14] = 0\n";
-        }
-        else
-        {
-            std::cout << "\ti_block[13] = 0\n";
-            std::cout << "\ti_block[14] = 0\n";
-        }
-    }
-    else
-    {
-        std::cout << "\ti_block[12] = 0\n";
-        std::cout << "\ti_block[13] = 0\n";
-        std::cout << "\ti_block[14] = 0\n";
+        return true;
     }
 
-    // once data has been written, finalize file and remove any trailing 0s
-    off_t fileSize = finalizeFile(totalBlocks, 4096, usb_fd, out_fd);
-
-    if (ftruncate(out_fd, fileSize) != 0)
+    std::ofstream out(path.c_str(), std::ios::trunc);
+    RunStats::writeJson(out);
+    if (!out.good())
     {
-        std::cerr << "Failed to set file size on output file.\n";
-        exit(1);
+        std::cerr << "Failed to write stats to " << path << ".\n";
+        return false;
     }
-
-    close(usb_fd);
-    close(out_fd);
+    return true;
 }
 
 bool setFilePermissions(const std::string &filePath)
@@ -169,8 +45,27 @@ bool setFilePermissions(const std::string &filePath)
     return true;
 }
 
-int main()
+// Function to run the recovery the arguments ask for, returning the exit code
+int recover(const std::vector<std::string> &args, const RecoveryOptions &options)
 {
+    // Batch mode: program --batch <device> <output directory>
+    if (args.size() == 3 && args[0] == "--batch")
+    {
+        std::cout << "Batch recovery started.\n\n";
+        RecoveryEngine engine(args[1], options);
+        BatchResult result = engine.recoverAll(args[2]);
+        return result.status.ok() ? 0 : reportFailure(result.status);
+    }
+
+    // Stream mode: program --stream <input or -> <output directory>
+    if (args.size() == 3 && args[0] == "--stream")
+    {
+        std::cout << "Stream carving started.\n\n";
+        RecoveryEngine engine(args[1], options);
+        BatchResult result = engine.recoverStream(args[2]);
+        return result.status.ok() ? 0 : reportFailure(result.status);
+    }
+
     bool inProduction = true;
 
     std::string usbDevicePath;
@@ -190,10 +85,13 @@ int main()
         outputPath = "/home/codedred/Desktop/FinalProject/outfile.pptx";
     }
 
-    std::string fileTypeSignature = "\x50\x4B\x03\x04";
-
     std::cout << "File recovery started.\n\n";
-    recoverFile(usbDevicePath, outputPath, fileTypeSignature);
+    RecoveryEngine engine(usbDevicePath, options);
+    RecoveredFile result = engine.recoverFile(outputPath);
+    if (!result.status.ok())
+    {
+        return reportFailure(result.status);
+    }
 
     if (setFilePermissions(outputPath))
     {
@@ -203,3 +101,47 @@ int main()
     std::cout << "File copying completed.\n";
     return 0;
 }
+
+int main(int argc, char *argv[])
+{
+    RecoveryOptions options;
+    std::string statsPath;
+
+    // --formats <list> picks the formats to recover, e.g. "zip,pdf" or "all" (default "zip")
+    // --index <file> saves the device scan so later runs can skip it
+    // --stats <file> writes counters and phase times as JSON at the end ("-" for stdout)
+    // --direct reads the device with O_DIRECT so the scan does not fill the page cache
+    std::vector<std::string> args;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (std::string(argv[i]) == "--formats" && i + 1 < argc)
+        {
+            std::string error;
+            if (!parseFormats(argv[++i], options.formats, error))
+            {
+                std::cerr << error << "\nKnown formats:";
+                for (int format = 0; format < FormatCount; ++format)
+                    std::cerr << " " << formatTable[format].name;
+                std::cerr << " (or all)\n";
+                return 1;
+            }
+        }
+        else if (std::string(argv[i]) == "--index" && i + 1 < argc)
+            options.indexPath = argv[++i];
+        else if (std::string(argv[i]) == "--stats" && i + 1 < argc)
+            statsPath = argv[++i];
+        else if (std::string(argv[i]) == "--direct")
+            options.directIO = true;
+        else
+            args.push_back(argv[i]);
+    }
+    RunStats::startProgress(progressInterval, std::cerr);
+    int exitCode = recover(args, options);
+    RunStats::stopProgress();
+
+    if (!statsPath.empty())
+    {
+        writeStats(statsPath);
+    }
+    return exitCode;
+}